@@ -99,6 +99,10 @@ void Socket::send(const file_tags *tags)
 	send(true); send(tags->title); send(tags->artist);
 	send(tags->album); send(tags->track);
 	send(tags->time); send(tags->rating);
+	send(tags->album_artist); send(tags->codec);
+	send(tags->disc); send(tags->bitrate);
+	send(tags->rate); send(tags->channels);
+	send(tags->track_gain); send(tags->album_gain);
 	G.done();
 }
 file_tags *Socket::get_tags()
@@ -110,6 +114,10 @@ file_tags *Socket::get_tags()
 		get(tags->title); get(tags->artist);
 		get(tags->album); get(tags->track);
 		get(tags->time);  get(tags->rating);
+		get(tags->album_artist); get(tags->codec);
+		get(tags->disc); get(tags->bitrate);
+		get(tags->rate); get(tags->channels);
+		get(tags->track_gain); get(tags->album_gain);
 	}
 	catch (...)
 	{
@@ -218,6 +226,44 @@ std::set<str> Socket::get_str_set()
 	return ret;
 }
 
+/* Paths go as runs of a directory (with the trailing slash) followed by the
+ * names in it and "". The list ends with "" in place of a directory. Names
+ * can't be empty, so only paths of files with a directory part work. */
+void Socket::send_paths(const strings &paths)
+{
+	BufferGuard G(*this);
+	str dir;
+	for (auto &p : paths)
+	{
+		auto i = p.rfind('/');
+		if (i == str::npos || i+1 == p.length()) { assert(false); continue; }
+		if (dir.length() != i+1 || p.compare(0, i+1, dir))
+		{
+			if (!dir.empty()) send("");
+			dir = p.substr(0, i+1);
+			send(dir);
+		}
+		send(p.substr(i+1));
+	}
+	if (!dir.empty()) send("");
+	send("");
+	G.done();
+}
+strings Socket::get_paths()
+{
+	strings ret;
+	while (true)
+	{
+		str dir = get_str(); if (dir.empty()) break;
+		while (true)
+		{
+			str name = get_str(); if (name.empty()) break;
+			ret.push_back(dir + name);
+		}
+	}
+	return ret;
+}
+
 
 /* Send the first event from the queue and remove it on success.  If the
  * operation would block return NB_IO_BLOCK.  Return NB_IO_ERR on error
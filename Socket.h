@@ -53,6 +53,7 @@ public:
 		SOCKET_DEBUG(">>> buffering done (#%d)", (int)packets.size());
 	}
 	size_t pending() const { return packets.size(); }
+	size_t buffered() const { return buf.size(); } // of the packet being made
 	bool send_next_packet_noblock(); // true:packet sent, false:would block or nothing to send
 
 	template<typename T> void send(T* x) { send((const T*)x); }
@@ -79,6 +80,9 @@ public:
 	void send(const std::set<str>    &idx); std::set<str>     get_str_set();
 	void send(const std::map<str,str> &ch); std::map<str,str> get_str_map();
 
+	// List of paths, grouped by directory so it is not sent over and over
+	void send_paths(const strings &paths); strings get_paths();
+
 	template<typename T> void get(T &x) {
 		static_assert(std::is_integral<T>::value, "Integral required.");
 		read(&x, sizeof(T));
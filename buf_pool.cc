@@ -0,0 +1,116 @@
+#include <sys/mman.h>
+#include "buf_pool.h"
+
+#define MIN_SHIFT	16		/* smallest class: 64KB */
+#define MAX_SHIFT	40
+#define HUGE_PAGE	(2 * 1024 * 1024)
+
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<char *> free_bufs[MAX_SHIFT + 1];	/* by class */
+static buf_pool_stats stats;
+static bool closing = false;	/* buf_pool_cleanup() was called */
+
+static int class_of (const size_t size)
+{
+	int shift = MIN_SHIFT;
+
+	while (((size_t)1 << shift) < size) shift++;
+	if (shift > MAX_SHIFT) fatal ("Buffer of %zu bytes is too big!", size);
+
+	return shift;
+}
+
+static char *map (const size_t size)
+{
+	void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	/* only works with huge pages reserved by the administrator */
+	if (size >= HUGE_PAGE)
+		p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+	if (p == MAP_FAILED) {
+		p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) fatal ("Can't allocate memory!");
+#ifdef MADV_HUGEPAGE
+		if (size >= HUGE_PAGE) madvise (p, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	return (char *)p;
+}
+
+static void unmap (char *buf, const size_t size)
+{
+	if (munmap (buf, size)) log_errno ("munmap() failed", errno);
+}
+
+/* Get a buffer of at least size bytes. */
+char *buf_pool_get (size_t size)
+{
+	const int c = class_of (size);
+	const size_t n = (size_t)1 << c;
+	char *buf = NULL;
+
+	LOCK (pool_mtx);
+	if (!free_bufs[c].empty()) {
+		buf = free_bufs[c].back ();
+		free_bufs[c].pop_back ();
+		stats.cached -= n;
+		stats.hits++;
+	}
+	else
+		stats.misses++;
+	stats.in_use += n;
+	stats.peak = MAX(stats.peak, stats.in_use);
+	UNLOCK (pool_mtx);
+
+	return buf ? buf : map (n);
+}
+
+/* Give back a buffer from buf_pool_get() of that size. */
+void buf_pool_put (char *buf, size_t size)
+{
+	if (!buf) return;
+
+	const int c = class_of (size);
+	const size_t n = (size_t)1 << c;
+	bool keep = false;
+
+	LOCK (pool_mtx);
+	stats.in_use -= n;
+	if (!closing && free_bufs[c].size() < BUF_POOL_KEEP) {
+		free_bufs[c].push_back (buf);
+		stats.cached += n;
+		keep = true;
+	}
+	UNLOCK (pool_mtx);
+
+	if (!keep) unmap (buf, n);
+}
+
+void buf_pool_get_stats (buf_pool_stats *s)
+{
+	LOCK (pool_mtx);
+	*s = stats;
+	UNLOCK (pool_mtx);
+}
+
+/* Free the kept buffers. Buffers given back later are freed right away. */
+void buf_pool_cleanup ()
+{
+	LOCK (pool_mtx);
+	closing = true;
+	logit ("Buffer pool: %zu hits, %zu misses, peak %zuKB in use",
+			stats.hits, stats.misses, stats.peak / 1024);
+	for (int c = MIN_SHIFT; c <= MAX_SHIFT; c++) {
+		for (char *buf : free_bufs[c])
+			unmap (buf, (size_t)1 << c);
+		free_bufs[c].clear ();
+	}
+	stats.cached = 0;
+	UNLOCK (pool_mtx);
+}
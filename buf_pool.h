@@ -0,0 +1,43 @@
+#pragma once
+
+// Pool for the big buffers that streams and the player keep allocating and
+// freeing: the input buffers of io streams (opened for every tag read,
+// precached file or duration check), the decoder buffers and the output
+// buffer. Sizes are rounded up to a power of two and up to BUF_POOL_KEEP
+// freed buffers of each size are kept for the next request, so they don't
+// have to be mapped and faulted in again. Buffers of a huge page or more
+// are backed by huge pages if the system has them.
+
+#define BUF_POOL_KEEP	4
+
+char *buf_pool_get (size_t size);
+void  buf_pool_put (char *buf, size_t size);
+void  buf_pool_cleanup ();
+
+struct buf_pool_stats
+{
+	size_t hits;	// requests served from the pool
+	size_t misses;	// requests that needed a new buffer
+	size_t in_use;	// bytes handed out now
+	size_t peak;	// most bytes handed out at once
+	size_t cached;	// bytes kept for reuse
+};
+void buf_pool_get_stats (buf_pool_stats *stats);
+
+// A buffer from the pool, for use in place of std::vector<char> where the
+// contents need no initialization.
+class pool_buf
+{
+public:
+	explicit pool_buf(size_t n) : n(n), p(buf_pool_get(n)) {}
+	pool_buf(const pool_buf &) = delete;
+	~pool_buf() { buf_pool_put(p, n); }
+
+	char *data() { return p; }
+	const char *data() const { return p; }
+	size_t size() const { return n; }
+
+private:
+	const size_t n;
+	char *const  p;
+};
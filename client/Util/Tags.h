@@ -29,24 +29,37 @@ public:
 		}
 		it.tags = NULL;
 	}
-	void request(const str &path, Socket &srv)
+	// should path be asked for? then it counts as requested from now on
+	bool want(const str &path)
 	{
-		if (requests.count(path) || tags.count(path)) return;
-		if (is_url(path)) return;
+		if (requests.count(path) || tags.count(path)) return false;
+		if (is_url(path)) return false;
 
 		requests.insert(path);
+		return true;
+	}
+	void request(const str &path, Socket &srv)
+	{
+		if (!want(path)) return;
 
 		srv.send(CMD_GET_FILE_TAGS);
 		srv.send(path);
 	}
 	void request(const plist &plist, Socket &srv)
 	{
+		strings paths;
 		for (auto &i : plist.items)
 		{
 			connect(*i);
 			if (i->tags || i->type != F_SOUND) continue;
-			request(i->path, srv);
+			if (want(i->path)) paths.push_back(i->path);
 		}
+		if (paths.empty()) return;
+
+		srv.buffer();
+		srv.send(CMD_GET_FILE_TAGS_BATCH);
+		srv.send_paths(paths);
+		srv.flush();
 	}
 
 	void update(const str &path, std::unique_ptr<file_tags> &&tag)
@@ -25,7 +25,7 @@ static constexpr int w_toggles = 6+3+7+6+4+5*2+4*1;
 InfoView::InfoView(Interface &iface)
 : iface(iface), drag_x0(-1)
 , bitrate(-1), avg_bitrate(-1), rate(-1)
-, curr_time(0), channels(0)
+, curr_time(0), channels(0), buffer_target(-1), underruns(0)
 , state(STATE_STOP), mixer_value(-1)
 {
 }
@@ -139,6 +139,8 @@ void InfoView::draw() const
 		bitrate = avg_bitrate = rate = 0;
 		curr_time = 0;
 		channels = 0;
+		buffer_target = -1;
+		underruns = 0;
 	}
 
 	// current song: play/pause state
@@ -261,6 +263,21 @@ void InfoView::draw() const
 		w -= 15+2;
 	}
 
+	// input buffer of network streams
+	if (buffer_target >= 0 && is_url(iface.curr_file.c_str()))
+	{
+		str bs = format("buf %dK", buffer_target);
+		if (underruns) bs += format(" (%d!)", underruns);
+		if (w >= bs.length()+2)
+		{
+			win.color(CLR_SOUND_PARAMS);
+			win.moveto(H-2, x);
+			win.put_ascii(bs);
+			x += bs.length()+2;
+			w -= bs.length()+2;
+		}
+	}
+
 	if (options::ShowMixer)
 	{
 		str ms = format("%s: %02d%%", mixer_name.c_str(), mixer_value);
@@ -36,6 +36,11 @@ public:
 	UPD(str, mixer_name)
 	UPD(int, mixer_value)
 	#undef UPD
+	void update_buffer(int target, int n)
+	{
+		if (buffer_target == target && underruns == n) return;
+		buffer_target = target; underruns = n; redraw(1);
+	}
 
 private:
 	Interface &iface;
@@ -45,6 +50,7 @@ private:
 	mutable int rate;		  // in kHz
 	mutable int curr_time;
 	mutable int channels;
+	mutable int buffer_target, underruns; // input buffer, KB or -1
 	mutable PlayState state; // STATE_(PLAY | STOP | PAUSE)
 	mutable str mixer_name;
 	mutable int mixer_value;
@@ -192,6 +192,10 @@ void Client::update_state ()
 	iface.info.update_channels(get_channels());
 	iface.info.update_bitrate(get_bitrate());
 	iface.info.update_rate(get_rate());
+
+	srv.send(CMD_GET_BUFFER);
+	wait_for_data(); int target = srv.get_int();
+	iface.info.update_buffer(target, srv.get_int());
 	if (silent_seek_pos == -1) iface.info.update_curr_time(get_curr_time ());
 }
 
@@ -873,6 +877,7 @@ void Client::handle_server_event (int type)
 		case EV_RATE:  iface.info.update_rate(srv.get_int()); break;
 		case EV_CHANNELS: iface.info.update_channels(srv.get_int()); break;
 		case EV_AVG_BITRATE: iface.info.update_avg_bitrate(srv.get_int()); break;
+		case EV_BUFFER: { int target = srv.get_int(); iface.info.update_buffer(target, srv.get_int()); } break;
 		case EV_OPTIONS: 
 		{
 			int v = srv.get_int();
@@ -963,6 +968,20 @@ void Client::handle_server_event (int type)
 			iface.redraw(3);
 			break;
 		}
+		case EV_FILE_TAGS_BATCH:
+		{
+			int n = 0;
+			while (true)
+			{
+				str file = srv.get_str(); if (file.empty()) break;
+				file_tags *tag = srv.get_tags();
+				if (tag) tags.update(file, std::unique_ptr<file_tags>(tag));
+				++n;
+			}
+			logit ("Received tags for %d files", n);
+			iface.redraw(3);
+			break;
+		}
 		case EV_FILE_RATING:
 		{
 			str file = srv.get_str();
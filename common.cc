@@ -54,8 +54,18 @@ void fatal (const char *format, ...)
 	exit (EXIT_FATAL);
 }
 
+#ifndef NDEBUG
+thread_local int NoHeapGuard::depth = 0;
+#define CHECK_HEAP_ALLOWED() \
+	do { if (NoHeapGuard::depth) fatal ("Memory allocation in %s " \
+			"inside a NoHeapGuard!", __func__); } while (0)
+#else
+#define CHECK_HEAP_ALLOWED() do {} while (0)
+#endif
+
 void *xmalloc (size_t size)
 {
+	CHECK_HEAP_ALLOWED ();
 	void *p = malloc(size);
 	if (!p) fatal ("Can't allocate memory!");
 	return p;
@@ -63,6 +73,7 @@ void *xmalloc (size_t size)
 
 void *xcalloc (size_t nmemb, size_t size)
 {
+	CHECK_HEAP_ALLOWED ();
 	void *p = calloc(nmemb, size);
 	if (!p) fatal ("Can't allocate memory!");
 	return p;
@@ -70,6 +81,7 @@ void *xcalloc (size_t nmemb, size_t size)
 
 void *xrealloc (void *ptr, const size_t size)
 {
+	CHECK_HEAP_ALLOWED ();
 	void *p = realloc(ptr, size);
 	if (!p && size) fatal ("Can't allocate memory!");
 	return p;
@@ -78,6 +90,7 @@ void *xrealloc (void *ptr, const size_t size)
 char *xstrdup (const char *s)
 {
 	if (!s) return NULL;
+	CHECK_HEAP_ALLOWED ();
 	char *n = strdup(s);
 	if (!n) fatal ("Can't allocate memory!");
 	return n;
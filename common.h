@@ -32,6 +32,20 @@ struct LockGuard
 	pthread_mutex_t &mutex;
 };
 
+/* Marks a scope in which the current thread must not allocate, like the
+ * real-time output path. In debug builds xmalloc() and friends abort when
+ * called inside one; in release builds this does nothing. */
+#ifndef NDEBUG
+struct NoHeapGuard
+{
+	NoHeapGuard()  { ++depth; }
+	~NoHeapGuard() { --depth; }
+	static thread_local int depth;
+};
+#else
+struct NoHeapGuard {};
+#endif
+
 /* Exit status on fatal error. */
 #define EXIT_FATAL	2
 
@@ -4,6 +4,7 @@
 #define HAVE_SNDIO 1
 
 #define HAVE_MMAP 1 /* Define to 1 if you have a working `mmap' system call. */
+/* HAVE_IO_URING is defined by SConstruct if liburing is found. */
 /* #undef HAVE_TREMOR */ /* Define if you have integer Vorbis. */
 
 #define PACKAGE_NAME      "AMOC"
@@ -1,16 +1,33 @@
 #include "fifo_buf.h"
+#include "buf_pool.h"
 
 fifo_buf::fifo_buf(size_t n)
 	: size(n)
 	, fill(0)
 	, pos(0)
-	, buf(new char[n])
+	, buf(buf_pool_get(n))
 {
 }
 
 fifo_buf::~fifo_buf()
 {
-	delete[] buf;
+	buf_pool_put(buf, size);
+}
+
+void fifo_buf::resize(size_t n)
+{
+	assert(n >= fill);
+	if (n == size) return;
+
+	char *b = buf_pool_get(n);
+	size_t k = fill;
+	peek(b, k);
+
+	buf_pool_put(buf, size);
+	buf  = b;
+	size = n;
+	pos  = 0;
+	fill = k;
 }
 
 size_t fifo_buf::put(const char *data, size_t N)
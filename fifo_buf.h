@@ -8,6 +8,7 @@ public:
 	~fifo_buf();
 
 	void clear() { fill = pos = 0; }
+	void resize(size_t n); // keeps the contents, n must be >= get_fill()
 
 	// these return number of bytes actually put/got
 	size_t put (const char *data, size_t size);
@@ -1,18 +1,29 @@
 #pragma once
 #include <optional>
+#include <limits.h>
 
 struct file_tags
 {
-	file_tags() : track(-1), time(-1), rating(-1), usage(0) {}
+	enum { NO_GAIN = INT_MIN };
+
+	file_tags() : track(-1), time(-1), rating(-1), disc(-1)
+	, bitrate(-1), rate(-1), channels(-1)
+	, track_gain(NO_GAIN), album_gain(NO_GAIN), usage(0) {}
 	file_tags(const file_tags &t)
 	: title(t.title), artist(t.artist), album(t.album)
 	, track(t.track), rating(t.rating), time(t.time)
+	, album_artist(t.album_artist), codec(t.codec), disc(t.disc)
+	, bitrate(t.bitrate), rate(t.rate), channels(t.channels)
+	, track_gain(t.track_gain), album_gain(t.album_gain)
 	, usage(0)
 	{
 	}
 	file_tags(const file_tags &&t)
 	: title(std::move(t.title)), artist(std::move(t.artist)), album(std::move(t.album))
 	, track(t.track), rating(t.rating), time(t.time)
+	, album_artist(std::move(t.album_artist)), codec(std::move(t.codec)), disc(t.disc)
+	, bitrate(t.bitrate), rate(t.rate), channels(t.channels)
+	, track_gain(t.track_gain), album_gain(t.album_gain)
 	, usage(0)
 	{
 		assert(t.usage == 0);
@@ -21,6 +32,15 @@ struct file_tags
 	str title, artist, album;
 	int track, rating;
 	int time; // in seconds or -1 for streams
+
+	// not known (empty or -1) unless the decoder reads them
+	str album_artist;
+	str codec;
+	int disc;
+	int bitrate; // average in kbps
+	int rate, channels;
+	int track_gain, album_gain; // ReplayGain in 1/100 dB or NO_GAIN
+
 	mutable int usage; // reference count
 
 	file_tags& operator= (file_tags &&t)
@@ -31,6 +51,14 @@ struct file_tags
 		track = t.track;
 		rating = t.rating;
 		time = t.time;
+		album_artist = std::move(t.album_artist);
+		codec = std::move(t.codec);
+		disc = t.disc;
+		bitrate = t.bitrate;
+		rate = t.rate;
+		channels = t.channels;
+		track_gain = t.track_gain;
+		album_gain = t.album_gain;
 		// leave usage as is
 		return *this;
 	}
@@ -42,6 +70,14 @@ struct file_tags
 		track = t.track;
 		rating = t.rating;
 		time = t.time;
+		album_artist = t.album_artist;
+		codec = t.codec;
+		disc = t.disc;
+		bitrate = t.bitrate;
+		rate = t.rate;
+		channels = t.channels;
+		track_gain = t.track_gain;
+		album_gain = t.album_gain;
 		// leave usage as is
 		return *this;
 	}
@@ -26,9 +26,14 @@ static magic_t cookie = NULL;
 static char *cached_file = NULL;
 static char *cached_result = NULL;
 
-void files_init ()
+static pthread_mutex_t magic_mtx = PTHREAD_MUTEX_INITIALIZER;
+static bool magic_loaded = false;
+
+/* Loading the magic database takes a while, so it is only done when a MIME
+ * type is needed for the first time. Call with magic_mtx held. */
+static void load_magic ()
 {
-	assert (cookie == NULL);
+	magic_loaded = true;
 
 	cookie = magic_open (MAGIC_SYMLINK | MAGIC_MIME | MAGIC_ERROR |
 	                     MAGIC_NO_CHECK_COMPRESS | MAGIC_NO_CHECK_ELF |
@@ -49,8 +54,9 @@ void files_cleanup ()
 	cached_file = NULL;
 	free (cached_result);
 	cached_result = NULL;
-	magic_close (cookie);
+	if (cookie) magic_close (cookie);
 	cookie = NULL;
+	magic_loaded = false;
 }
 
 str add_path(const str &p1, const str &p2)
@@ -289,10 +295,10 @@ char *file_mime_type (const char *file)
 
 	assert (file != NULL);
 
-	static pthread_mutex_t magic_mtx = PTHREAD_MUTEX_INITIALIZER;
-
+	LOCK(magic_mtx);
+	if (!magic_loaded)
+		load_magic ();
 	if (cookie != NULL) {
-		LOCK(magic_mtx);
 		if (cached_file && !strcmp (cached_file, file))
 			result = xstrdup (cached_result);
 		else {
@@ -307,8 +313,8 @@ char *file_mime_type (const char *file)
 				cached_result = xstrdup (result);
 			}
 		}
-		UNLOCK(magic_mtx);
 	}
+	UNLOCK(magic_mtx);
 
 	return result;
 }
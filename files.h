@@ -1,6 +1,5 @@
 #pragma once
 
-void files_init ();
 void files_cleanup ();
 
 str  add_path(const str &p1, const str &p2); // like (cd p1; cd p2; return pwd) p1,p2 assumed to be normalized!
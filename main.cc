@@ -430,8 +430,6 @@ int main (int argc, const char *argv[])
 
 	logit ("This is AMOC (version %s)", PACKAGE_VERSION);
 
-	files_init ();
-
 	memset (&params, 0, sizeof(params));
 	params.allow_iface = 1;
 
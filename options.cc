@@ -196,16 +196,23 @@ void load(Component who)
 	OPT(RatingSpace);
 	OPT(RatingStar);
 	OPT(ReadTags);
+	OPT(TagsReaderThreads);
+	OPT(TagsCacheLog);
 	OPT(MusicDir);
 	OPT(StartInMusicDir);
 	OPT(Repeat);
 	OPT(Shuffle);
 	OPT(AutoNext);
+	OPT(Gapless);
 	OPT(ASCIILines); OPT(HideBorder);
 	OPT(InputBuffer);
 	OPT(OutputBuffer);
 	OPT(Prebuffering);
+	OPT(AdaptivePrebuffering);
+	OPT(PrecacheTracks);
+	OPT(PrecacheBuffer);
 	OPT(HTTPProxy);
+	OPT(HTTPCacheSize);
 	EOPT(SoundDriver, "SNDIO", "JACK", "ALSA", "OSS", "NULL");
 	OPT(JackClientName);
 	OPT(JackStartServer);
@@ -219,6 +226,7 @@ void load(Component who)
 	OPT(ALSAMixer1);
 	OPT(ALSAMixer2);
 	OPT(ALSAStutterDefeat);
+	OPT(ALSALatency);
 	OPT(Softmixer_SaveState);
 	OPT(SoftmixerActive);
 	OPT(SoftmixerMono);
@@ -231,6 +239,8 @@ void load(Component who)
 	OPT(HideFileExtension);
 	OPT(RunDir);
 	OPT(UseMMap);
+	OPT(UseIOUring);
+	OPT(DirectIOMinSize);
 	OPT(UseMimeMagic);
 	OPT(FileNamesIconv);
 	OPT(TiMidity_Config);
@@ -240,15 +250,24 @@ void load(Component who)
 	OPT(TimeBarSpace);
 	OPT(SeekTime);
 	OPT(SilentSeekTime);
-	EOPT(ResampleMethod, "SincBestQuality", "SincMediumQuality", "SincFastest", "ZeroOrderHold", "Linear");
+	EOPT(ResampleMethod, "SincBestQuality", "SincMediumQuality", "SincFastest", "ZeroOrderHold", "Linear",
+	                     "PolyphaseBest", "PolyphaseFast", "FastLinear");
 	OPT(ForceSampleRate);
 	OPT(Allow24bitOutput);
+	OPT(Dither);
 	OPT(UseRealtimePriority);
 	OPT(PlaylistFullPaths);
 	OPT(MessageLingerTime);
 
 	build_rating_strings(RatingSpace.c_str(), RatingStar.c_str());
 	if (Prebuffering > InputBuffer) InputBuffer = Prebuffering;
+	AdaptivePrebuffering = CLAMP(0, AdaptivePrebuffering, 600);
+	PrecacheTracks = CLAMP(0, PrecacheTracks, 16);
+	TagsReaderThreads = CLAMP(1, TagsReaderThreads, 32);
+	if (PrecacheBuffer < 64) PrecacheBuffer = 64;
+	ALSALatency = CLAMP(0, ALSALatency, 2000);
+	if (DirectIOMinSize < 0) DirectIOMinSize = 0;
+	if (HTTPCacheSize < 0) HTTPCacheSize = 0;
 
 	if (RunDir.empty()) RunDir = ConfigDir;
 	normalize_path(RunDir);
@@ -312,16 +331,23 @@ Ratio hsplit = std::make_pair(1,1), vsplit = std::make_pair(1,1);
 Layout layout = HSPLIT;
 
 bool ReadTags = true;
+int  TagsReaderThreads = 4;
+bool TagsCacheLog = false;
 bool StartInMusicDir = false;
 str  LastDir = "";
 bool Repeat = false;
 bool Shuffle = false;
 bool AutoNext = true;
+bool Gapless = true;
 bool ASCIILines = false, HideBorder = false;
 int InputBuffer = 512;
 int OutputBuffer = 512;
 int Prebuffering = 64;
+int AdaptivePrebuffering = 0;
+int PrecacheTracks = 1;
+int PrecacheBuffer = 256;
 str HTTPProxy = "";
+int HTTPCacheSize = 256;
 
 SoundDriver_t SoundDriver = SoundDriver_t::AUTO;
 
@@ -339,6 +365,7 @@ str  ALSADevice = "default";
 str  ALSAMixer1 = "PCM";
 str  ALSAMixer2 = "Master";
 bool ALSAStutterDefeat = false;
+int  ALSALatency = 0;
 
 bool Softmixer_SaveState = true;
 bool ShowMixer = true;
@@ -353,6 +380,8 @@ bool ShowHiddenFiles = false;
 bool HideFileExtension = false;
 
 bool UseMMap = false;
+bool UseIOUring = false;
+int  DirectIOMinSize = 0;
 bool UseMimeMagic = false;
 bool FileNamesIconv = false;
 str  TiMidity_Config = "no";
@@ -370,6 +399,7 @@ ResampleMethod_t ResampleMethod = ResampleMethod_t::Linear;
 
 int  ForceSampleRate = 0;
 bool Allow24bitOutput = false;
+bool Dither = false;
 bool UseRealtimePriority = false;
 
 bool PlaylistFullPaths = true;
@@ -31,6 +31,8 @@ namespace options
 	extern str    TERM;
 
 	extern bool ReadTags;
+	extern int  TagsReaderThreads;
+	extern bool TagsCacheLog;
 	extern bool PlaylistFullPaths;
 	extern bool ShowHiddenFiles;
 	extern bool HideFileExtension;
@@ -43,19 +45,27 @@ namespace options
 	extern str  TimeBarSpace;
 
 	extern int  Prebuffering, InputBuffer, OutputBuffer;
+	extern int  AdaptivePrebuffering;
+	extern int  PrecacheTracks, PrecacheBuffer;
 	extern bool UseRealtimePriority;
 	extern bool Repeat;
 	extern bool Shuffle;
 	extern bool AutoNext;
+	extern bool Gapless;
 	extern str  HTTPProxy;
+	extern int  HTTPCacheSize;
 	extern str  TiMidity_Config;
 	extern bool UseMMap;
+	extern bool UseIOUring;
+	extern int  DirectIOMinSize;
 	extern bool UseMimeMagic;
 	extern bool FileNamesIconv;
-	enum class ResampleMethod_t : int { SincBestQuality, SincMediumQuality, SincFastest, ZeroOrderHold, Linear };
+	enum class ResampleMethod_t : int { SincBestQuality, SincMediumQuality, SincFastest, ZeroOrderHold, Linear,
+	                                    PolyphaseBest, PolyphaseFast, FastLinear };
 	extern ResampleMethod_t ResampleMethod;
 	extern int  ForceSampleRate;
 	extern bool Allow24bitOutput;
+	extern bool Dither;
 	
 	enum class SoundDriver_t : int { AUTO = -1, SNDIO, JACK, ALSA, OSS, NOSOUND };
 	extern SoundDriver_t SoundDriver;
@@ -67,6 +77,7 @@ namespace options
 	extern str  ALSAMixer1;
 	extern str  ALSAMixer2;
 	extern bool ALSAStutterDefeat;
+	extern int  ALSALatency;
 	extern str  OSSDevice;
 	extern str  OSSMixerDevice;
 	extern str  OSSMixerChannel1;
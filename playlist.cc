@@ -1,8 +1,8 @@
 #include <sys/stat.h>
 #include <dirent.h>
-#include <stack>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <pthread.h>
 
 #include "playlist.h"
 #include "client/Util/Tags.h"
@@ -22,6 +22,33 @@ file_type plist_item::ftype (const str &file)
 	return F_OTHER;
 }
 
+/* ftype() for an entry of an open directory, using the type readdir() got
+ * from the filesystem if it has one, so that only symlinks and entries of
+ * unknown type need a stat. */
+static file_type entry_ftype (DIR *dir, const dirent *entry, const str &path)
+{
+	bool is_dir;
+
+	switch (entry->d_type)
+	{
+		case DT_DIR: is_dir = true; break;
+		case DT_LNK:
+		case DT_UNKNOWN:
+		{
+			struct stat st;
+			if (fstatat(dirfd(dir), entry->d_name, &st, 0) == -1) return F_OTHER;
+			is_dir = S_ISDIR(st.st_mode);
+			break;
+		}
+		default: is_dir = false; break;
+	}
+
+	if (is_dir) return F_DIR;
+	if (is_sound_file(path)) return F_SOUND;
+	if (is_plist_file(path)) return F_PLAYLIST;
+	return F_OTHER;
+}
+
 bool plist_item::can_tag() const
 {
 	if (type != F_SOUND) return false;
@@ -212,28 +239,17 @@ bool operator< (const plist_item &a, const plist_item &b)
 	return strcoll(a.path.c_str(), b.path.c_str()) < 0;
 }
 
-bool plist::load_directory(const str &directory_, bool include_updir)
+/* Read the entries of dir, which is directory, into items. Returns false if
+ * the user interrupted it. */
+static bool read_entries (DIR *dir, const str &directory, bool include_updir,
+		std::vector<std::unique_ptr<plist_item> > &items)
 {
-	str directory = normalized_path(directory_);
-	
-	DIR *dir = opendir(directory.empty() ? "." : directory.c_str());
-	if (!dir) {
-		error_errno ("Can't read directory", errno);
-		return false;
-	}
-
-	items.clear();
-	is_dir = true;
-
 	const bool root = (directory == "/");
 	const char *prefix = (root ? "" : directory.c_str());
 	dirent *entry;
 	while ((entry = readdir(dir)))
 	{
-		if (user_wants_interrupt()) {
-			error ("Interrupted! Not all files read!");
-			break;
-		}
+		if (user_wants_interrupt()) return false;
 
 		if (!strcmp(entry->d_name, ".")) continue;
 		bool up = !strcmp(entry->d_name, "..");
@@ -242,70 +258,193 @@ bool plist::load_directory(const str &directory_, bool include_updir)
 
 		str p = format("%s/%s", prefix, entry->d_name);
 		if (up) normalize_path(p);
-		items.emplace_back(new plist_item(p));
+		file_type t = entry_ftype(dir, entry, p);
+		items.emplace_back(new plist_item(p, t));
+	}
+	return true;
+}
+
+bool plist::load_directory(const str &directory_, bool include_updir)
+{
+	str directory = normalized_path(directory_);
+	
+	DIR *dir = opendir(directory.empty() ? "." : directory.c_str());
+	if (!dir) {
+		error_errno ("Can't read directory", errno);
+		return false;
 	}
 
+	items.clear();
+	is_dir = true;
+
+	if (!read_entries(dir, directory, include_updir, items))
+		error ("Interrupted! Not all files read!");
+
 	closedir (dir);
 
 	sort();
 	return true;
 }
 
-bool plist::add_directory (const str &directory, bool recursive)
+//-----------------------------------------------------------------------------
+// add_directory scans the tree with SCAN_THREADS threads, which take the
+// directories from a shared stack, so a slow directory (network filesystems)
+// doesn't hold up the others. The result is put together from the tree when
+// all is done, so its order doesn't depend on which thread was faster: the
+// files of the subdirectories in sorted order, then those of the directory.
+// Nothing is handed out before the whole tree is read; none of the callers
+// could show part of it yet.
+//-----------------------------------------------------------------------------
+
+#define SCAN_THREADS	8
+
+struct scan_node
 {
-	is_dir = false;
+	str path;
+	const scan_node *parent;
+	dev_t dev;
+	ino_t ino;
+	int error;	// errno from opening it, or 0
+	std::vector<std::unique_ptr<plist_item> > files;	// sorted
+	std::vector<std::unique_ptr<scan_node> > children;	// sorted
+};
+
+struct dir_scanner
+{
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;	// todo or busy changed
+	std::vector<scan_node *> todo;
+	int busy;	// nodes being scanned
+	bool recursive;
+	bool interrupted;
+};
+
+/* Read the directory of n. Its (dev, ino) is compared to those of the
+ * directories above, which are all done, to notice symlink loops. */
+static bool scan_dir (scan_node *n, bool recursive)
+{
+	DIR *dir = opendir(n->path.c_str());
+	if (!dir) {
+		n->error = errno;
+		return true;
+	}
 
-	std::stack<str> todo;
-	std::set<ino_t> done;
-	todo.push(directory);
-	plist added;
-	while (!todo.empty())
+	struct stat st;
+	if (fstat(dirfd(dir), &st) == 0)
 	{
-		if (user_wants_interrupt()) {
-			error ("Interrupted! Not all files read!");
-			break;
-		}
-
-		str d = todo.top(); todo.pop();
-		const char *dir = d.c_str();
-		
-		struct stat st;
-		if (stat (dir, &st)) {
-			char *err = xstrerror (errno);
-			error ("Can't stat \"%s\" (Error: \"%s\")", dir, err);
-			free (err);
-			continue;
-		}
-		if (done.count(st.st_ino))
+		n->dev = st.st_dev;
+		n->ino = st.st_ino;
+		for (auto *a = n->parent; a; a = a->parent)
 		{
-			logit ("Detected symlink loop on %s", dir);
-			continue;
+			if (a->dev != n->dev || a->ino != n->ino) continue;
+			logit ("Detected symlink loop on %s", n->path.c_str());
+			closedir (dir);
+			return true;
 		}
+	}
+
+	std::vector<std::unique_ptr<plist_item> > items;
+	bool ok = read_entries(dir, n->path, false, items);
+	closedir (dir);
+
+	std::sort(items.begin(), items.end(),
+		[](const std::unique_ptr<plist_item>&a, const std::unique_ptr<plist_item>&b)
+		{ return *a < *b; });
 
-		plist p; p.load_directory(d, false);
-		for (int i = 0, n = (int)p.items.size(); i < n; ++i)
+	for (auto &it : items)
+	{
+		switch (it->type)
 		{
-			auto &it = p.items[i];
-			switch (it->type)
-			{
-				case F_DIR:
-				{
-					if (recursive) todo.push(it->path);
-					// fallthrough
-				}
-				case F_PLAYLIST:
-				case F_OTHER:
-					p.items.erase(p.items.begin() + i);
-					--i; --n;
-					break;
-				default: break;
-			}
+			case F_DIR:
+				if (!recursive) break;
+				n->children.emplace_back(new scan_node{it->path, n, 0, 0, 0, {}, {}});
+				break;
+			case F_PLAYLIST:
+			case F_OTHER:
+				break;
+			default:
+				n->files.push_back(std::move(it));
+				break;
 		}
+	}
+	return ok;
+}
+
+static void *scan_thread (void *data)
+{
+	auto &sc = *(dir_scanner *)data;
 
-		p += std::move(added);
-		added.swap(p);
+	LOCK (sc.mtx);
+	while (true)
+	{
+		while (sc.todo.empty() && sc.busy && !sc.interrupted)
+			pthread_cond_wait (&sc.cond, &sc.mtx);
+		if (sc.todo.empty() || sc.interrupted) break;
+
+		scan_node *n = sc.todo.back(); sc.todo.pop_back();
+		++sc.busy;
+		UNLOCK (sc.mtx);
+
+		bool ok = scan_dir(n, sc.recursive);
+
+		LOCK (sc.mtx);
+		if (!ok) sc.interrupted = true;
+		for (auto i = n->children.rbegin(); i != n->children.rend(); ++i)
+			sc.todo.push_back(i->get());
+		--sc.busy;
+		pthread_cond_broadcast (&sc.cond);
 	}
-	*this += std::move(added);
+	UNLOCK (sc.mtx);
+
+	return NULL;
+}
+
+/* Report the errors and move the files out of the tree in their order. */
+static void collect (scan_node &n, std::vector<std::unique_ptr<plist_item> > &items)
+{
+	if (n.error)
+	{
+		char *err = xstrerror (n.error);
+		error ("Can't read directory \"%s\" (Error: \"%s\")", n.path.c_str(), err);
+		free (err);
+	}
+
+	for (auto &c : n.children) collect(*c, items);
+	for (auto &f : n.files) items.push_back(std::move(f));
+}
+
+bool plist::add_directory (const str &directory, bool recursive)
+{
+	is_dir = false;
+
+	scan_node root{normalized_path(directory), NULL, 0, 0, 0, {}, {}};
+	if (root.path.empty()) root.path = ".";
+
+	dir_scanner sc;
+	pthread_mutex_init (&sc.mtx, NULL);
+	pthread_cond_init (&sc.cond, NULL);
+	sc.todo.push_back(&root);
+	sc.busy = 0;
+	sc.recursive = recursive;
+	sc.interrupted = false;
+
+	std::vector<pthread_t> threads;
+	for (int i = 1; recursive && i < SCAN_THREADS; ++i)
+	{
+		pthread_t tid;
+		int rc = pthread_create (&tid, NULL, scan_thread, &sc);
+		if (rc) { log_errno ("Can't create directory scanning thread", rc); break; }
+		threads.push_back(tid);
+	}
+	scan_thread (&sc);
+	for (auto tid : threads) pthread_join (tid, NULL);
+
+	pthread_cond_destroy (&sc.cond);
+	pthread_mutex_destroy (&sc.mtx);
+
+	if (sc.interrupted) error ("Interrupted! Not all files read!");
+
+	collect(root, items);
 	return true;
 }
 
@@ -0,0 +1,151 @@
+#include "ring_buf.h"
+#include "buf_pool.h"
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <climits>
+#endif
+
+ring_buf::ring_buf(size_t n)
+	: size(n)
+	, buf(buf_pool_get(n))
+	, head(0)
+	, tail(0)
+{
+	assert(n > 0);
+}
+
+ring_buf::~ring_buf()
+{
+	buf_pool_put(buf, size);
+}
+
+size_t ring_buf::put(const char *data, size_t N)
+{
+	size_t h = head.load(std::memory_order_relaxed);
+	size_t t = tail.load(std::memory_order_acquire);
+	size_t n = std::min(N, size - (h - t));
+	if (!n) return 0;
+
+	size_t i = h % size; // next free byte
+	size_t k = std::min(n, size - i);
+	memcpy(buf + i, data, k);
+	memcpy(buf, data + k, n - k);
+
+	head.store(h + n, std::memory_order_release);
+	return n;
+}
+
+size_t ring_buf::peek(char *data, size_t N) const
+{
+	size_t t = tail.load(std::memory_order_relaxed);
+	size_t h = head.load(std::memory_order_acquire);
+	size_t n = std::min(N, h - t);
+	if (!n) return 0;
+
+	size_t i = t % size;
+	size_t k = std::min(n, size - i);
+	memcpy(data, buf + i, k);
+	memcpy(data + k, buf, n - k);
+	return n;
+}
+
+size_t ring_buf::get(char *data, size_t N)
+{
+	size_t n = peek(data, N);
+	if (n) tail.store(tail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+	return n;
+}
+
+char *ring_buf::reserve(size_t *n)
+{
+	size_t h = head.load(std::memory_order_relaxed);
+	size_t t = tail.load(std::memory_order_acquire);
+	size_t i = h % size;
+	*n = std::min(size - (h - t), size - i);
+	return buf + i;
+}
+
+char *ring_buf::read_span(size_t *n)
+{
+	size_t t = tail.load(std::memory_order_relaxed);
+	size_t h = head.load(std::memory_order_acquire);
+	size_t i = t % size;
+	*n = std::min(h - t, size - i);
+	return buf + i;
+}
+
+//----------------------------------------------------------------------------
+
+#ifdef __linux__
+
+static void futex_wait(std::atomic<unsigned> *addr, unsigned val)
+{
+	syscall(SYS_futex, (unsigned*)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+static void futex_wake(std::atomic<unsigned> *addr)
+{
+	syscall(SYS_futex, (unsigned*)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+ring_event::ring_event() : seq(0), waiters(0) {}
+ring_event::~ring_event() {}
+
+#else
+
+ring_event::ring_event() : seq(0), waiters(0)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+ring_event::~ring_event()
+{
+	pthread_mutex_destroy(&mutex);
+	pthread_cond_destroy(&cond);
+}
+
+#endif
+
+unsigned ring_event::prepare()
+{
+	waiters.fetch_add(1, std::memory_order_seq_cst);
+	return seq.load(std::memory_order_seq_cst);
+}
+
+void ring_event::cancel()
+{
+	waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ring_event::wait(unsigned key)
+{
+#ifdef __linux__
+	// spurious wakeups are fine: the caller rechecks its condition
+	while (seq.load(std::memory_order_acquire) == key)
+		futex_wait(&seq, key);
+#else
+	LOCK(mutex);
+	while (seq.load(std::memory_order_acquire) == key)
+		pthread_cond_wait(&cond, &mutex);
+	UNLOCK(mutex);
+#endif
+	waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ring_event::notify()
+{
+	// pairs with the fetch_add in prepare(): either the waiter sees our
+	// change when it rechecks its condition, or we see the waiter here
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!waiters.load(std::memory_order_relaxed)) return;
+
+#ifdef __linux__
+	seq.fetch_add(1, std::memory_order_release);
+	futex_wake(&seq);
+#else
+	LOCK(mutex);
+	seq.fetch_add(1, std::memory_order_release);
+	pthread_cond_broadcast(&cond);
+	UNLOCK(mutex);
+#endif
+}
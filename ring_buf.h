@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+
+// Lock-free ring buffer for exactly one producer and one consumer thread.
+// put/reserve/commit/get_space may only be called by the producer,
+// get/peek/read_span/consume/discard only by the consumer. Other threads
+// can still read the fill level through get_fill(), but the result is only
+// a snapshot.
+//
+// head and tail are free-running byte counters (they are never wrapped,
+// only their difference matters) and live on separate cache lines so the
+// two sides don't keep stealing each other's line.
+
+class ring_buf
+{
+public:
+	ring_buf(size_t size);
+	ring_buf(const ring_buf &) = delete;
+	~ring_buf();
+
+	// these return number of bytes actually put/got
+	size_t put (const char *data, size_t size);
+	size_t peek(char *data, size_t size) const;
+	size_t get (char *data, size_t size);
+
+	// Zero-copy access: reserve returns the contiguous free span at the
+	// write position (*n is set to its size, which may be 0), commit
+	// publishes the first n bytes of it. read_span/consume do the same for
+	// the contiguous readable span. The consumer may modify the span in
+	// place before consuming it.
+	char *reserve(size_t *n);
+	void  commit(size_t n) { head.store(head.load(std::memory_order_relaxed) + n, std::memory_order_release); }
+	char *read_span(size_t *n);
+	void  consume(size_t n) { tail.store(tail.load(std::memory_order_relaxed) + n, std::memory_order_release); }
+
+	// drop everything the producer has written so far (consumer side)
+	void discard() { tail.store(head.load(std::memory_order_acquire), std::memory_order_release); }
+
+	// Drop what was written after the first total bytes. Only while the
+	// producer is not writing (it is synchronized with the caller some
+	// other way) and the consumer has not read past total.
+	void truncate(size_t total) { head.store(total, std::memory_order_release); }
+
+	size_t get_space() const { return size - get_fill(); }
+	size_t get_fill()  const
+	{
+		size_t t = tail.load(std::memory_order_acquire);
+		size_t h = head.load(std::memory_order_acquire);
+		return std::min(h - t, size);
+	}
+	size_t get_size()  const { return size; }
+
+	// Total bytes ever written/read, for marking positions in the stream.
+	size_t total_put() const { return head.load(std::memory_order_acquire); }
+	size_t total_got() const { return tail.load(std::memory_order_acquire); }
+
+private:
+	const size_t size;
+	char *const  buf;
+
+	alignas(64) std::atomic<size_t> head; // bytes written, owned by producer
+	alignas(64) std::atomic<size_t> tail; // bytes read, owned by consumer
+};
+
+// Eventcount for sleeping on a condition that is published without a lock,
+// e.g. the fill level of a ring_buf. The waiting side does
+//
+//     unsigned key = ev.prepare();
+//     if (condition) ev.cancel(); else ev.wait(key);
+//
+// and the other side changes the condition and then calls notify(), which
+// is just a fence and a load unless somebody is actually sleeping. Uses a
+// futex on Linux and a mutex + condition variable elsewhere.
+
+class ring_event
+{
+public:
+	ring_event();
+	ring_event(const ring_event &) = delete;
+	~ring_event();
+
+	unsigned prepare();
+	void cancel();
+	void wait(unsigned key);
+	void notify();
+
+private:
+	alignas(64) std::atomic<unsigned> seq;
+	std::atomic<int> waiters;
+#ifndef __linux__
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+#endif
+};
@@ -25,6 +25,7 @@
 #include "audio.h"
 #include "input/io.h"
 #include "output/audio_conversion.h"
+#include "output/dsp_chain.h"
 
 static pthread_t playing_thread = 0;  /* tid of play thread */
 static int play_thread_running = 0;
@@ -62,6 +63,9 @@ static struct sound_params req_sound_params = { 0, 0, 0 };
 static struct audio_conversion sound_conv;
 static int need_audio_conversion = 0;
 
+/* Equalizer and softmixer, run by audio_send_pcm(). */
+static DSPChain dsp;
+
 /* URL of the last played stream. Used to fake pause/unpause of internet
  * streams. Protected by plist_mtx. */
 static char *last_stream_url = NULL;
@@ -193,12 +197,16 @@ static void *play_thread (void *unused)
 {
 	logit ("Entering playing thread");
 
+	/* The last player() call handed off to the next file, which is
+	 * already queued in out_buf. */
+	bool gapless = false;
+
 	while (true) {
 
 		LOCK (plist_mtx);
 		if (playlist.stopped()) { UNLOCK(plist_mtx); break; }
 		str file = playlist.path(playlist.current());
-		str next = playlist.path(playlist.next());
+		std::vector<str> next = playlist.upcoming(std::max(1, options::PrecacheTracks));
 		UNLOCK (plist_mtx);
 
 		play_next = 0;
@@ -206,15 +214,22 @@ static void *play_thread (void *unused)
 
 		if (!file.empty()) {
 			logit ("Playing %s", file.c_str());
-			out_buf_time_set (out_buf, 0.0);
+			if (!gapless)
+				out_buf_time_set (out_buf, 0.0);
 
-			const char *next_file = next.empty() ? NULL : next.c_str();
-			player (file.c_str(), next_file, out_buf);
+			gapless = player (file, next, out_buf);
 
-			set_info_rate (0);
-			set_info_bitrate (0);
-			set_info_channels (1);
-			out_buf_time_set (out_buf, 0.0);
+			if (!gapless) {
+				set_info_rate (0);
+				set_info_bitrate (0);
+				set_info_channels (1);
+				set_info_buffer (-1, 0);
+				out_buf_time_set (out_buf, 0.0);
+			}
+		}
+		else if (gapless) {
+			player_drop_handoff (out_buf);
+			gapless = false;
 		}
 
 		LOCK (plist_mtx);
@@ -247,6 +262,9 @@ static void *play_thread (void *unused)
 		if (stopped) break;
 	}
 
+	if (gapless)
+		player_drop_handoff (out_buf);
+
 	prev_state = state;
 	state = STATE_STOP;
 	state_change ();
@@ -470,6 +488,7 @@ int audio_open (struct sound_params *sound_params)
 			}
 			need_audio_conversion = 1;
 		}
+		dsp.configure (driver_sound_params);
 		audio_opened = 1;
 
 		#ifndef NDEBUG
@@ -490,24 +509,29 @@ int audio_open (struct sound_params *sound_params)
 
 int audio_send_buf (const char *buf, const size_t size)
 {
-	size_t out_data_len = size;
-	int res;
-	char *converted = NULL;
+	if (!need_audio_conversion)
+		return out_buf_put (out_buf, buf, size);
 
-	if (need_audio_conversion)
-		converted = audio_conv (&sound_conv, buf, size, &out_data_len);
-
-	if (need_audio_conversion && converted)
-		res = out_buf_put (out_buf, converted, out_data_len);
-	else if (!need_audio_conversion)
-		res = out_buf_put (out_buf, buf, size);
-	else
-		res = 0;
+	/* converted points into sound_conv's scratch memory */
+	size_t out_data_len;
+	char *converted = audio_conv (&sound_conv, buf, size, &out_data_len);
+	return converted ? out_buf_put (out_buf, converted, out_data_len) : 0;
+}
 
-	if (converted)
-		free (converted);
+/* Get memory in the output buffer that the decoder can write to directly.
+ * Returns NULL if the sound has to be converted first, the caller must then
+ * use audio_send_buf(). */
+char *audio_reserve_buf (size_t *size)
+{
+	*size = 0;
+	if (need_audio_conversion) return NULL;
+	return out_buf_reserve (out_buf, size);
+}
 
-	return res;
+/* Queue size bytes written to the memory from audio_reserve_buf(). */
+void audio_commit_buf (const size_t size)
+{
+	out_buf_commit (out_buf, size);
 }
 
 /* Get the current audio format bytes per frame value.
@@ -531,52 +555,35 @@ int audio_get_buf_fill ()
 	return hw->get_buff_fill ();
 }
 
-int audio_send_pcm (const char *buf, const size_t size)
+/* Bytes the device takes without blocking or -1 if the driver can't tell. */
+int audio_get_avail ()
 {
-	char *softmixed = NULL;
-	char *equalized = NULL;
-
-	if (equalizer_is_active ())
-	{
-		equalized = (char*) xmalloc (size);
-		memcpy (equalized, buf, size);
+	return hw->get_avail ();
+}
 
-		equalizer_process_buffer (equalized, size, driver_sound_params);
+bool audio_wait_avail (int timeout_ms)
+{
+	return hw->wait_avail (timeout_ms);
+}
 
-		buf = equalized;
-	}
+/* Process the sound in place and play all of it. buf belongs to the output
+ * buffer's read thread, so nothing else looks at it while we do this. */
+int audio_send_pcm (char *buf, const size_t size)
+{
+	if (dsp.active ())
+		dsp.process (buf, size);
 
-	if (softmixer_is_active () || softmixer_is_mono ())
-	{
-		if (equalized)
-		{
-			softmixed = equalized;
-		}
-		else
-		{
-			softmixed = (char*) xmalloc (size);
-			memcpy (softmixed, buf, size);
-		}
+	size_t pos = 0;
+	while (pos < size) {
+		int played = hw->play (buf + pos, size - pos);
 
-		softmixer_process_buffer (softmixed, size, driver_sound_params);
+		if (played < 0)
+			fatal ("Audio output error!");
 
-		buf = softmixed;
+		pos += played;
 	}
 
-	int played;
-
-	played = hw->play (buf, size);
-
-	if (played < 0)
-		fatal ("Audio output error!");
-
-	if (softmixed && !equalized)
-		free (softmixed);
-
-	if (equalized)
-		free (equalized);
-
-	return played;
+	return size;
 }
 
 /* Get current time of the song in seconds. */
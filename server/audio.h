@@ -162,6 +162,28 @@ struct AudioDriver
 	 */
 	virtual int get_buff_fill() const = 0;
 
+	/** Read the free space in the device buffer.
+	 *
+	 * Drivers that know how much the device can take without blocking
+	 * return it here, and play() of at most that much must not block.
+	 * The output thread then writes exactly that much and sleeps in
+	 * wait_avail() instead of inside play().
+	 *
+	 * \return Free space in bytes or -1 if the driver can't tell (then
+	 * play() may block).
+	 */
+	virtual int get_avail() { return -1; }
+
+	/** Wait for free space in the device buffer.
+	 *
+	 * Sleep until get_avail() is likely to return more than 0, e.g. until
+	 * the device has played the next period, or until timeout_ms passed.
+	 * Only used if get_avail() doesn't return -1.
+	 *
+	 * \return false on error.
+	 */
+	virtual bool wait_avail(int timeout_ms) { return true; }
+
 	/** Stop playing immediately.
 	 *
 	 * Request that the sound should not be played. This should involve
@@ -214,11 +236,15 @@ void audio_fail_file (const str &path);
 
 int  audio_open (struct sound_params *sound_params);
 int  audio_send_buf (const char *buf, const size_t size);
-int  audio_send_pcm (const char *buf, const size_t size);
+char*audio_reserve_buf (size_t *size);
+void audio_commit_buf (const size_t size);
+int  audio_send_pcm (char *buf, const size_t size);
 void audio_reset ();
 int  audio_get_bpf ();
 int  audio_get_bps ();
 int  audio_get_buf_fill ();
+int  audio_get_avail ();
+bool audio_wait_avail (int timeout_ms);
 void audio_close ();
 int  audio_get_time ();
 int  audio_get_state ();
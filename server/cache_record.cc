@@ -0,0 +1,289 @@
+#include "cache_record.h"
+
+/* A record is the version byte followed by fields: a varint key (field
+ * number << 2 | type) and the value. Fields that have their default value
+ * are left out and unknown ones are skipped, so fields can be added without
+ * a new version. */
+
+enum field_type
+{
+	T_INT,		/* zigzag varint */
+	T_STR,		/* varint length and the bytes */
+	T_POOLED	/* varint number in the string_pool and varint
+			   pool_check() of the string */
+};
+
+enum field
+{
+	F_MTIME = 1, F_SIZE, F_TITLE, F_ARTIST, F_ALBUM, F_TRACK, F_TIME,
+	F_RATING, F_ALBUM_ARTIST, F_CODEC, F_DISC, F_BITRATE, F_RATE,
+	F_CHANNELS, F_TRACK_GAIN, F_ALBUM_GAIN
+};
+
+static void put_varint (std::vector<char> &buf, uint64_t v)
+{
+	for (; v >= 0x80; v >>= 7) buf.push_back ((char)(v | 0x80));
+	buf.push_back ((char)v);
+}
+
+static bool get_varint (const char *&p, const char *end, uint64_t &v)
+{
+	v = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		const unsigned char c = *p++;
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) return true;
+	}
+	return false;
+}
+
+static void put_int (std::vector<char> &buf, const field f, const int64_t v,
+		const int64_t def)
+{
+	if (v == def) return;
+	put_varint (buf, f << 2 | T_INT);
+	put_varint (buf, (uint64_t)v << 1 ^ (uint64_t)(v >> 63));
+}
+
+/* After a crash the records can be on disk without the pool chunk they
+ * refer to, and the numbers are then given to other strings. A record
+ * keeps this hash of its strings, so it can't get the wrong one. */
+static uint32_t pool_check (const str &s)
+{
+	uint32_t h = 2166136261u;	/* FNV-1a */
+	for (const char c : s) h = (h ^ (unsigned char)c) * 16777619u;
+	return (h ^ h >> 16) & 0xffff;
+}
+
+static void put_str (std::vector<char> &buf, const field f, const str &s,
+		string_pool *pool)
+{
+	if (s.empty()) return;
+
+	const int n = pool ? pool->intern(s) : -1;
+	if (n >= 0) {
+		put_varint (buf, f << 2 | T_POOLED);
+		put_varint (buf, n);
+		put_varint (buf, pool_check(s));
+		return;
+	}
+	put_varint (buf, f << 2 | T_STR);
+	put_varint (buf, s.length());
+	buf.insert (buf.end(), s.begin(), s.end());
+}
+
+void cache_record_serialize (const cache_record &rec, std::vector<char> &buf,
+		string_pool &pool)
+{
+	const auto &tags = rec.tags;
+	const file_tags def;
+
+	buf.clear ();
+	buf.push_back (CACHE_RECORD_VERSION);
+	put_int (buf, F_MTIME, rec.mod_time, INT64_MIN);
+	put_int (buf, F_SIZE, rec.size, -1);
+	put_str (buf, F_TITLE, tags.title, NULL);
+	put_str (buf, F_ARTIST, tags.artist, &pool);
+	put_str (buf, F_ALBUM, tags.album, &pool);
+	put_int (buf, F_TRACK, tags.track, def.track);
+	put_int (buf, F_TIME, tags.time, def.time);
+	put_int (buf, F_RATING, tags.rating, def.rating);
+	put_str (buf, F_ALBUM_ARTIST, tags.album_artist, &pool);
+	put_str (buf, F_CODEC, tags.codec, &pool);
+	put_int (buf, F_DISC, tags.disc, def.disc);
+	put_int (buf, F_BITRATE, tags.bitrate, def.bitrate);
+	put_int (buf, F_RATE, tags.rate, def.rate);
+	put_int (buf, F_CHANNELS, tags.channels, def.channels);
+	put_int (buf, F_TRACK_GAIN, tags.track_gain, def.track_gain);
+	put_int (buf, F_ALBUM_GAIN, tags.album_gain, def.album_gain);
+}
+
+bool cache_record_deserialize (cache_record &rec, const char *buf, size_t len,
+		const string_pool &pool)
+{
+	auto &tags = rec.tags;
+	const char *p = buf, *end = buf + len;
+	bool got_mtime = false;
+
+	if (!len || *p++ != CACHE_RECORD_VERSION) goto err;
+
+	while (p < end) {
+		uint64_t key, v;
+		int64_t i = 0;
+		str s;
+
+		if (!get_varint(p, end, key) || !get_varint(p, end, v)) goto err;
+		switch (key & 3) {
+			case T_INT:
+				i = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+				break;
+			case T_STR:
+				if (v > (uint64_t)(end - p)) goto err;
+				s.assign (p, v);
+				p += v;
+				break;
+			case T_POOLED: {
+				const str *ps = pool.lookup (v);
+				uint64_t check;
+				if (!ps || !get_varint(p, end, check)
+						|| check != pool_check(*ps))
+					goto err;
+				s = *ps;
+				break;
+			}
+			default:
+				goto err;
+		}
+
+		switch (key >> 2) {
+			case F_MTIME: rec.mod_time = i; got_mtime = true; break;
+			case F_SIZE: rec.size = i; break;
+			case F_TITLE: tags.title = std::move(s); break;
+			case F_ARTIST: tags.artist = std::move(s); break;
+			case F_ALBUM: tags.album = std::move(s); break;
+			case F_TRACK: tags.track = i; break;
+			case F_TIME: tags.time = i; break;
+			case F_RATING: tags.rating = i; break;
+			case F_ALBUM_ARTIST: tags.album_artist = std::move(s); break;
+			case F_CODEC: tags.codec = std::move(s); break;
+			case F_DISC: tags.disc = i; break;
+			case F_BITRATE: tags.bitrate = i; break;
+			case F_RATE: tags.rate = i; break;
+			case F_CHANNELS: tags.channels = i; break;
+			case F_TRACK_GAIN: tags.track_gain = i; break;
+			case F_ALBUM_GAIN: tags.album_gain = i; break;
+			default: break; /* from a later version */
+		}
+	}
+	if (got_mtime) return true;
+
+err:
+	logit ("Cache record deserialization error at %tdB", p - buf);
+	return false;
+}
+
+bool cache_record_deserialize_v4 (cache_record &rec, const char *buf, size_t bytes_left)
+{
+	auto &tags = rec.tags;
+	const char *p = buf;
+
+	#define extract_num(var) \
+	do { \
+		if (bytes_left < sizeof(var)) goto err; \
+		memcpy (&var, p, sizeof(var)); \
+		bytes_left -= sizeof(var); \
+		p += sizeof(var); \
+	} while (0)
+
+	#define extract_str(var) \
+	do { \
+		size_t len = strnlen(p, bytes_left) + 1; \
+		if (len > bytes_left) goto err; \
+		var = p; p += len; bytes_left -= len; \
+		assert(var.length() == len-1); \
+	} while (0)
+
+	extract_num (rec.mod_time);
+	extract_str (tags.artist);
+	extract_str (tags.album);
+	extract_str (tags.title);
+	extract_num (tags.track);
+	extract_num (tags.time);
+
+	if (!bytes_left) goto err;
+	tags.rating = *p++;
+	--bytes_left;
+
+	return true;
+
+err:
+	logit ("Cache record deserialization error at %tdB", p - buf);
+	return false;
+}
+
+string_pool::string_pool ()
+: count(0)
+{
+	pthread_mutex_init (&mtx, NULL);
+}
+
+string_pool::~string_pool ()
+{
+	int rc = pthread_mutex_destroy (&mtx);
+	if (rc != 0) log_errno ("Can't destroy string pool mutex", rc);
+}
+
+int string_pool::intern (const str &s)
+{
+	LockGuard g(mtx);
+
+	auto it = numbers.find (s);
+	if (it != numbers.end()) return it->second;
+
+	const uint32_t n = count;
+	if (n == CHUNK * MAX_CHUNKS) return -1;
+	if (n % CHUNK == 0) chunks[n / CHUNK].reset (new str[CHUNK]);
+	chunks[n / CHUNK][n % CHUNK] = s;
+	numbers.emplace (s, n);
+	dirty.insert (n / CHUNK);
+
+	/* lookup() may see it now */
+	count.store (n + 1, std::memory_order_release);
+	return n;
+}
+
+const str *string_pool::lookup (const uint32_t n) const
+{
+	if (n >= count.load(std::memory_order_acquire)) return NULL;
+	return &chunks[n / CHUNK][n % CHUNK];
+}
+
+str string_pool::chunk_key (const uint32_t chunk)
+{
+	/* paths start with '/', so this can't be one */
+	return format("\1strings %u", chunk);
+}
+
+/* Take the strings of a chunk from save(). Only a full chunk can be
+ * followed by another one; a chunk that was not saved completely before a
+ * crash ends the pool, and records with later numbers fail to load. */
+bool string_pool::load (const uint32_t chunk, const char *data, size_t len)
+{
+	LockGuard g(mtx);
+
+	uint32_t n = count;
+	if (n != chunk * CHUNK || chunk >= MAX_CHUNKS) return false;
+
+	const char *p = data, *end = data + len;
+	chunks[chunk].reset (new str[CHUNK]);
+	while (p < end && n < (chunk + 1) * CHUNK) {
+		uint64_t l;
+		if (!get_varint(p, end, l) || l > (uint64_t)(end - p)) break;
+
+		str &s = chunks[chunk][n % CHUNK];
+		s.assign (p, l);
+		p += l;
+		numbers.emplace (s, n++);
+	}
+	count.store (n, std::memory_order_release);
+
+	return n == (chunk + 1) * CHUNK;
+}
+
+void string_pool::save (const std::function<void(const str &key, const std::vector<char> &data)> &put)
+{
+	LockGuard g(mtx);
+
+	std::vector<char> data;
+	const uint32_t n = count;
+	for (auto chunk : dirty) {
+		data.clear ();
+		for (uint32_t i = chunk * CHUNK; i < n && i < (chunk + 1) * CHUNK; i++) {
+			const str &s = chunks[chunk][i % CHUNK];
+			put_varint (data, s.length());
+			data.insert (data.end(), s.begin(), s.end());
+		}
+		put (chunk_key(chunk), data);
+	}
+	dirty.clear ();
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "../file_tags.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+
+/* The first byte of every record. Version 4 was the fixed layout that
+ * cache_record_deserialize_v4() reads. */
+#define CACHE_RECORD_VERSION	5
+
+struct cache_record
+{
+	operator bool() const { return mod_time != -1; }
+
+	time_t mod_time; // last modification time of the file
+	off_t  size = -1; // of the file
+	file_tags tags;
+};
+
+// Strings that many records have (artists, albums, codecs) are stored once
+// and records only keep their number. Numbers are not changed while the
+// server runs, and looking one up takes no lock. A crash can lose strings
+// whose numbers are then given to others, so records also keep a check.
+class string_pool
+{
+public:
+	string_pool();
+	~string_pool();
+
+	int intern(const str &s); // number of s, -1 if the pool is full
+	const str *lookup(uint32_t n) const; // NULL if there is no such string
+
+	// The pool is stored with the records, CHUNK strings under each
+	// chunk_key(). When the store is opened the chunks are given to load()
+	// in order until it returns false; save() writes the ones that changed.
+	static str chunk_key(uint32_t chunk);
+	bool load(uint32_t chunk, const char *data, size_t len);
+	void save(const std::function<void(const str &key, const std::vector<char> &data)> &put);
+
+private:
+	enum { CHUNK = 256, MAX_CHUNKS = 4096 };
+
+	pthread_mutex_t mtx; // for changing it
+	std::map<str, uint32_t> numbers;
+	std::set<uint32_t> dirty; // chunks to save
+	std::unique_ptr<str[]> chunks[MAX_CHUNKS];
+	std::atomic<uint32_t> count;
+};
+
+// buf is overwritten, so it can be reused for many records
+void cache_record_serialize (const cache_record &rec, std::vector<char> &buf,
+		string_pool &pool);
+bool cache_record_deserialize (cache_record &rec, const char *buf, size_t len,
+		const string_pool &pool);
+
+// records written before CACHE_RECORD_VERSION, for upgrading old caches
+bool cache_record_deserialize_v4 (cache_record &rec, const char *buf, size_t len);
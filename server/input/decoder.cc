@@ -11,8 +11,12 @@
 #include "decoder.h"
 #include "io.h"
 #include "inputs.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unordered_map>
 #include <taglib/fileref.h>
 #include <taglib/tag.h>
+#include <taglib/tpropertymap.h>
 
 //-----------------------------------------------------------------------------
 // Decoder methods
@@ -58,16 +62,51 @@ void Decoder::read_tags(const str &file_name, file_tags &info)
 		info.title  = tag->title().to8Bit(true);
 		info.track  = tag->track();
 	}
+	if (!f.isNull() && f.file())
+	{
+		for (auto &p : f.file()->properties())
+			if (!p.second.isEmpty())
+				comment_tag(info, p.first.to8Bit(true).c_str(),
+						p.second.front().to8Bit(true).c_str());
+	}
 	if (!f.isNull() && f.audioProperties())
 	{
 		TagLib::AudioProperties *properties = f.audioProperties();
 		info.time = properties->length();
+		info.bitrate = properties->bitrate();
+		info.rate = properties->sampleRate();
+		info.channels = properties->channels();
 	}
 	else
 	{
 		info.time = get_duration(file_name);
 	}
 }
+
+/* ReplayGain values look like "-6.48 dB". */
+static int parse_gain (const char *value)
+{
+	char *end;
+	double g = strtod (value, &end);
+	if (end == value || !std::isfinite(g)) return file_tags::NO_GAIN;
+	return (int)lround (CLAMP(-100.0, g, 100.0) * 100);
+}
+
+bool comment_tag (file_tags &tags, const char *name, const char *value)
+{
+	if (!strcasecmp(name, "albumartist") || !strcasecmp(name, "album artist"))
+		tags.album_artist = value;
+	else if (!strcasecmp(name, "discnumber"))
+		tags.disc = atoi (value);
+	else if (!strcasecmp(name, "replaygain_track_gain"))
+		tags.track_gain = parse_gain (value);
+	else if (!strcasecmp(name, "replaygain_album_gain"))
+		tags.album_gain = parse_gain (value);
+	else
+		return false;
+	return true;
+}
+
 bool Decoder::write_tags(const str &file_name, const tag_changes &info)
 {
 	TagLib::FileRef f(file_name.c_str());
@@ -159,26 +198,19 @@ struct decoder_preference
 static std::vector<decoder_preference> preferences;
 static std::vector<int> default_decoder_list;
 
-/* Return the index of the first decoder able to handle audio with the
- * given filename extension and/or MIME media type, or -1 if none can. */
-static Decoder* find_decoder (const char *file, str *mime)
+/* Return the first decoder able to handle audio with the given filename
+ * extension and/or MIME media type, or NULL if none can. */
+static Decoder* scan_decoders (const char *ext, const str *mime)
 {
 	const std::vector<int> *decoder_list = NULL;
 
 	// lookup by mime type first, if we have it
-	str m, type, subtype;
-	if (mime && !mime->empty())
+	str type, subtype;
+	if (mime)
 	{
 		type = *mime;
 		split_mime(type, subtype);
 	}
-	else if (options::UseMimeMagic && file && *file)
-	{
-		m = type = file_mime_type(file);
-		split_mime(type, subtype);
-		mime = m.empty() ? NULL : &m;
-	}
-	else mime = NULL;
 	if (!type.empty()) for (auto &pref : preferences)
 	{
 		if (strcasecmp(pref.type.c_str(), type.c_str()) ||
@@ -188,7 +220,6 @@ static Decoder* find_decoder (const char *file, str *mime)
 	}
 
 	// if not found, try extension
-	const char *ext = file ? ext_pos(file) : NULL;
 	if (!decoder_list && ext) for (auto &pref : preferences)
 	{
 		if (!pref.subtype.empty() || strcasecmp(pref.type.c_str(), ext)) continue;
@@ -211,6 +242,187 @@ static Decoder* find_decoder (const char *file, str *mime)
 	return NULL;
 }
 
+//-----------------------------------------------------------------------------
+// Content sniffing
+//-----------------------------------------------------------------------------
+// The formats are recognized by a few bytes at fixed offsets from the start
+// of the data, after any ID3v2 tags. decoder_init compiles the table below
+// for the decoders that are there, indexed by the first byte where that is
+// fixed, so finding the decoder for some data is one pass over a handful of
+// candidates instead of asking every decoder to look at it.
+//-----------------------------------------------------------------------------
+
+#define SNIFF_SIZE	4096	/* read from files, enough for all offsets */
+#define SNIFF_CACHE_MAX	65536	/* entries in sniff_cache */
+
+struct magic_part { int offset; const char *bytes; const char *mask; int len; };
+struct magic { const char *plugin; magic_part a, b; };
+
+/* More specific ones first, the first match wins. */
+static const magic magics[] =
+{
+	{"vorbis",   {0, "OggS", NULL, 4}, {28, "\x01vorbis", NULL, 7}},
+	{"speex",    {0, "OggS", NULL, 4}, {28, "Speex   ", NULL, 8}},
+	{"ffmpeg",   {0, "OggS", NULL, 4}, {28, "OpusHead", NULL, 8}},
+	{"ffmpeg",   {0, "OggS", NULL, 4}, {28, "\x7f" "FLAC", NULL, 5}},
+	{"flac",     {0, "fLaC", NULL, 4}},
+	{"sndfile",  {0, "RIFF", NULL, 4}, {8, "WAVE", NULL, 4}},
+	{"sndfile",  {0, "FORM", NULL, 4}, {8, "AIFF", NULL, 4}},
+	{"sndfile",  {0, ".snd", NULL, 4}},
+	{"wav",      {0, "wvpk", NULL, 4}},
+	{"muse",     {0, "MPCK", NULL, 4}},
+	{"muse",     {0, "MP+", NULL, 3}},
+	{"ffmpeg",   {4, "ftyp", NULL, 4}},
+	{"ffmpeg",   {0, "\x30\x26\xb2\x75\x8e\x66\xcf\x11", NULL, 8}}, // ASF
+	{"timidity", {0, "MThd", NULL, 4}},
+	{"mod",      {0, "IMPM", NULL, 4}},
+	{"mod",      {0, "Extended Module:", NULL, 16}},
+	{"mod",      {44, "SCRM", NULL, 4}},
+	{"mod",      {1080, "M.K.", NULL, 4}},
+	{"aac",      {0, "ADIF", NULL, 4}},
+	{"aac",      {0, "\xff\xf0", "\xff\xf6", 2}}, // ADTS, layer 0
+	{"mp3",      {0, "\xff\xe0", "\xff\xe0", 2}}, // any other MPEG audio frame
+};
+
+struct compiled_magic { const magic *m; int plugin; };
+static std::vector<compiled_magic> magic_by_byte[256]; // unmasked, at offset 0
+static std::vector<compiled_magic> magic_other;
+
+struct sniff_result { time_t mtime; int plugin; };
+static std::unordered_map<str, sniff_result> sniff_cache; // by path
+static std::unordered_map<str, Decoder*> ext_cache; // lower case extension
+static pthread_mutex_t cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void compile_magics ()
+{
+	for (auto &m : magics)
+	{
+		int d = 0; for (; d < plugins.size(); ++d) if (!strcmp(plugins[d].name, m.plugin)) break;
+		if (d >= plugins.size()) continue;
+
+		if (m.a.offset == 0 && !m.a.mask)
+			magic_by_byte[(unsigned char)m.a.bytes[0]].push_back({&m, d});
+		else
+			magic_other.push_back({&m, d});
+	}
+}
+
+static bool part_matches (const magic_part &p, const unsigned char *buf, size_t len)
+{
+	if (!p.bytes) return true;
+	if (p.offset + p.len > len) return false;
+
+	const unsigned char *b = buf + p.offset;
+	for (int i = 0; i < p.len; ++i)
+	{
+		unsigned char mask = p.mask ? p.mask[i] : 0xff;
+		if ((b[i] & mask) != (unsigned char)p.bytes[i]) return false;
+	}
+	return true;
+}
+
+/* Return the index of the plugin for this data or -1. Entries indexed by
+ * the first byte come first: they are more specific than the masked ones
+ * at offset 0. */
+static int match_magic (const unsigned char *buf, size_t len)
+{
+	if (!len) return -1;
+
+	for (auto &c : magic_by_byte[buf[0]])
+		if (part_matches(c.m->a, buf, len) && part_matches(c.m->b, buf, len)) return c.plugin;
+	for (auto &c : magic_other)
+		if (part_matches(c.m->a, buf, len) && part_matches(c.m->b, buf, len)) return c.plugin;
+	return -1;
+}
+
+/* Size of the ID3v2 tag at buf or 0 if there is none. */
+static size_t id3_size (const unsigned char *buf, size_t len)
+{
+	if (len < 10 || memcmp(buf, "ID3", 3) || buf[3] == 0xff || buf[4] == 0xff) return 0;
+	if ((buf[6] | buf[7] | buf[8] | buf[9]) & 0x80) return 0;
+
+	size_t n = (buf[6] << 21) | (buf[7] << 14) | (buf[8] << 7) | buf[9];
+	return 10 + n + (buf[5] & 0x10 ? 10 : 0); // footer
+}
+
+static int sniff_buf (const unsigned char *buf, size_t len)
+{
+	size_t base = 0, n;
+	while ((n = id3_size(buf + base, len - base))) if ((base += n) >= len) return -1;
+	return match_magic(buf + base, len - base);
+}
+
+/* Find the decoder for a file by its contents. The results are kept until
+ * the file is modified. */
+static Decoder *sniff_file (const char *file)
+{
+	struct stat st;
+	if (stat(file, &st) || !S_ISREG(st.st_mode)) return NULL;
+
+	{
+		LockGuard g(cache_mtx);
+		auto it = sniff_cache.find(file);
+		if (it != sniff_cache.end() && it->second.mtime == st.st_mtime)
+			return it->second.plugin < 0 ? NULL : plugins[it->second.plugin].decoder;
+	}
+
+	int plugin = -1;
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		unsigned char buf[SNIFF_SIZE];
+		off_t base = 0;
+		ssize_t n;
+		while ((n = pread(fd, buf, sizeof(buf), base)) > 0)
+		{
+			size_t tag = id3_size(buf, n);
+			if (!tag) { plugin = match_magic(buf, n); break; }
+			base += tag;
+		}
+		close(fd);
+	}
+
+	LockGuard g(cache_mtx);
+	if (sniff_cache.size() >= SNIFF_CACHE_MAX) sniff_cache.clear();
+	sniff_cache[file] = {st.st_mtime, plugin};
+	return plugin < 0 ? NULL : plugins[plugin].decoder;
+}
+
+/* scan_decoders() for an extension alone, which only depends on the
+ * extension. */
+static Decoder *find_decoder_by_ext (const char *ext)
+{
+	str key = ext;
+	for (auto &c : key) c = tolower((unsigned char)c);
+
+	LockGuard g(cache_mtx);
+	auto it = ext_cache.find(key);
+	if (it != ext_cache.end()) return it->second;
+	return ext_cache[key] = scan_decoders(ext, NULL);
+}
+
+/* Return the first decoder able to handle audio with the given filename
+ * and/or MIME media type, or NULL if none can. With UseMimeMagic the
+ * contents of the file decide before its extension. */
+static Decoder* find_decoder (const char *file, str *mime)
+{
+	str m;
+	if (mime && mime->empty()) mime = NULL;
+	if (!mime && options::UseMimeMagic && file && *file && !is_url(file))
+	{
+		Decoder *d = sniff_file(file);
+		if (d) return d;
+
+		char *type = file_mime_type(file);
+		if (type && *type) { m = type; mime = &m; }
+		free(type);
+	}
+
+	const char *ext = file ? ext_pos(file) : NULL;
+	if (!mime) return ext ? find_decoder_by_ext(ext) : NULL;
+	return scan_decoders(ext, mime);
+}
+
 bool is_sound_file (const str &name)
 {
 	return find_decoder(name.c_str(), NULL);
@@ -255,6 +467,13 @@ Decoder *get_decoder_by_content (io_stream &stream)
 	}
 	else logit ("No MIME type.");
 
+	int plugin = sniff_buf((const unsigned char *)buf, res);
+	if (plugin >= 0) {
+		logit ("Found decoder for stream by its signature: %s",
+				plugins[plugin].name);
+		return plugins[plugin].decoder;
+	}
+
 	for (auto &p : plugins) {
 		if (p.decoder->can_decode(stream)) {
 			logit ("Found decoder for stream: %s", p.name);
@@ -282,11 +501,17 @@ void decoder_init()
 	"oga(vorbis,*,ffmpeg)", "ogg(vorbis,*,ffmpeg)", "ogv(ffmpeg)", "application/ogg(vorbis)",
 	"audio/ogg(vorbis)", "flac(flac,*,ffmpeg)", "opus(ffmpeg)", "spx(speex)", "noise(noise)"};
 	for (auto *s : PreferredDecoders) preferences.emplace_back(s);
+
+	compile_magics();
 }
 
 void decoder_cleanup ()
 {
 	preferences.clear();
 	default_decoder_list.clear();
+	for (auto &v : magic_by_byte) v.clear();
+	magic_other.clear();
+	sniff_cache.clear();
+	ext_cache.clear();
 	for (auto &p : plugins) delete p.decoder;
 }
@@ -144,6 +144,10 @@ public:
 };
 
 bool   is_sound_file (const str &file);
+
+/* Take a Vorbis comment style field (ALBUMARTIST=..., DISCNUMBER=...) that
+ * is not one of the basic tags into tags. Returns false if it is unknown. */
+bool comment_tag (file_tags &tags, const char *name, const char *value);
 Decoder *get_decoder (const str &file);
 Decoder *get_decoder_by_content(io_stream &stream);
 void decoder_init ();
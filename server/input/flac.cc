@@ -296,8 +296,10 @@ static void fill_tag (FLAC__StreamMetadata_VorbisComment_Entry *comm,
 		tags->track = atoi (value);
 		free (value);
 	}
-	else
+	else {
+		comment_tag (*tags, name, value);
 		free (value);
+	}
 
 	free (name);
 }
@@ -358,8 +360,15 @@ struct flac_decoder : public Decoder
 	void read_tags(const str &file_name, file_tags &info) override
 	{
 		struct flac_data *data = new flac_data(file_name.c_str(), 0);
-		if (data->ok) info.time = data->length;
+		if (data->ok) {
+			info.time = data->length;
+			info.bitrate = data->avg_bitrate > 0
+				? data->avg_bitrate / 1000 : -1;
+			info.rate = data->sample_rate;
+			info.channels = data->channels;
+		}
 		delete data;
+		info.codec = "FLAC";
 
 		get_vorbiscomments (file_name.c_str(), &info);
 	}
@@ -0,0 +1,380 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "http_cache.h"
+
+#define HTTP_CACHE_DIR		"http_cache"
+#define HTTP_CACHE_MAGIC	"amochc1"
+
+/* The index file is this header, the URL and one bit per block. */
+struct http_cache_header
+{
+	char magic[8];
+	uint32_t block;
+	uint32_t url_len;
+	int64_t size;
+	char validator[128];	/* ETag or Last-Modified */
+	char mime_type[128];
+};
+
+struct http_cache
+{
+	str url;
+	str path;		/* of the files, without .idx or .data */
+	off_t size = -1;	/* -1 until the server has told us */
+	str validator;
+	str mime_type;
+	std::vector<uint8_t> blocks;	/* bitmap of the complete blocks */
+	int fd = -1;		/* the data file */
+	off_t run_start = 0, run_end = -1;	/* last data written without
+						   a gap */
+};
+
+static str cache_dir ()
+{
+	return options::run_file_path (HTTP_CACHE_DIR);
+}
+
+/* FNV-1a, to get a file name for the URL. */
+static str url_hash (const char *url)
+{
+	uint64_t h = 14695981039346656037ULL;
+	char name[17];
+
+	for (const char *p = url; *p; p++) {
+		h ^= (uint8_t)*p;
+		h *= 1099511628211ULL;
+	}
+	snprintf (name, sizeof(name), "%016" PRIx64, h);
+
+	return name;
+}
+
+static off_t num_blocks (const off_t size)
+{
+	return (size + HTTP_CACHE_BLOCK - 1) / HTTP_CACHE_BLOCK;
+}
+
+static bool block_done (const struct http_cache *c, const off_t b)
+{
+	return c->blocks[b / 8] & (1 << (b % 8));
+}
+
+static void set_block (struct http_cache *c, const off_t b, const bool done)
+{
+	if (done)
+		c->blocks[b / 8] |= 1 << (b % 8);
+	else
+		c->blocks[b / 8] &= ~(1 << (b % 8));
+}
+
+static bool load_index (struct http_cache *c)
+{
+	struct http_cache_header h;
+	bool ok = false;
+
+	int fd = open ((c->path + ".idx").c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	do {
+		if (read (fd, &h, sizeof(h)) != sizeof(h)
+				|| memcmp (h.magic, HTTP_CACHE_MAGIC, sizeof(h.magic))
+				|| h.block != HTTP_CACHE_BLOCK
+				|| h.url_len != c->url.length() || h.size < 0)
+			break;
+
+		str url (h.url_len, '\0');
+		if (read (fd, &url[0], h.url_len) != (ssize_t)h.url_len
+				|| url != c->url)
+			break; /* a collision of the hashes */
+
+		std::vector<uint8_t> blocks ((num_blocks (h.size) + 7) / 8);
+		if (read (fd, blocks.data(), blocks.size())
+				!= (ssize_t)blocks.size())
+			break;
+
+		h.validator[sizeof(h.validator) - 1] = 0;
+		h.mime_type[sizeof(h.mime_type) - 1] = 0;
+		c->size = h.size;
+		c->validator = h.validator;
+		c->mime_type = h.mime_type;
+		c->blocks = std::move (blocks);
+		ok = true;
+	} while (0);
+
+	close (fd);
+
+	return ok;
+}
+
+static void save_index (struct http_cache *c)
+{
+	struct http_cache_header h;
+
+	/* Another stream of the same URL may have fetched other blocks. */
+	struct http_cache disk;
+	disk.url = c->url;
+	disk.path = c->path;
+	if (load_index (&disk) && disk.size == c->size
+			&& disk.validator == c->validator)
+		for (size_t i = 0; i < c->blocks.size(); i++)
+			c->blocks[i] |= disk.blocks[i];
+
+	memset (&h, 0, sizeof(h));
+	memcpy (h.magic, HTTP_CACHE_MAGIC, sizeof(h.magic));
+	h.block = HTTP_CACHE_BLOCK;
+	h.url_len = c->url.length();
+	h.size = c->size;
+	strncpy (h.validator, c->validator.c_str(), sizeof(h.validator) - 1);
+	strncpy (h.mime_type, c->mime_type.c_str(), sizeof(h.mime_type) - 1);
+
+	/* Write a new file and rename it, so a crash never leaves an index
+	 * that claims blocks which are not there. */
+	const str tmp = c->path + ".tmp";
+	int fd = open (tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		log_errno ("Can't write the HTTP cache index", errno);
+		return;
+	}
+
+	bool ok = write (fd, &h, sizeof(h)) == sizeof(h)
+		&& write (fd, c->url.data(), h.url_len) == (ssize_t)h.url_len
+		&& write (fd, c->blocks.data(), c->blocks.size())
+			== (ssize_t)c->blocks.size();
+	if (!ok)
+		log_errno ("Can't write the HTTP cache index", errno);
+	close (fd);
+
+	if (!ok || rename (tmp.c_str(), (c->path + ".idx").c_str())) {
+		if (ok)
+			log_errno ("Can't rename the HTTP cache index", errno);
+		unlink (tmp.c_str());
+	}
+}
+
+/* Remove the least recently used entries until the cache fits into
+ * HTTPCacheSize. */
+static void trim ()
+{
+	struct entry { time_t used; off_t bytes; str path; };
+	std::vector<entry> entries;
+	const off_t limit = (off_t)options::HTTPCacheSize * 1024 * 1024;
+	off_t total = 0;
+
+	const str dir = cache_dir ();
+	DIR *d = opendir (dir.c_str());
+	if (!d) {
+		log_errno ("Can't open the HTTP cache", errno);
+		return;
+	}
+
+	struct dirent *e;
+	while ((e = readdir (d))) {
+		const size_t len = strlen (e->d_name);
+		if (len < 4 || strcmp (e->d_name + len - 4, ".idx"))
+			continue;
+
+		entry en;
+		en.path = dir + "/" + str (e->d_name, len - 4);
+
+		struct stat idx, data;
+		if (stat ((en.path + ".idx").c_str(), &idx))
+			continue;
+		en.used = idx.st_mtime;
+		/* the data files are sparse */
+		en.bytes = stat ((en.path + ".data").c_str(), &data) ? 0
+			: (off_t)data.st_blocks * 512;
+
+		total += en.bytes;
+		entries.push_back (std::move (en));
+	}
+	closedir (d);
+
+	if (total <= limit)
+		return;
+
+	std::sort (entries.begin(), entries.end(),
+			[](const entry &a, const entry &b) { return a.used < b.used; });
+
+	for (auto &en : entries) {
+		if (total <= limit)
+			break;
+		debug ("Removing %s from the HTTP cache", en.path.c_str());
+		unlink ((en.path + ".idx").c_str());
+		unlink ((en.path + ".data").c_str());
+		total -= en.bytes;
+	}
+}
+
+/* Open the cache entry of url, which may be empty. Returns NULL if the cache
+ * is disabled. */
+struct http_cache *http_cache_open (const char *url)
+{
+	if (!options::HTTPCacheSize)
+		return NULL;
+
+	auto *c = new http_cache;
+	c->url = url;
+	c->path = cache_dir () + "/" + url_hash (url);
+
+	if (load_index (c)) {
+		c->fd = open ((c->path + ".data").c_str(), O_RDWR);
+		if (c->fd == -1) {
+			c->size = -1;
+			c->blocks.clear ();
+		}
+		else
+			debug ("Found %s in the HTTP cache", url);
+	}
+
+	return c;
+}
+
+void http_cache_close (struct http_cache *c)
+{
+	if (!c)
+		return;
+
+	if (c->fd != -1) {
+		close (c->fd);
+		save_index (c);
+		trim ();
+	}
+
+	delete c;
+}
+
+/* Size of the resource, -1 if unknown. */
+off_t http_cache_size (const struct http_cache *c)
+{
+	return c->size;
+}
+
+const char *http_cache_mime_type (const struct http_cache *c)
+{
+	return c->mime_type.empty() ? NULL : c->mime_type.c_str();
+}
+
+/* ETag or Last-Modified of the cached blocks, NULL if the server sent none. */
+const char *http_cache_validator (const struct http_cache *c)
+{
+	return c->validator.empty() ? NULL : c->validator.c_str();
+}
+
+/* Check the entry against what the server says about the resource, and start
+ * afresh if it has changed. Returns false if cached blocks were dropped. */
+bool http_cache_validate (struct http_cache *c, const off_t size,
+		const char *validator, const char *mime_type)
+{
+	if (!validator)
+		validator = "";
+
+	if (c->size == size && c->validator == validator) {
+		if (mime_type)
+			c->mime_type = mime_type;
+		return true;
+	}
+
+	const bool had = c->size != -1 && std::any_of (c->blocks.begin(),
+			c->blocks.end(), [](uint8_t b) { return b != 0; });
+	if (had)
+		logit ("%s has changed, dropping it from the HTTP cache",
+				c->url.c_str());
+
+	c->size = size;
+	c->validator = validator;
+	c->mime_type = mime_type ? mime_type : "";
+	c->blocks.assign ((num_blocks (size) + 7) / 8, 0);
+	c->run_end = -1;
+
+	if (c->fd == -1) {
+		mkdir (cache_dir().c_str(), 0700);
+		c->fd = open ((c->path + ".data").c_str(), O_RDWR | O_CREAT, 0600);
+		if (c->fd == -1)
+			log_errno ("Can't create an HTTP cache file", errno);
+	}
+	if (c->fd != -1 && ftruncate (c->fd, 0))
+		log_errno ("ftruncate() failed", errno);
+
+	return !had;
+}
+
+/* Is the block pos is in complete? */
+bool http_cache_has (const struct http_cache *c, const off_t pos)
+{
+	return c->fd != -1 && pos >= 0 && pos < c->size
+		&& block_done (c, pos / HTTP_CACHE_BLOCK);
+}
+
+/* Return where the cached data from pos on starts: pos if its block is
+ * complete, otherwise the start of the next complete block, or the size if
+ * there is none. */
+off_t http_cache_next (const struct http_cache *c, const off_t pos)
+{
+	if (http_cache_has (c, pos))
+		return pos;
+
+	for (off_t b = pos / HTTP_CACHE_BLOCK + 1; b < num_blocks (c->size); b++)
+		if (block_done (c, b))
+			return b * HTTP_CACHE_BLOCK;
+
+	return c->size;
+}
+
+/* Read from the complete blocks from pos on. Returns 0 if the block at pos
+ * isn't complete. */
+ssize_t http_cache_read (struct http_cache *c, const off_t pos, char *buf,
+		size_t count)
+{
+	off_t end = pos;
+
+	while (end < pos + (off_t)count && http_cache_has (c, end))
+		end = (end / HTTP_CACHE_BLOCK + 1) * HTTP_CACHE_BLOCK;
+	end = MIN(end, MIN(pos + (off_t)count, c->size));
+	if (end <= pos)
+		return 0;
+
+	ssize_t n = pread (c->fd, buf, end - pos, pos);
+	if (n <= 0) {
+		/* the file was damaged, fetch the block again */
+		if (n < 0)
+			log_errno ("Can't read from the HTTP cache", errno);
+		set_block (c, pos / HTTP_CACHE_BLOCK, false);
+		return 0;
+	}
+
+	return n;
+}
+
+/* Store data fetched from pos. A block is complete once all of it was
+ * written without a gap. */
+void http_cache_write (struct http_cache *c, const off_t pos,
+		const char *data, size_t len)
+{
+	if (c->fd == -1 || pos >= c->size)
+		return;
+
+	len = MIN(len, (size_t)(c->size - pos));
+	if (pwrite (c->fd, data, len, pos) != (ssize_t)len) {
+		log_errno ("Can't write to the HTTP cache", errno);
+		c->run_end = -1;
+		return;
+	}
+
+	if (pos != c->run_end)
+		c->run_start = pos;
+	c->run_end = pos + len;
+
+	for (off_t b = pos / HTTP_CACHE_BLOCK;
+			b * HTTP_CACHE_BLOCK < c->run_end; b++) {
+		const off_t start = b * HTTP_CACHE_BLOCK;
+		const off_t end = MIN(start + HTTP_CACHE_BLOCK, c->size);
+
+		if (start >= c->run_start && end <= c->run_end)
+			set_block (c, b, true);
+	}
+}
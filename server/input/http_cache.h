@@ -0,0 +1,29 @@
+#pragma once
+#include <sys/types.h>
+
+/* Remote files that can be fetched in ranges are kept on disk in RunDir,
+ * in blocks of HTTP_CACHE_BLOCK bytes: a sparse data file plus an index of
+ * the blocks that are complete. Seeking back, playing the file again or
+ * opening it to read its tags then only fetch the blocks that are missing.
+ * The entries are dropped oldest first when they take more than
+ * HTTPCacheSize megabytes. */
+
+#define HTTP_CACHE_BLOCK	(64 * 1024)
+
+struct http_cache;
+
+struct http_cache *http_cache_open (const char *url);
+void http_cache_close (struct http_cache *c);
+
+off_t http_cache_size (const struct http_cache *c);
+const char *http_cache_mime_type (const struct http_cache *c);
+const char *http_cache_validator (const struct http_cache *c);
+bool http_cache_validate (struct http_cache *c, const off_t size,
+		const char *validator, const char *mime_type);
+
+bool http_cache_has (const struct http_cache *c, const off_t pos);
+off_t http_cache_next (const struct http_cache *c, const off_t pos);
+ssize_t http_cache_read (struct http_cache *c, const off_t pos, char *buf,
+		size_t count);
+void http_cache_write (struct http_cache *c, const off_t pos,
+		const char *data, size_t len);
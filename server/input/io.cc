@@ -27,6 +27,8 @@
 
 #include "io.h"
 #include "io_curl.h"
+#include "io_uring_file.h"
+#include "io_reactor.h"
 
 #ifdef HAVE_MMAP
 static void *io_mmap_file (const struct io_stream *s)
@@ -56,17 +58,25 @@ static void *io_mmap_file (const struct io_stream *s)
 #endif
 
 #ifdef HAVE_MMAP
-static ssize_t io_read_mmap (struct io_stream *s, const int dont_move,
-		void *buf, size_t count)
+/* Check the file size only every this many reads (and whenever a read gets
+ * to the end of the mapping, where a growing file would show). */
+#define IO_MMAP_STAT_READS	64
+
+/* Remap the file if its size has changed. Return 0 on error. */
+static int io_mmap_check_size (struct io_stream *s, const size_t count)
 {
 	struct stat file_stat;
-	size_t to_read;
 
-	assert (s->mem != NULL);
+	if (s->mem_borrowed)
+		return 1;
+	if (++s->mem_reads < IO_MMAP_STAT_READS
+			&& s->mem_pos + (off_t)count < s->size)
+		return 1;
+	s->mem_reads = 0;
 
 	if (fstat (s->fd, &file_stat) == -1) {
 		log_errno ("fstat() failed", errno);
-		return -1;
+		return 0;
 	}
 
 	if (s->size != file_stat.st_size) {
@@ -74,18 +84,32 @@ static ssize_t io_read_mmap (struct io_stream *s, const int dont_move,
 
 		if (munmap (s->mem, (size_t)s->size)) {
 			log_errno ("munmap() failed", errno);
-			return -1;
+			return 0;
 		}
 
 		s->size = file_stat.st_size;
 		s->mem = io_mmap_file (s);
 		if (!s->mem)
-			return -1;
+			return 0;
 
 		if (s->mem_pos > s->size)
 			logit ("File shrunk");
 	}
 
+	return 1;
+}
+
+static ssize_t io_read_mmap (struct io_stream *s, const int dont_move,
+		void *buf, size_t count)
+{
+	size_t to_read;
+
+	assert (s->mem != NULL);
+	assert (!s->mem_borrowed);
+
+	if (!io_mmap_check_size (s, count))
+		return -1;
+
 	if (s->mem_pos >= s->size)
 		return 0;
 
@@ -139,6 +163,11 @@ static ssize_t io_internal_read (struct io_stream *s, const int dont_move,
 			fatal ("You can't peek data directly from CURL!");
 		res = io_curl_read (s, buf, count);
 		break;
+#ifdef HAVE_IO_URING
+	case IO_SOURCE_URING:
+		res = io_uring_file_read (s, dont_move, buf, count);
+		break;
+#endif
 	default:
 		fatal ("Unknown io_stream->source: %d", s->source);
 	}
@@ -162,14 +191,15 @@ static off_t io_seek_buffered (struct io_stream *s, const off_t where)
 {
 	off_t res = -1;
 
-	assert (s->source != IO_SOURCE_CURL);
-
 	logit ("Seeking...");
 
 	switch (s->source) {
 	case IO_SOURCE_FD:
 		res = io_seek_fd (s, where);
 		break;
+	case IO_SOURCE_CURL:
+		res = io_curl_seek (s, where);
+		break;
 #ifdef HAVE_MMAP
 	case IO_SOURCE_MMAP:
 		res = io_seek_mmap (s, where);
@@ -181,10 +211,12 @@ static off_t io_seek_buffered (struct io_stream *s, const off_t where)
 
 	LOCK (s->buf_mtx);
 	s->buf->clear();
-	pthread_cond_signal (&s->buf_free_cond);
-	s->after_seek = 1;
 	s->eof = 0;
+	s->parked = 0;
+	s->last_put = -1;
+	s->primed = 0;
 	UNLOCK (s->buf_mtx);
+	io_reactor_wake ();
 
 	return res;
 }
@@ -193,21 +225,31 @@ static off_t io_seek_unbuffered (struct io_stream *s, const off_t where)
 {
 	off_t res = -1;
 
-	assert (s->source != IO_SOURCE_CURL);
-
 	switch (s->source) {
 #ifdef HAVE_MMAP
 	case IO_SOURCE_MMAP:
 		res = io_seek_mmap (s, where);
+		s->mem_borrowed = 0;
 		break;
 #endif
 	case IO_SOURCE_FD:
 		res = io_seek_fd (s, where);
 		break;
+	case IO_SOURCE_CURL:
+		res = io_curl_seek (s, where);
+		break;
+#ifdef HAVE_IO_URING
+	case IO_SOURCE_URING:
+		res = io_uring_file_seek (s, where);
+		break;
+#endif
 	default:
 		fatal ("Unknown io_stream->source: %d", s->source);
 	}
 
+	if (res != -1)
+		s->eof = 0;
+
 	return res;
 }
 
@@ -218,7 +260,7 @@ off_t io_seek (struct io_stream *s, off_t offset, int whence)
 	assert (s != NULL);
 	assert (s->opened);
 
-	if (s->source == IO_SOURCE_CURL || !io_ok(s))
+	if (!io_seekable(s) || !io_ok(s))
 		return -1;
 
 	LOCK (s->io_mtx);
@@ -267,13 +309,12 @@ void io_abort (struct io_stream *s)
 {
 	assert (s != NULL);
 
-	if (s->buffered && !s->stop_read_thread) {
+	if (s->buffered && !s->aborted) {
 		logit ("Aborting...");
 		LOCK (s->buf_mtx);
-		s->stop_read_thread = 1;
+		s->aborted = 1;
 		io_wake_up (s);
 		pthread_cond_broadcast (&s->buf_fill_cond);
-		pthread_cond_broadcast (&s->buf_free_cond);
 		UNLOCK (s->buf_mtx);
 		logit ("done");
 	}
@@ -292,9 +333,7 @@ void io_close (struct io_stream *s)
 		if (s->buffered) {
 			io_abort (s);
 
-			logit ("Waiting for io_read_thread()...");
-			pthread_join (s->read_thread, NULL);
-			logit ("IO read thread exited");
+			io_reactor_remove (s);
 		}
 
 		switch (s->source) {
@@ -311,6 +350,12 @@ void io_close (struct io_stream *s)
 		case IO_SOURCE_CURL:
 			io_curl_close (s);
 			break;
+#ifdef HAVE_IO_URING
+		case IO_SOURCE_URING:
+			io_uring_file_close (s);
+			close (s->fd);
+			break;
+#endif
 		default:
 			fatal ("Unknown io_stream->source: %d", s->source);
 		}
@@ -320,9 +365,6 @@ void io_close (struct io_stream *s)
 		if (s->buffered) {
 			delete s->buf;
 			s->buf = NULL;
-			rc = pthread_cond_destroy (&s->buf_free_cond);
-			if (rc != 0)
-				log_errno ("Destroying buf_free_cond failed", rc);
 			rc = pthread_cond_destroy (&s->buf_fill_cond);
 			if (rc != 0)
 				log_errno ("Destroying buf_fill_cond failed", rc);
@@ -351,93 +393,6 @@ void io_close (struct io_stream *s)
 	logit ("done");
 }
 
-static void *io_read_thread (void *data)
-{
-	struct io_stream *s = (struct io_stream *)data;
-
-	logit ("IO read thread created");
-
-	while (!s->stop_read_thread) {
-		char read_buf[8096];
-		int read_buf_fill = 0;
-		int read_buf_pos = 0;
-
-		LOCK (s->io_mtx);
-
-		LOCK (s->buf_mtx);
-		s->after_seek = 0;
-		UNLOCK (s->buf_mtx);
-
-		read_buf_fill = io_internal_read (s, 0, read_buf, sizeof(read_buf));
-		UNLOCK (s->io_mtx);
-		if (read_buf_fill > 0)
-
-		LOCK (s->buf_mtx);
-
-		if (s->stop_read_thread) {
-			UNLOCK (s->buf_mtx);
-			break;
-		}
-
-		if (read_buf_fill < 0) {
-			s->errno_val = errno;
-			s->read_error = 1;
-			logit ("Exiting due to read error.");
-			pthread_cond_broadcast (&s->buf_fill_cond);
-			UNLOCK (s->buf_mtx);
-			break;
-		}
-
-		if (read_buf_fill == 0) {
-			s->eof = 1;
-			debug ("EOF, waiting");
-			pthread_cond_broadcast (&s->buf_fill_cond);
-			pthread_cond_wait (&s->buf_free_cond, &s->buf_mtx);
-			debug ("Got signal");
-			UNLOCK (s->buf_mtx);
-			continue;
-		}
-
-		s->eof = 0;
-
-		while (read_buf_pos < read_buf_fill && !s->after_seek) {
-			size_t put;
-
-			put = s->buf->put(
-					read_buf + read_buf_pos,
-					read_buf_fill - read_buf_pos);
-
-			if (s->stop_read_thread)
-				break;
-
-			if (put > 0) {
-				if (s->buf_fill_callback) {
-					UNLOCK (s->buf_mtx);
-					s->buf_fill_callback (s,
-						s->buf->get_fill(),
-						s->buf->get_size(),
-						s->buf_fill_callback_data);
-					LOCK (s->buf_mtx);
-				}
-				pthread_cond_broadcast (&s->buf_fill_cond);
-				read_buf_pos += put;
-				continue;
-			}
-
-			pthread_cond_wait (&s->buf_free_cond, &s->buf_mtx);
-		}
-
-		UNLOCK (s->buf_mtx);
-	}
-
-	if (s->stop_read_thread)
-		logit ("Stop request");
-
-	logit ("Exiting IO read thread");
-
-	return NULL;
-}
-
 static void io_open_file (struct io_stream *s, const char *file)
 {
 	struct stat file_stat;
@@ -460,6 +415,14 @@ static void io_open_file (struct io_stream *s, const char *file)
 		s->size = file_stat.st_size;
 		s->opened = 1;
 
+#ifdef HAVE_IO_URING
+		if (options::UseIOUring) {
+			if (io_uring_file_open (s, file))
+				break;
+			logit ("Can't use io_uring, falling back to read()");
+		}
+#endif
+
 #ifdef HAVE_MMAP
 		if (!options::UseMMap) {
 			logit ("Not using mmap()");
@@ -473,6 +436,8 @@ static void io_open_file (struct io_stream *s, const char *file)
 
 		s->source = IO_SOURCE_MMAP;
 		s->mem_pos = 0;
+		s->mem_reads = 0;
+		s->mem_borrowed = 0;
 #endif
 	} while (0);
 }
@@ -480,7 +445,6 @@ static void io_open_file (struct io_stream *s, const char *file)
 /* Open the file. */
 struct io_stream *io_open (const char *file, const int buffered)
 {
-	int rc;
 	struct io_stream *s;
 
 	assert (file != NULL);
@@ -508,22 +472,30 @@ struct io_stream *io_open (const char *file, const int buffered)
 	if (!s->opened)
 		return s;
 
-	s->stop_read_thread = 0;
+	s->aborted = 0;
 	s->eof = 0;
-	s->after_seek = 0;
-	s->buffered = buffered;
+	/* A mmap()ed file is in memory already, the reactor would only copy
+	 * it once more. io_uring reads ahead by itself. */
+	s->buffered = buffered && s->source != IO_SOURCE_MMAP
+		&& s->source != IO_SOURCE_URING;
 	s->pos = 0;
 
-	if (buffered) {
+	if (s->buffered) {
 		s->buf = new fifo_buf (options::InputBuffer * 1024);
 		s->prebuffer = options::Prebuffering * 1024;
+		s->want = SIZE_MAX;
+		s->parked = 0;
+		s->last_put = -1;
+		s->win_bytes = 0;
+		s->win_ms = 0;
+		s->rate = 0;
+		s->stall = 0;
+		s->primed = 0;
+		s->underruns = 0;
 
-		pthread_cond_init (&s->buf_free_cond, NULL);
 		pthread_cond_init (&s->buf_fill_cond, NULL);
 
-		rc = pthread_create (&s->read_thread, NULL, io_read_thread, s);
-		if (rc != 0)
-			fatal ("Can't create read thread: %s", xstrerror (errno));
+		io_reactor_add (s);
 	}
 
 	return s;
@@ -547,8 +519,16 @@ int io_ok (struct io_stream *s)
 	return res;
 }
 
+/* How full the buffer of s surely gets: the reactor stops filling it when
+ * less than a chunk is free, and the source may deliver any amount at once,
+ * so waiting for more than this could take forever. */
+static size_t fill_max (const struct io_stream *s)
+{
+	return s->buf->get_size() - io_reactor_chunk (s);
+}
+
 /* Read data from the buffer without removing them, so stream position is
- * unchanged. You can't peek more data than the buffer size. */
+ * unchanged. You can't peek more data than fill_max(). */
 static ssize_t io_peek_internal (struct io_stream *s, void *buf, size_t count)
 {
 	ssize_t received = 0;
@@ -558,11 +538,11 @@ static ssize_t io_peek_internal (struct io_stream *s, void *buf, size_t count)
 	LOCK (s->buf_mtx);
 
 	/* Wait until enough data will be available */
-	while (io_ok_nolock(s) && !s->stop_read_thread
-			&& count > s->buf->get_fill()
-			&& s->buf->get_space()
+	while (io_ok_nolock(s) && !s->aborted
+			&& MIN(count, fill_max(s)) > s->buf->get_fill()
 			&& !s->eof) {
 		debug ("waiting...");
+		s->want = MIN(s->want, MIN(count, fill_max(s)));
 		pthread_cond_wait (&s->buf_fill_cond, &s->buf_mtx);
 	}
 
@@ -574,34 +554,89 @@ static ssize_t io_peek_internal (struct io_stream *s, void *buf, size_t count)
 	return io_ok(s) ? received : -1;
 }
 
-/* Wait until there are s->prebuffer bytes in the buffer or some event
- * occurs which prevents prebuffering. */
+/* Wait until there are to_fill bytes in the buffer or some event occurs
+ * which prevents prebuffering. Until then the stream goes before the others
+ * that have reached their target. */
 void io_prebuffer (struct io_stream *s, const size_t to_fill)
 {
+	if (!s->buffered)
+		return;
+
 	LOCK (s->buf_mtx);
-	while (io_ok_nolock(s) && !s->stop_read_thread && !s->eof
-	                       && to_fill > s->buf->get_fill()) {
+	s->prebuffer = MIN(to_fill, fill_max(s));
+	while (io_ok_nolock(s) && !s->aborted && !s->eof
+	                       && s->prebuffer > s->buf->get_fill()) {
+		s->want = MIN(s->want, s->prebuffer);
 		pthread_cond_wait (&s->buf_fill_cond, &s->buf_mtx);
 	}
 	UNLOCK (s->buf_mtx);
 }
 
+/* Get how well the source of s keeps up. */
+void io_get_stats (struct io_stream *s, struct io_stats *stats)
+{
+	memset (stats, 0, sizeof(*stats));
+	if (!s->buffered)
+		return;
+
+	LOCK (s->buf_mtx);
+	stats->rate = s->rate;
+	stats->stall = s->stall;
+	stats->underruns = s->underruns;
+	stats->fill = s->buf->get_fill ();
+	stats->size = s->buf->get_size ();
+	stats->prebuffer = s->prebuffer;
+	UNLOCK (s->buf_mtx);
+}
+
+/* Wake the reactor if it is waiting for space in the buffer and there is
+ * enough now. */
+static void io_unpark (struct io_stream *s)
+{
+	if (s->parked && s->buf->get_space() >= io_reactor_chunk (s)) {
+		s->parked = 0;
+		s->last_put = -1; /* it was us, not the source, who held it */
+		io_reactor_wake ();
+	}
+}
+
+/* Make the buffer of s hold at least size bytes. */
+void io_grow_buffer (struct io_stream *s, const size_t size)
+{
+	if (!s->buffered)
+		return;
+
+	LOCK (s->buf_mtx);
+	if (size > s->buf->get_size()) {
+		debug ("Growing the input buffer to %zuKB", size / 1024);
+		s->buf->resize (size);
+		io_unpark (s);
+	}
+	UNLOCK (s->buf_mtx);
+}
+
 static ssize_t io_read_buffered (struct io_stream *s, void *buf, size_t count)
 {
 	ssize_t received = 0;
 
 	LOCK (s->buf_mtx);
 
-	while (received < (ssize_t)count && !s->stop_read_thread
+	while (received < (ssize_t)count && !s->aborted
 			&& ((!s->eof && !s->read_error)
 				|| s->buf->get_fill())) {
 		if (s->buf->get_fill()) {
 			received += s->buf->get((char *)buf + received,
 					count - received);
-			pthread_cond_signal (&s->buf_free_cond);
+			io_unpark (s);
 			continue;
 		}
 
+		if (s->primed) {
+			s->underruns++;
+			s->primed = 0;
+			debug ("Buffer underrun");
+		}
+		s->want = MIN(s->want, MIN(count - received, fill_max(s)));
 		pthread_cond_wait (&s->buf_fill_cond, &s->buf_mtx);
 	}
 
@@ -623,9 +658,11 @@ static ssize_t io_read_unbuffered (struct io_stream *s, const int dont_move,
 
 	res = io_internal_read (s, dont_move, (char*) buf, count);
 
-	if (!dont_move) {
+	if (!dont_move && res >= 0) {
 		s->pos += res;
-		if (res == 0)
+		if (res == 0 || ((s->source == IO_SOURCE_MMAP
+						|| s->source == IO_SOURCE_URING)
+					&& s->pos >= s->size))
 			s->eof = 1;
 	}
 
@@ -670,6 +707,57 @@ ssize_t io_peek (struct io_stream *s, void *buf, size_t count)
 	return io_ok(s) ? received : -1;
 }
 
+/* Lend between min and max bytes at the current position straight from the
+ * mmap()ed file, so the caller can parse them without copying. *len is set
+ * to the number of bytes lent. Returns NULL (and *len is 0) if the stream
+ * can't do that or fewer than min bytes are left; io_read() works then.
+ * Until io_release() the stream must not be used otherwise. */
+const char *io_borrow (struct io_stream *s, size_t min, size_t max,
+		size_t *len)
+{
+	assert (s != NULL);
+	assert (s->opened);
+	assert (min <= max);
+
+	*len = 0;
+
+#ifdef HAVE_MMAP
+	if (s->source != IO_SOURCE_MMAP || s->buffered)
+		return NULL;
+
+	assert (!s->mem_borrowed);
+
+	if (!io_mmap_check_size (s, max) || s->mem_pos >= s->size
+			|| (size_t)(s->size - s->mem_pos) < min)
+		return NULL;
+
+	*len = MIN(max, (size_t)(s->size - s->mem_pos));
+	s->mem_borrowed = 1;
+
+	return (const char *)s->mem + s->mem_pos;
+#else
+	return NULL;
+#endif
+}
+
+/* Give back the span from io_borrow(), of which the first used bytes were
+ * consumed: the stream position moves past them. */
+void io_release (struct io_stream *s, size_t used)
+{
+	assert (s != NULL);
+
+#ifdef HAVE_MMAP
+	assert (s->mem_borrowed);
+	assert (s->mem_pos + (off_t)used <= s->size);
+
+	s->mem_pos += used;
+	s->pos += used;
+	s->mem_borrowed = 0;
+	if (s->pos >= s->size)
+		s->eof = 1;
+#endif
+}
+
 /* Get the string describing the error associated with the stream. */
 char *io_strerror (struct io_stream *s)
 {
@@ -721,7 +809,7 @@ int io_eof (struct io_stream *s)
 
 	LOCK (s->buf_mtx);
 	eof = (s->eof && (!s->buffered || !s->buf->get_fill())) ||
-		s->stop_read_thread;
+		s->aborted;
 	UNLOCK (s->buf_mtx);
 
 	return eof;
@@ -734,6 +822,7 @@ void io_init ()
 
 void io_cleanup ()
 {
+	io_reactor_exit ();
 	io_curl_cleanup ();
 }
 
@@ -807,5 +896,7 @@ void io_set_buf_fill_callback (struct io_stream *s,
 /* Return a non-zero value if the stream is seekable. */
 int io_seekable (const struct io_stream *s)
 {
-	return s->source == IO_SOURCE_FD || s->source == IO_SOURCE_MMAP;
+	return s->source == IO_SOURCE_FD || s->source == IO_SOURCE_MMAP
+		|| s->source == IO_SOURCE_URING
+		|| (s->source == IO_SOURCE_CURL && s->curl.ranges);
 }
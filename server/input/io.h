@@ -1,6 +1,7 @@
 #pragma once
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <sys/socket.h>     /* curl sometimes needs this */
 #include <curl/curl.h>
@@ -11,7 +12,8 @@ enum io_source
 {
 	IO_SOURCE_FD,
 	IO_SOURCE_MMAP,
-	IO_SOURCE_CURL
+	IO_SOURCE_CURL,
+	IO_SOURCE_URING
 };
 
 struct io_stream_curl
@@ -37,9 +39,47 @@ struct io_stream_curl
 				   0 - disabled, in bytes */
 	size_t icy_meta_count;	/* how many bytes was read from the last
 				   metadata packet */
+	int paused;	/* did write_cb() pause the transfer because buf
+			   is full? */
+	int64_t timer;	/* when curl wants to be called again (for buffered
+			   streams, see io_reactor.cc), -1 if never */
+	int attached;	/* is the IO reactor running the transfers? */
+
+	/* Resources that can be fetched in ranges are seekable. */
+	int ranges;	/* can this one? */
+	struct http_cache *cache;	/* blocks fetched so far, or NULL */
+	off_t pos;	/* offset of the next byte to read, where buf starts */
+	off_t xfer_pos;	/* offset of the next byte curl gives us */
+	off_t seek_to;	/* seek left for the IO reactor to do, or -1 */
+	int started;	/* were the headers of this transfer checked? */
+	int partial;	/* did the server send only the range we asked
+			   for? */
+	int stopped;	/* write_cb() stopped at a block that is cached */
+	int from_cache;	/* was anything read from the cache? */
+	int revalidate;	/* opened with a cached start, which is not read
+			   until the server has confirmed it */
+	struct curl_slist *revalidate_headers;	/* http_headers and
+						   If-Range for that */
+
+	/* from the headers of the last response */
+	int accept_ranges;
+	off_t total;	/* size of the resource or -1 */
+	char *validator;	/* ETag or Last-Modified */
 };
 
 struct io_stream;
+struct io_stream_uring;
+
+/* See io_get_stats(). */
+struct io_stats
+{
+	double rate;	/* bytes per second the source delivers, 0 if unknown */
+	int stall;	/* longest recent wait for data in ms */
+	int underruns;
+	size_t fill;	/* of the buffer */
+	size_t size;
+	size_t prebuffer;
+};
 
 typedef void (*buf_fill_callback_t) (struct io_stream *s, size_t fill,
 		size_t buf_size, void *data_ptr);
@@ -54,27 +94,45 @@ struct io_stream
 	char *strerror;	/* error string */
 	int opened;	/* was the stream opened (open(), mmap(), etc.)? */
 	int eof;	/* was the end of file reached? */
-	int after_seek;	/* are we after seek and need to do fresh read()? */
 	int buffered;	/* are we using the buffer? */
 	off_t pos;	/* current position in the file from the user point of view */
-	size_t prebuffer;	/* number of bytes left to prebuffer */
+	size_t prebuffer;	/* fill the buffer up to this before other
+				   streams get more */
 	pthread_mutex_t io_mtx;	/* mutex for IO operations */
 
 #ifdef HAVE_MMAP
 	void *mem;
 	off_t mem_pos;
+	int mem_reads;	/* reads since the file size was last checked */
+	int mem_borrowed;	/* is there a span out from io_borrow()? */
+#endif
+
+#ifdef HAVE_IO_URING
+	struct io_stream_uring *uring;
 #endif
 
 	struct io_stream_curl curl;
 
+	/* The buffer is filled by the IO reactor (see io_reactor.cc). */
 	fifo_buf *buf;
 	pthread_mutex_t buf_mtx;
-	pthread_cond_t buf_free_cond; /* some space became available in the
-					 buffer */
-	pthread_cond_t buf_fill_cond; /* the buffer was filled with some data */
-	pthread_t read_thread;
-	int stop_read_thread;		/* request for stopping the read
-					   thread */
+	pthread_cond_t buf_fill_cond; /* the buffer was filled up to want */
+	size_t want;	/* smallest fill somebody is waiting for */
+	int parked;	/* the reactor found the buffer full and waits
+			   for io_reactor_wake() */
+	int reading;	/* a file reader is filling buf (see io_reactor.cc) */
+	int aborted;	/* stop filling the buffer */
+
+	/* How the data arrive, kept by the IO reactor (see io_get_stats()) */
+	int64_t last_put;	/* when data were last put into buf (ms), -1 if
+				   the time until the next put means nothing */
+	size_t win_bytes;	/* data put in the current measuring window */
+	int64_t win_ms;		/* and the time it took */
+	double rate;	/* bytes per second, while there was space in buf */
+	int stall;	/* longest wait for data in ms, slowly forgotten */
+	int primed;	/* has buf reached the prebuffering target since it
+			   was emptied by opening or seeking? */
+	int underruns;	/* reads that found buf empty after that */
 
 	struct stream_metadata {
 		pthread_mutex_t mtx;
@@ -90,6 +148,9 @@ struct io_stream
 struct io_stream *io_open (const char *file, const int buffered);
 ssize_t io_read (struct io_stream *s, void *buf, size_t count);
 ssize_t io_peek (struct io_stream *s, void *buf, size_t count);
+const char *io_borrow (struct io_stream *s, size_t min, size_t max,
+		size_t *len);
+void io_release (struct io_stream *s, size_t used);
 off_t io_seek (struct io_stream *s, off_t offset, int whence);
 void io_close (struct io_stream *s);
 int io_ok (struct io_stream *s);
@@ -107,6 +168,8 @@ char *io_get_metadata_url (struct io_stream *s);
 void io_set_metadata_title (struct io_stream *s, const char *title);
 void io_set_metadata_url (struct io_stream *s, const char *url);
 void io_prebuffer (struct io_stream *s, const size_t to_fill);
+void io_get_stats (struct io_stream *s, struct io_stats *stats);
+void io_grow_buffer (struct io_stream *s, const size_t size);
 void io_set_buf_fill_callback (struct io_stream *s,
 		buf_fill_callback_t callback, void *data_ptr);
 int io_seekable (const struct io_stream *s);
@@ -19,12 +19,58 @@
 #include <errno.h>
 #include <assert.h>
 #include <stdint.h>
+#include <inttypes.h>
 
 #include "io.h"
 #include "io_curl.h"
+#include "http_cache.h"
+
+/* How much a buffered stream may have in curl.buf before the transfer is
+ * paused until the reactor has taken some of it. */
+#define CURL_BUF_MAX	(256 * 1024)
 
 static char user_agent[] = PACKAGE_NAME "/" PACKAGE_VERSION;
 
+/* All transfers share DNS lookups and TLS sessions. Those that the IO
+ * reactor runs also share their connections, so the next file from the
+ * same server doesn't have to connect again. curl can't share connections
+ * between threads, but the reactor only runs curl under its lock. */
+static CURLSH *share;
+static CURLSH *reactor_share;
+static pthread_mutex_t share_mtx[CURL_LOCK_DATA_LAST];
+
+static void share_lock (CURL *handle, curl_lock_data data,
+		curl_lock_access access, void *userp)
+{
+	LOCK (share_mtx[data]);
+}
+
+static void share_unlock (CURL *handle, curl_lock_data data, void *userp)
+{
+	UNLOCK (share_mtx[data]);
+}
+
+static CURLSH *new_share (const bool connections)
+{
+	CURLSH *sh = curl_share_init ();
+
+	if (!sh) {
+		logit ("curl_share_init() returned NULL");
+		return NULL;
+	}
+
+	curl_share_setopt (sh, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt (sh, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt (sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt (sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	if (connections)
+		curl_share_setopt (sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+	return sh;
+}
+
 void io_curl_init ()
 {
 	char *ptr;
@@ -35,26 +81,135 @@ void io_curl_init ()
 	}
 
 	curl_global_init (CURL_GLOBAL_NOTHING);
+
+	for (auto &m : share_mtx)
+		pthread_mutex_init (&m, NULL);
+	share = new_share (false);
+	reactor_share = new_share (true);
 }
 
 void io_curl_cleanup ()
 {
+	if (share && curl_share_cleanup (share) != CURLSHE_OK)
+		logit ("curl_share_cleanup() failed");
+	if (reactor_share && curl_share_cleanup (reactor_share) != CURLSHE_OK)
+		logit ("curl_share_cleanup() failed");
+	share = reactor_share = NULL;
+
 	curl_global_cleanup ();
 }
 
+/* Look at the response once its headers are in: can the resource be fetched
+ * in ranges, and where does the data start? Return 0 to abort. */
+static int check_response (struct io_stream *s)
+{
+	long code = 0;
+
+	curl_easy_getinfo (s->curl.handle, CURLINFO_RESPONSE_CODE, &code);
+	s->curl.partial = code == 206;
+
+	/* The first response after opening from the cache: if the resource
+	 * has changed, take it as it is now (nothing was read yet). */
+	if (s->curl.revalidate) {
+		s->curl.revalidate = 0;
+		if (!s->curl.partial || s->curl.total != s->size) {
+			logit ("The cached start of the remote file is stale");
+			s->size = -1;
+			s->curl.ranges = 0;
+		}
+	}
+
+	if (!s->curl.partial) {
+		curl_off_t length = -1;
+
+		if (s->curl.xfer_pos)
+			logit ("The server ignored the range request");
+		s->curl.xfer_pos = 0;
+
+		curl_easy_getinfo (s->curl.handle,
+				CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+		s->curl.total = length > 0 ? (off_t)length : -1;
+	}
+
+	if (s->size == -1 && s->curl.total > 0 && !s->curl.icy_meta_int
+			&& (s->curl.accept_ranges || s->curl.partial)) {
+		s->size = s->curl.total;
+		s->curl.ranges = 1;
+		debug ("Can fetch ranges of %" PRId64 " bytes", s->size);
+	}
+
+	if (!s->curl.ranges) {
+		http_cache_close (s->curl.cache);
+		s->curl.cache = NULL;
+		return 1;
+	}
+
+	/* Has it changed since we have read from it (or the cache)? */
+	if ((s->curl.cache && !http_cache_validate (s->curl.cache,
+					s->curl.total, s->curl.validator,
+					s->curl.mime_type)
+				&& s->curl.from_cache)
+			|| s->curl.total != s->size) {
+		logit ("The remote file has changed");
+		s->errno_val = ESTALE;
+		return 0;
+	}
+
+	return 1;
+}
+
 static size_t write_cb (void *data, size_t size, size_t nmemb,
 		void *stream)
 {
 	struct io_stream *s = (struct io_stream *)stream;
 	size_t buf_start = s->curl.buf_fill;
 	size_t data_size = size * nmemb;
+	size_t len = data_size;
+	size_t skip = 0;
+
+	if (!s->curl.started) {
+		s->curl.started = 1;
+		if (!check_response (s))
+			return 0;
+	}
+
+	if (s->buffered && s->curl.buf_fill >= CURL_BUF_MAX) {
+		debug ("Buffer full, pausing");
+		s->curl.paused = 1;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	if (s->curl.ranges) {
+		const off_t from = s->curl.xfer_pos;
+
+		/* Stop where the cache can take over, returning less than
+		 * we got ends the transfer. */
+		if (s->curl.cache && s->curl.partial) {
+			const off_t next = http_cache_next (s->curl.cache, from);
+			if (from + (off_t)len > next) {
+				len = next - from;
+				s->curl.stopped = 1;
+			}
+		}
 
-	s->curl.buf_fill += data_size;
-	debug ("Got %zu bytes", data_size);
+		if (s->curl.cache)
+			http_cache_write (s->curl.cache, from, (const char *)data,
+					len);
+		s->curl.xfer_pos = from + len;
+
+		/* A transfer starts at a block, or at 0 if the server ignored
+		 * the range. */
+		const off_t buf_end = s->curl.pos + s->curl.buf_fill;
+		if (buf_end > from)
+			skip = MIN((off_t)len, buf_end - from);
+	}
+
+	s->curl.buf_fill += len - skip;
+	debug ("Got %zu bytes", len - skip);
 	s->curl.buf = (char *)xrealloc (s->curl.buf, s->curl.buf_fill);
-	memcpy (s->curl.buf + buf_start, data, data_size);
+	memcpy (s->curl.buf + buf_start, (char *)data + skip, len - skip);
 
-	return data_size;
+	return len;
 }
 
 static size_t header_cb (void *data, size_t size, size_t nmemb,
@@ -86,17 +241,17 @@ static size_t header_cb (void *data, size_t size, size_t nmemb,
 			free (s->curl.mime_type);
 			s->curl.mime_type = NULL;
 		}
-		if (s->curl.mime_type)
-			logit ("Another Content-Type header!");
-		else {
-			char *value = header + sizeof("Content-Type:") - 1;
+		char *value = header + sizeof("Content-Type:") - 1;
 
-			while (isblank(value[0]))
-				value++;
+		while (isblank(value[0]))
+			value++;
 
+		if (!s->curl.mime_type) {
 			s->curl.mime_type = xstrdup (value);
 			debug ("Mime type: '%s'", s->curl.mime_type);
 		}
+		else if (strcmp (s->curl.mime_type, value))
+			logit ("Another Content-Type header!");
 	}
 	else if (!strncasecmp(header, "icy-name:", sizeof("icy-name:")-1)
 			|| !strncasecmp(header, "x-audiocast-name",
@@ -116,6 +271,42 @@ static size_t header_cb (void *data, size_t size, size_t nmemb,
 
 		io_set_metadata_url (s, value);
 	}
+	else if (!strncasecmp(header, "HTTP/", sizeof("HTTP/")-1)) {
+		/* a new response, e.g. after a redirect */
+		s->curl.accept_ranges = 0;
+		s->curl.total = -1;
+		free (s->curl.validator);
+		s->curl.validator = NULL;
+	}
+	else if (!strncasecmp(header, "Accept-Ranges:",
+				sizeof("Accept-Ranges:")-1)) {
+		char *value = strchr (header, ':') + 1;
+
+		while (isblank(value[0]))
+			value++;
+
+		s->curl.accept_ranges = !strcasecmp (value, "bytes");
+	}
+	else if (!strncasecmp(header, "Content-Range:",
+				sizeof("Content-Range:")-1)) {
+		/* bytes first-last/total */
+		char *total = strrchr (header, '/');
+
+		if (total && isdigit(total[1]))
+			s->curl.total = strtoll (total + 1, NULL, 10);
+	}
+	else if (!strncasecmp(header, "ETag:", sizeof("ETag:")-1)
+			|| (!strncasecmp(header, "Last-Modified:",
+					sizeof("Last-Modified:")-1)
+				&& !s->curl.validator)) {
+		char *value = strchr (header, ':') + 1;
+
+		while (isblank(value[0]))
+			value++;
+
+		free (s->curl.validator);
+		s->curl.validator = xstrdup (value);
+	}
 	else if (!strncasecmp(header, "icy-metaint:",
 				sizeof("icy-metaint:")-1)) {
 		char *end;
@@ -149,6 +340,17 @@ static int check_curl_stream (struct io_stream *s)
 	                                    &msg_queue_num))) {
 		if (msg->msg == CURLMSG_DONE) {
 			s->curl.status = msg->data.result;
+			if (s->curl.stopped
+					&& s->curl.status == CURLE_WRITE_ERROR) {
+				debug ("Stopped at a cached block");
+				s->curl.status = CURLE_OK;
+			}
+			if (s->curl.status != CURLE_OK && s->curl.revalidate) {
+				/* e.g. offline, better than nothing */
+				logit ("Can't revalidate, using the HTTP cache");
+				s->curl.revalidate = 0;
+				s->curl.status = CURLE_OK;
+			}
 			if (s->curl.status != CURLE_OK) {
 				debug ("Read error");
 				res = 0;
@@ -164,15 +366,102 @@ static int check_curl_stream (struct io_stream *s)
 	return res;
 }
 
+/* Start fetching the resource, from offset from on if it's not 0. Return 0
+ * on error. */
+static int start_transfer (struct io_stream *s, const off_t from)
+{
+	if (!(s->curl.handle = curl_easy_init())) {
+		logit ("curl_easy_init() returned NULL");
+		s->errno_val = EINVAL;
+		return 0;
+	}
+
+	curl_easy_setopt (s->curl.handle, CURLOPT_NOPROGRESS, 1);
+	/* 1.1 keeps the connection open for the next file, servers that
+	 * answer with "ICY 200 OK" are handled by http200_aliases */
+	curl_easy_setopt (s->curl.handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+	curl_easy_setopt (s->curl.handle, CURLOPT_WRITEFUNCTION, write_cb);
+	curl_easy_setopt (s->curl.handle, CURLOPT_WRITEDATA, s);
+	curl_easy_setopt (s->curl.handle, CURLOPT_HEADERFUNCTION, header_cb);
+	curl_easy_setopt (s->curl.handle, CURLOPT_WRITEHEADER, s);
+	curl_easy_setopt (s->curl.handle, CURLOPT_USERAGENT, user_agent);
+	curl_easy_setopt (s->curl.handle, CURLOPT_URL, s->curl.url);
+	curl_easy_setopt (s->curl.handle, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt (s->curl.handle, CURLOPT_FAILONERROR, 1);
+	curl_easy_setopt (s->curl.handle, CURLOPT_MAXREDIRS, 15);
+	curl_easy_setopt (s->curl.handle, CURLOPT_HTTP200ALIASES,
+			s->curl.http200_aliases);
+	curl_easy_setopt (s->curl.handle, CURLOPT_HTTPHEADER,
+			s->curl.revalidate && s->curl.revalidate_headers
+			? s->curl.revalidate_headers : s->curl.http_headers);
+	if (!options::HTTPProxy.empty())
+		curl_easy_setopt (s->curl.handle, CURLOPT_PROXY,
+				options::HTTPProxy.c_str());
+	curl_easy_setopt (s->curl.handle, CURLOPT_SHARE,
+			s->curl.attached ? reactor_share : share);
+	if (from || s->curl.revalidate) {
+		char range[32];
+
+		snprintf (range, sizeof(range), "%" PRId64 "-", (int64_t)from);
+		curl_easy_setopt (s->curl.handle, CURLOPT_RANGE, range);
+		debug ("Fetching from byte %" PRId64, (int64_t)from);
+	}
+
+	s->curl.got_locn = 0;
+	s->curl.xfer_pos = from;
+	s->curl.started = 0;
+	s->curl.partial = 0;
+	s->curl.stopped = 0;
+	s->curl.accept_ranges = 0;
+	s->curl.total = -1;
+
+	if ((s->curl.multi_status = curl_multi_add_handle(s->curl.multi_handle,
+					s->curl.handle)) != CURLM_OK) {
+		logit ("curl_multi_add_handle() failed");
+		s->errno_val = EINVAL;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Drop the transfer and what it has received. */
+static void stop_transfer (struct io_stream *s)
+{
+	if (s->curl.handle) {
+		curl_multi_remove_handle (s->curl.multi_handle, s->curl.handle);
+		curl_easy_cleanup (s->curl.handle);
+		s->curl.handle = NULL;
+	}
+
+	free (s->curl.buf);
+	s->curl.buf = NULL;
+	s->curl.buf_fill = 0;
+	s->curl.paused = 0;
+}
+
 void io_curl_open (struct io_stream *s, const char *url)
 {
 	s->source = IO_SOURCE_CURL;
 	s->curl.url = NULL;
+	s->curl.handle = NULL;
 	s->curl.http_headers = NULL;
+	s->curl.http200_aliases = NULL;
 	s->curl.buf = NULL;
 	s->curl.buf_fill = 0;
 	s->curl.need_perform_loop = 1;
 	s->curl.got_locn = 0;
+	s->curl.paused = 0;
+	s->curl.timer = -1;
+	s->curl.attached = 0;
+	s->curl.ranges = 0;
+	s->curl.cache = NULL;
+	s->curl.pos = 0;
+	s->curl.seek_to = -1;
+	s->curl.from_cache = 0;
+	s->curl.validator = NULL;
+	s->curl.revalidate = 0;
+	s->curl.revalidate_headers = NULL;
 
 	s->curl.wake_up_pipe[0] = -1;
 	s->curl.wake_up_pipe[1] = -1;
@@ -183,12 +472,6 @@ void io_curl_open (struct io_stream *s, const char *url)
 		return;
 	}
 
-	if (!(s->curl.handle = curl_easy_init())) {
-		logit ("curl_easy_init() returned NULL");
-		s->errno_val = EINVAL;
-		return;
-	}
-
 	s->curl.multi_status = CURLM_OK;
 	s->curl.status = CURLE_OK;
 
@@ -199,31 +482,31 @@ void io_curl_open (struct io_stream *s, const char *url)
 	s->curl.http200_aliases = curl_slist_append (NULL, "ICY");
 	s->curl.http_headers = curl_slist_append (NULL, "Icy-MetaData: 1");
 
-	curl_easy_setopt (s->curl.handle, CURLOPT_NOPROGRESS, 1);
-	curl_easy_setopt (s->curl.handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_0);
-	curl_easy_setopt (s->curl.handle, CURLOPT_WRITEFUNCTION, write_cb);
-	curl_easy_setopt (s->curl.handle, CURLOPT_WRITEDATA, s);
-	curl_easy_setopt (s->curl.handle, CURLOPT_HEADERFUNCTION, header_cb);
-	curl_easy_setopt (s->curl.handle, CURLOPT_WRITEHEADER, s);
-	curl_easy_setopt (s->curl.handle, CURLOPT_USERAGENT, user_agent);
-	curl_easy_setopt (s->curl.handle, CURLOPT_URL, s->curl.url);
-	curl_easy_setopt (s->curl.handle, CURLOPT_FOLLOWLOCATION, 1);
-	curl_easy_setopt (s->curl.handle, CURLOPT_FAILONERROR, 1);
-	curl_easy_setopt (s->curl.handle, CURLOPT_MAXREDIRS, 15);
-	curl_easy_setopt (s->curl.handle, CURLOPT_HTTP200ALIASES,
-			s->curl.http200_aliases);
-	curl_easy_setopt (s->curl.handle, CURLOPT_HTTPHEADER,
-			s->curl.http_headers);
-	if (!options::HTTPProxy.empty())
-		curl_easy_setopt (s->curl.handle, CURLOPT_PROXY,
-				options::HTTPProxy.c_str());
-
-	if ((s->curl.multi_status = curl_multi_add_handle(s->curl.multi_handle,
-					s->curl.handle)) != CURLM_OK) {
-		logit ("curl_multi_add_handle() failed");
-		s->errno_val = EINVAL;
-		return;
+	/* If the start is cached, the server is only asked whether it is
+	 * still the same: with If-Range, an unchanged resource is answered
+	 * with the range, which write_cb() stops at once because it is
+	 * cached, and a changed one with all of it. */
+	s->curl.cache = http_cache_open (url);
+	if (s->curl.cache && http_cache_has (s->curl.cache, 0)) {
+		logit ("Reading from the HTTP cache");
+		s->size = http_cache_size (s->curl.cache);
+		s->curl.ranges = 1;
+		s->curl.revalidate = 1;
+		if (http_cache_mime_type (s->curl.cache))
+			s->curl.mime_type = xstrdup (
+					http_cache_mime_type (s->curl.cache));
+
+		/* weak ETags can't be used with If-Range */
+		const char *v = http_cache_validator (s->curl.cache);
+		if (v && strncmp (v, "W/", 2)) {
+			str h = format ("If-Range: %s", v);
+			s->curl.revalidate_headers = curl_slist_append (
+					curl_slist_append (NULL, "Icy-MetaData: 1"),
+					h.c_str());
+		}
 	}
+	if (!start_transfer (s, 0))
+		return;
 
 	if (pipe(s->curl.wake_up_pipe) < 0) {
 		log_errno ("pipe() failed", errno);
@@ -243,6 +526,8 @@ void io_curl_close (struct io_stream *s)
 		free (s->curl.url);
 	if (s->curl.http_headers)
 		curl_slist_free_all (s->curl.http_headers);
+	if (s->curl.revalidate_headers)
+		curl_slist_free_all (s->curl.revalidate_headers);
 	if (s->curl.buf)
 		free (s->curl.buf);
 	if (s->curl.mime_type)
@@ -262,6 +547,9 @@ void io_curl_close (struct io_stream *s)
 
 	if (s->curl.http200_aliases)
 		curl_slist_free_all (s->curl.http200_aliases);
+
+	free (s->curl.validator);
+	http_cache_close (s->curl.cache);
 }
 
 /* Get data using curl and put them into the internal buffer.
@@ -333,7 +621,7 @@ static int curl_read_internal (struct io_stream *s)
 				return 0;
 			}
 
-			if (s->stop_read_thread)
+			if (s->aborted)
 				return 1;
 
 			if (FD_ISSET(s->curl.wake_up_pipe[0], &read_fds)) {
@@ -382,6 +670,63 @@ static size_t read_from_buffer (struct io_stream *s, char *buf, size_t count)
 	return 0;
 }
 
+/* Read sound at the read position: what curl has given us, or else what is
+ * cached. */
+static size_t read_sound (struct io_stream *s, char *buf, size_t count)
+{
+	size_t res = read_from_buffer (s, buf, count);
+
+	if (!res && s->curl.cache && !s->curl.revalidate) {
+		ssize_t n = http_cache_read (s->curl.cache, s->curl.pos, buf,
+				count);
+		if (n > 0) {
+			res = n;
+			s->curl.from_cache = 1;
+		}
+	}
+
+	s->curl.pos += res;
+
+	return res;
+}
+
+/* Has everything been read? */
+static int curl_eof (const struct io_stream *s)
+{
+	if (s->curl.buf_fill)
+		return 0;
+
+	return s->curl.ranges ? s->curl.pos >= s->size : !s->curl.handle;
+}
+
+/* If the read position is neither received nor cached nor on its way,
+ * fetch from there (from its block if there is a cache). Return 0 on error.
+ */
+static int fetch_ahead (struct io_stream *s)
+{
+	if (!s->curl.ranges || curl_eof (s) || s->curl.buf_fill)
+		return 1;
+	if (s->curl.cache && !s->curl.revalidate
+			&& http_cache_has (s->curl.cache, s->curl.pos))
+		return 1;
+	if (s->curl.handle && !s->curl.stopped)
+		return 1;
+
+	stop_transfer (s);
+	s->curl.need_perform_loop = !s->buffered;
+
+	return start_transfer (s, s->curl.cache
+			? s->curl.pos - s->curl.pos % HTTP_CACHE_BLOCK
+			: s->curl.pos);
+}
+
+/* Move the read position of a resource fetched in ranges. */
+static void seek_now (struct io_stream *s, const off_t where)
+{
+	stop_transfer (s);
+	s->curl.pos = where;
+}
+
 /* Parse icy string in form: StreamTitle='my music';StreamUrl='www.x.com' */
 static void parse_icy_string (struct io_stream *s, const char *str)
 {
@@ -492,7 +837,7 @@ static int read_icy_metadata (struct io_stream *s)
 
 	/* make sure that the whole packet is in the buffer */
 	while (s->curl.buf_fill < size && s->curl.handle
-			&& !s->stop_read_thread)
+			&& !s->aborted)
 		if (!curl_read_internal(s))
 			return 0;
 
@@ -535,20 +880,158 @@ ssize_t io_curl_read (struct io_stream *s, char *buf, size_t count)
 		else
 			to_read = count - nread;
 
-		res = read_from_buffer (s, buf + nread, to_read);
+		res = read_sound (s, buf + nread, to_read);
 		if (s->curl.icy_meta_int)
 			s->curl.icy_meta_count += res;
 		nread += res;
 		debug ("Read %zu bytes from the buffer (%zu bytes full)", res, nread);
 
-		if (nread < count && !curl_read_internal(s))
+		if (nread < count && !res
+				&& !(fetch_ahead (s) && curl_read_internal (s)))
 			return -1;
-	} while (nread < count && !s->stop_read_thread
-			&& s->curl.handle); /* s->curl.handle == NULL on EOF */
+	} while (nread < count && !s->aborted && !curl_eof (s));
+
+	return nread;
+}
+
+/* Let the IO reactor run the transfer of a buffered stream: curl tells it
+ * through the callbacks which sockets to watch and when to time out. */
+void io_curl_attach (struct io_stream *s, curl_socket_callback socket_cb,
+		curl_multi_timer_callback timer_cb)
+{
+	CURLM *m = s->curl.multi_handle;
+
+	curl_multi_setopt (m, CURLMOPT_SOCKETFUNCTION, socket_cb);
+	curl_multi_setopt (m, CURLMOPT_SOCKETDATA, s);
+	curl_multi_setopt (m, CURLMOPT_TIMERFUNCTION, timer_cb);
+	curl_multi_setopt (m, CURLMOPT_TIMERDATA, s);
+	s->curl.need_perform_loop = 0;
+	s->curl.attached = 1;
+
+	/* It hasn't started yet, let it use the reactor's connections. */
+	if (s->curl.handle) {
+		curl_multi_remove_handle (m, s->curl.handle);
+		curl_easy_setopt (s->curl.handle, CURLOPT_SHARE, reactor_share);
+		curl_multi_add_handle (m, s->curl.handle);
+	}
+}
+
+/* Called with the reactor's lock held, so the connection goes back to the
+ * pool while no other transfer uses it. */
+void io_curl_detach (struct io_stream *s)
+{
+	CURLM *m = s->curl.multi_handle;
+
+	stop_transfer (s);
+	curl_multi_setopt (m, CURLMOPT_SOCKETFUNCTION, NULL);
+	curl_multi_setopt (m, CURLMOPT_TIMERFUNCTION, NULL);
+}
+
+/* Let curl handle events on the socket fd (or its timeout, if fd is
+ * CURL_SOCKET_TIMEOUT). Return 0 on error. */
+int io_curl_socket_action (struct io_stream *s, curl_socket_t fd,
+		const int events)
+{
+	int running;
+
+	if (!s->curl.handle)
+		return 1;
+
+	s->curl.multi_status = curl_multi_socket_action (s->curl.multi_handle,
+			fd, events, &running);
+	if (s->curl.multi_status != CURLM_OK) {
+		logit ("curl_multi_socket_action() failed");
+		return 0;
+	}
+
+	return check_curl_stream (s);
+}
+
+/* Move up to count bytes of the sound curl has received so far to buf,
+ * without the icy metadata. Never waits for more. */
+ssize_t io_curl_take (struct io_stream *s, char *buf, size_t count)
+{
+	size_t nread = 0;
+
+	if (s->curl.seek_to != -1) {
+		seek_now (s, s->curl.seek_to);
+		s->curl.seek_to = -1;
+	}
+
+	while (nread < count) {
+		if (s->curl.icy_meta_int && s->curl.icy_meta_count
+				== s->curl.icy_meta_int) {
+			if (!s->curl.buf_fill)
+				break;
+
+			/* only take the packet when all of it is here */
+			long size = (uint8_t)s->curl.buf[0] * 16;
+			if (s->curl.buf_fill < 1 + size) {
+				if (!s->curl.handle) {
+					logit ("Icy metadata packet broken");
+					free (s->curl.buf);
+					s->curl.buf = NULL;
+					s->curl.buf_fill = 0;
+				}
+				break;
+			}
+
+			char *packet = (char *)xmalloc (1 + size);
+			read_from_buffer (s, packet, 1 + size);
+			if (size) {
+				debug ("Received metadata packet %ld bytes long", size);
+				parse_icy_metadata (s, packet + 1, size);
+			}
+			free (packet);
+			s->curl.icy_meta_count = 0;
+		}
+
+		size_t to_read = count - nread;
+		if (s->curl.icy_meta_int)
+			to_read = MIN (to_read, s->curl.icy_meta_int -
+					s->curl.icy_meta_count);
+
+		size_t res = read_sound (s, buf + nread, to_read);
+		if (!res)
+			break;
+		if (s->curl.icy_meta_int)
+			s->curl.icy_meta_count += res;
+		nread += res;
+	}
+
+	if (s->curl.paused && s->curl.handle
+			&& s->curl.buf_fill < CURL_BUF_MAX / 2) {
+		debug ("Resuming");
+		s->curl.paused = 0;
+		curl_easy_pause (s->curl.handle, CURLPAUSE_CONT);
+	}
+
+	if (nread < count && !fetch_ahead (s))
+		return nread ? (ssize_t)nread : -1;
 
 	return nread;
 }
 
+/* Has everything been received and taken? */
+int io_curl_done (const struct io_stream *s)
+{
+	return curl_eof (s);
+}
+
+/* Seek in a resource that can be fetched in ranges. The IO reactor owns the
+ * transfer of a buffered stream, so it is left to io_curl_take() then. */
+off_t io_curl_seek (struct io_stream *s, const off_t where)
+{
+	assert (s->curl.ranges);
+
+	if (s->buffered)
+		s->curl.seek_to = where;
+	else
+		seek_now (s, where);
+
+	return where;
+}
+
 /* Set the error string for the stream. */
 void io_curl_strerror (struct io_stream *s)
 {
@@ -557,7 +1040,9 @@ void io_curl_strerror (struct io_stream *s)
 	assert (s != NULL);
 	assert (s->source == IO_SOURCE_CURL);
 
-	if (s->curl.multi_status != CURLM_OK)
+	if (s->errno_val == ESTALE)
+		err = "The remote file has changed";
+	else if (s->curl.multi_status != CURLM_OK)
 		err = curl_multi_strerror(s->curl.multi_status);
 	else if (s->curl.status != CURLE_OK)
 		err = curl_easy_strerror(s->curl.status);
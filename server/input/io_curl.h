@@ -8,3 +8,12 @@ void io_curl_close (struct io_stream *s);
 ssize_t io_curl_read (struct io_stream *s, char *buf, size_t count);
 void io_curl_strerror (struct io_stream *s);
 void io_curl_wake_up (struct io_stream *s);
+
+void io_curl_attach (struct io_stream *s, curl_socket_callback socket_cb,
+		curl_multi_timer_callback timer_cb);
+void io_curl_detach (struct io_stream *s);
+int io_curl_socket_action (struct io_stream *s, curl_socket_t fd,
+		const int events);
+ssize_t io_curl_take (struct io_stream *s, char *buf, size_t count);
+int io_curl_done (const struct io_stream *s);
+off_t io_curl_seek (struct io_stream *s, const off_t where);
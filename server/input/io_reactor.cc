@@ -0,0 +1,441 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "io_reactor.h"
+#include "io_curl.h"
+
+#define MAX_EVENTS	16
+#define STATS_WINDOW	1000	/* ms over which the rate is measured */
+#define FILE_READERS	4	/* most threads reading files */
+
+/* The network streams are under reactor_mtx, which the reactor thread only
+ * drops while it sleeps in epoll_wait(). The curl callbacks are always
+ * called with it held. */
+static pthread_mutex_t reactor_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t reactor_tid;
+static bool reactor_running = false;
+static bool reactor_exit = false;
+static int epoll_fd = -1;
+static int wake_fd = -1;	/* eventfd to interrupt epoll_wait() */
+static std::vector<struct io_stream *> streams;
+static std::map<curl_socket_t, struct io_stream *> sockets;
+static char chunk_buf[IO_REACTOR_CHUNK];
+
+/* The file streams are read by their own threads, with no lock held, so a
+ * read that blocks (NFS, a spun down disk) holds up only its stream and
+ * its reader. files_mtx is never held while a stream's mutexes are taken,
+ * so io_reactor_wake() can be called with them held. */
+static pthread_mutex_t files_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t files_cond = PTHREAD_COND_INITIALIZER;	/* wake up */
+static pthread_cond_t read_cond = PTHREAD_COND_INITIALIZER;	/* a read is done */
+static std::vector<struct io_stream *> files;
+static std::vector<pthread_t> readers;
+static unsigned files_gen = 0;	/* counts io_reactor_wake() calls */
+static bool files_exit = false;
+
+static int64_t now_ms ()
+{
+	struct timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static int socket_cb (CURL *easy, curl_socket_t fd, int what, void *userp,
+		void *socketp)
+{
+	struct io_stream *s = (struct io_stream *)userp;
+	struct epoll_event ev;
+
+	if (what == CURL_POLL_REMOVE) {
+		epoll_ctl (epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		sockets.erase (fd);
+		return 0;
+	}
+
+	ev.events = 0;
+	if (what & CURL_POLL_IN)
+		ev.events |= EPOLLIN;
+	if (what & CURL_POLL_OUT)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = fd;
+
+	int op = sockets.count (fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl (epoll_fd, op, fd, &ev) < 0)
+		log_errno ("epoll_ctl() failed", errno);
+	sockets[fd] = s;
+
+	return 0;
+}
+
+static int timer_cb (CURLM *multi, long timeout_ms, void *userp)
+{
+	struct io_stream *s = (struct io_stream *)userp;
+
+	s->curl.timer = timeout_ms < 0 ? -1 : now_ms () + timeout_ms;
+	return 0;
+}
+
+static void curl_action (struct io_stream *s, curl_socket_t fd,
+		const int events)
+{
+	if (io_curl_socket_action (s, fd, events))
+		return;
+
+	LOCK (s->buf_mtx);
+	s->read_error = 1;
+	pthread_cond_broadcast (&s->buf_fill_cond);
+	UNLOCK (s->buf_mtx);
+}
+
+/* Account for n bytes just put into the buffer of s. */
+static void measure (struct io_stream *s, const size_t n)
+{
+	const int64_t now = now_ms ();
+
+	if (s->last_put >= 0) {
+		const int gap = now - s->last_put;
+
+		s->stall = MAX(s->stall, gap);
+		s->win_bytes += n;
+		s->win_ms += gap;
+		if (s->win_ms >= STATS_WINDOW) {
+			const double rate = s->win_bytes * 1000.0 / s->win_ms;
+
+			s->rate = s->rate > 0 ? (3 * s->rate + rate) / 4 : rate;
+			s->stall -= s->stall / 32;
+			s->win_bytes = 0;
+			s->win_ms = 0;
+		}
+	}
+	s->last_put = now;
+}
+
+/* Move one chunk into the stream's buffer through mem. If urgent is set,
+ * only if it is still below its prebuffering target. Return true if
+ * something was put. */
+static bool fill (struct io_stream *s, const bool urgent, char *mem)
+{
+	const size_t chunk = io_reactor_chunk (s);
+	size_t space;
+	ssize_t n;
+
+	LOCK (s->buf_mtx);
+	if (s->aborted || s->eof || s->read_error || s->parked
+			|| (urgent && s->buf->get_fill() >= s->prebuffer)) {
+		UNLOCK (s->buf_mtx);
+		return false;
+	}
+	space = s->buf->get_space ();
+	if (space < chunk) {
+		s->parked = 1;
+		UNLOCK (s->buf_mtx);
+		return false;
+	}
+	UNLOCK (s->buf_mtx);
+
+	space = MIN(space, IO_REACTOR_CHUNK);
+
+	/* io_mtx keeps a seek from getting between the read and putting the
+	 * data into the buffer */
+	LOCK (s->io_mtx);
+	if (s->source == IO_SOURCE_CURL) {
+		n = io_curl_take (s, mem, space);
+		LOCK (s->buf_mtx);
+		UNLOCK (s->io_mtx);
+
+		if (n < 0)
+			s->read_error = 1;
+		else if (!n && io_curl_done (s))
+			s->eof = 1;
+	}
+	else {
+		n = read (s->fd, mem, space);
+		const int err = errno;
+		LOCK (s->buf_mtx);
+		UNLOCK (s->io_mtx);
+
+		if (n < 0) {
+			s->errno_val = err;
+			s->read_error = 1;
+			logit ("Read error: %s", xstrerror (err));
+		}
+		else if (n == 0) {
+			debug ("EOF");
+			s->eof = 1;
+		}
+	}
+
+	if (n > 0) {
+		s->buf->put (mem, n);
+		measure (s, n);
+	}
+
+	const size_t buf_fill = s->buf->get_fill ();
+	if (buf_fill >= s->prebuffer)
+		s->primed = 1;
+	if (buf_fill >= s->want || s->eof || s->read_error) {
+		s->want = SIZE_MAX;
+		pthread_cond_broadcast (&s->buf_fill_cond);
+	}
+	UNLOCK (s->buf_mtx);
+
+	if (n > 0 && s->buf_fill_callback)
+		s->buf_fill_callback (s, buf_fill, s->buf->get_size(),
+				s->buf_fill_callback_data);
+
+	return n > 0;
+}
+
+/* Give every network stream a chunk, streams that haven't reached their target
+ * two. Return true if there is more to do right away. */
+static bool fill_all ()
+{
+	bool busy = false;
+
+	for (auto *s : streams)
+		busy |= fill (s, true, chunk_buf);
+	for (auto *s : streams)
+		busy |= fill (s, false, chunk_buf);
+
+	return busy;
+}
+
+static void *reactor_thread (void *unused)
+{
+	struct epoll_event events[MAX_EVENTS];
+
+	logit ("IO reactor started");
+
+	LOCK (reactor_mtx);
+	while (!reactor_exit) {
+		const bool busy = fill_all ();
+
+		int64_t timer = -1;
+		for (auto *s : streams)
+			if (s->source == IO_SOURCE_CURL && s->curl.timer >= 0
+					&& (timer < 0 || s->curl.timer < timer))
+				timer = s->curl.timer;
+
+		int timeout = -1;
+		if (busy)
+			timeout = 0;
+		else if (timer >= 0)
+			timeout = MAX(0, timer - now_ms ());
+
+		UNLOCK (reactor_mtx);
+		int n = epoll_wait (epoll_fd, events, MAX_EVENTS, timeout);
+		LOCK (reactor_mtx);
+
+		if (n < 0 && errno != EINTR)
+			log_errno ("epoll_wait() failed", errno);
+
+		for (int i = 0; i < n; i++) {
+			const int fd = events[i].data.fd;
+
+			if (fd == wake_fd) {
+				uint64_t v;
+				if (read (wake_fd, &v, sizeof(v)) < 0)
+					log_errno ("Can't read from eventfd", errno);
+				continue;
+			}
+
+			auto it = sockets.find (fd);
+			if (it == sockets.end())
+				continue; /* removed meanwhile */
+
+			int ev = 0;
+			if (events[i].events & EPOLLIN)
+				ev |= CURL_CSELECT_IN;
+			if (events[i].events & EPOLLOUT)
+				ev |= CURL_CSELECT_OUT;
+			if (events[i].events & (EPOLLERR | EPOLLHUP))
+				ev |= CURL_CSELECT_ERR;
+			curl_action (it->second, fd, ev);
+		}
+
+		const int64_t now = now_ms ();
+		for (auto *s : streams)
+			if (s->source == IO_SOURCE_CURL && s->curl.timer >= 0
+					&& s->curl.timer <= now) {
+				s->curl.timer = -1;
+				curl_action (s, CURL_SOCKET_TIMEOUT, 0);
+			}
+	}
+	UNLOCK (reactor_mtx);
+
+	logit ("IO reactor exiting");
+
+	return NULL;
+}
+
+/* Give the file streams nobody else is reading a chunk, the ones that
+ * haven't reached their target first, until none can take more. */
+static void *file_reader (void *unused)
+{
+	char *mem = (char *)xmalloc (IO_REACTOR_CHUNK);
+
+	LOCK (files_mtx);
+	while (!files_exit) {
+		const unsigned gen = files_gen;
+		bool busy = false;
+
+		/* by index, the list may change while we read */
+		for (int urgent = 1; urgent >= 0; urgent--)
+			for (size_t i = 0; i < files.size(); i++) {
+				struct io_stream *s = files[i];
+				if (s->reading)
+					continue;
+
+				s->reading = 1;
+				UNLOCK (files_mtx);
+				busy |= fill (s, urgent, mem);
+				LOCK (files_mtx);
+				s->reading = 0;
+				pthread_cond_broadcast (&read_cond);
+			}
+
+		if (!busy && gen == files_gen && !files_exit)
+			pthread_cond_wait (&files_cond, &files_mtx);
+	}
+	UNLOCK (files_mtx);
+
+	free (mem);
+	return NULL;
+}
+
+static void start_reactor ()
+{
+	struct epoll_event ev;
+
+	epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		fatal ("epoll_create1() failed: %s", xstrerror (errno));
+
+	wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd < 0)
+		fatal ("eventfd() failed: %s", xstrerror (errno));
+
+	ev.events = EPOLLIN;
+	ev.data.fd = wake_fd;
+	if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0)
+		fatal ("epoll_ctl() failed: %s", xstrerror (errno));
+
+	reactor_exit = false;
+	int rc = pthread_create (&reactor_tid, NULL, reactor_thread, NULL);
+	if (rc != 0)
+		fatal ("Can't create IO reactor thread: %s", xstrerror (rc));
+	reactor_running = true;
+}
+
+/* Interrupt epoll_wait() and the idle file readers, e.g. because a stream
+ * has space again. */
+void io_reactor_wake ()
+{
+	const uint64_t one = 1;
+
+	if (write (wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		log_errno ("Can't wake up the IO reactor", errno);
+
+	LOCK (files_mtx);
+	files_gen++;
+	pthread_cond_broadcast (&files_cond);
+	UNLOCK (files_mtx);
+}
+
+/* Start filling the buffer of s. */
+void io_reactor_add (struct io_stream *s)
+{
+	assert (s->buffered);
+
+	LOCK (reactor_mtx);
+	if (!reactor_running)
+		start_reactor ();
+
+	if (s->source == IO_SOURCE_CURL) {
+		streams.push_back (s);
+		io_curl_attach (s, socket_cb, timer_cb);
+		curl_action (s, CURL_SOCKET_TIMEOUT, 0);
+	}
+	UNLOCK (reactor_mtx);
+
+	if (s->source != IO_SOURCE_CURL) {
+		LOCK (files_mtx);
+		s->reading = 0;
+		files.push_back (s);
+		/* a reader for each file, up to FILE_READERS */
+		if (readers.size() < MIN(files.size(), (size_t)FILE_READERS)) {
+			pthread_t tid;
+			int rc = pthread_create (&tid, NULL, file_reader, NULL);
+			if (rc != 0)
+				fatal ("Can't create file reader thread: %s",
+						xstrerror (rc));
+			readers.push_back (tid);
+		}
+		UNLOCK (files_mtx);
+	}
+
+	io_reactor_wake ();
+}
+
+/* Stop filling the buffer of s. The reactor doesn't touch s afterwards. */
+void io_reactor_remove (struct io_stream *s)
+{
+	if (s->source != IO_SOURCE_CURL) {
+		LOCK (files_mtx);
+		files.erase (std::remove (files.begin(), files.end(), s),
+				files.end());
+		while (s->reading)
+			pthread_cond_wait (&read_cond, &files_mtx);
+		UNLOCK (files_mtx);
+		return;
+	}
+
+	LOCK (reactor_mtx);
+	streams.erase (std::remove (streams.begin(), streams.end(), s),
+			streams.end());
+
+	io_curl_detach (s);
+	for (auto it = sockets.begin(); it != sockets.end(); ) {
+		if (it->second != s) {
+			++it;
+			continue;
+		}
+		epoll_ctl (epoll_fd, EPOLL_CTL_DEL, it->first, NULL);
+		it = sockets.erase (it);
+	}
+	UNLOCK (reactor_mtx);
+}
+
+void io_reactor_exit ()
+{
+	if (!reactor_running)
+		return;
+
+	LOCK (reactor_mtx);
+	reactor_exit = true;
+	UNLOCK (reactor_mtx);
+	io_reactor_wake ();
+
+	pthread_join (reactor_tid, NULL);
+	reactor_running = false;
+
+	LOCK (files_mtx);
+	files_exit = true;
+	pthread_cond_broadcast (&files_cond);
+	UNLOCK (files_mtx);
+	for (auto tid : readers)
+		pthread_join (tid, NULL);
+	readers.clear ();
+	files_exit = false;
+
+	close (epoll_fd);
+	close (wake_fd);
+	epoll_fd = wake_fd = -1;
+}
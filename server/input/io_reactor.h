@@ -0,0 +1,22 @@
+#pragma once
+#include "io.h"
+
+/* One thread fills the buffers of all network streams: it runs curl on
+ * their sockets and timers from one epoll loop. Files are read in large
+ * chunks by a few file reader threads, outside any lock the others need, so
+ * a slow one (NFS, a spun down disk) holds up only its own stream. Both are
+ * started with the first buffered stream. */
+
+/* Bytes read from a file at once. A full buffer is filled again when this
+ * much is free. */
+#define IO_REACTOR_CHUNK	(64 * 1024)
+
+static inline size_t io_reactor_chunk (const struct io_stream *s)
+{
+	return MIN(IO_REACTOR_CHUNK, s->buf->get_size() / 2);
+}
+
+void io_reactor_add (struct io_stream *s);
+void io_reactor_remove (struct io_stream *s);
+void io_reactor_wake ();
+void io_reactor_exit ();
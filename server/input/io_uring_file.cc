@@ -0,0 +1,272 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "io_uring_file.h"
+
+#ifdef HAVE_IO_URING
+#include <liburing.h>
+
+#define URING_BLOCKS		4		/* reads in flight */
+#define URING_BLOCK		(256 * 1024)
+#define URING_BLOCK_DIRECT	(1024 * 1024)	/* O_DIRECT skips the page cache,
+						   so read more at once */
+#define DIRECT_ALIGN		4096
+
+struct io_stream_uring
+{
+	struct io_uring ring;
+	char *mem;		/* URING_BLOCKS blocks of block bytes */
+	size_t block;		/* block size */
+	bool direct;		/* reading with O_DIRECT? */
+
+	/* The queued blocks, in file order starting at head. A block is
+	 * always read from a multiple of block, which O_DIRECT needs. */
+	struct {
+		off_t off;	/* file offset */
+		size_t len;	/* bytes read so far */
+		int err;	/* errno of a failed read */
+		bool done;
+	} b[URING_BLOCKS];
+	int head, n;
+	off_t next;		/* offset of the block after the last queued one */
+	off_t pos;		/* read position */
+};
+
+/* Queue a read of the rest of block i. */
+static bool queue_read (struct io_stream *s, const int i)
+{
+	struct io_stream_uring *u = s->uring;
+	struct io_uring_sqe *sqe = io_uring_get_sqe (&u->ring);
+	if (!sqe) return false;
+
+	io_uring_prep_read (sqe, s->fd, u->mem + i * u->block + u->b[i].len,
+			u->block - u->b[i].len, u->b[i].off + u->b[i].len);
+	io_uring_sqe_set_data (sqe, (void *)(intptr_t)i);
+	return true;
+}
+
+/* Fill the queue with reads up to the end of the file. */
+static void submit_blocks (struct io_stream *s)
+{
+	struct io_stream_uring *u = s->uring;
+	bool queued = false;
+
+	while (u->n < URING_BLOCKS && u->next < s->size) {
+		const int i = (u->head + u->n) % URING_BLOCKS;
+		u->b[i].off = u->next;
+		u->b[i].len = 0;
+		u->b[i].err = 0;
+		u->b[i].done = false;
+		if (!queue_read (s, i)) break;
+		u->n++;
+		u->next += u->block;
+		queued = true;
+	}
+
+	if (queued) {
+		int rc = io_uring_submit (&u->ring);
+		if (rc < 0) log_errno ("io_uring_submit() failed", -rc);
+	}
+}
+
+/* A short read stopped O_DIRECT at an unaligned offset, where it can't go
+ * on: read the rest of the file through the page cache. */
+static void stop_direct (struct io_stream *s)
+{
+	int flags = fcntl (s->fd, F_GETFL);
+	if (flags == -1 || fcntl (s->fd, F_SETFL, flags & ~O_DIRECT) == -1) {
+		log_errno ("Can't turn off O_DIRECT", errno);
+		return;
+	}
+	logit ("Short read with O_DIRECT, reading buffered from now on");
+	s->uring->direct = false;
+}
+
+/* Wait until block i is read. Return 0 or -errno if the ring failed. */
+static int wait_block (struct io_stream *s, const int i)
+{
+	struct io_stream_uring *u = s->uring;
+
+	while (!u->b[i].done) {
+		struct io_uring_cqe *cqe;
+		int rc = io_uring_wait_cqe (&u->ring, &cqe);
+		if (rc == -EINTR) continue;
+		if (rc < 0) {
+			log_errno ("io_uring_wait_cqe() failed", -rc);
+			return rc;
+		}
+
+		const int j = (int)(intptr_t)io_uring_cqe_get_data (cqe);
+		const int res = cqe->res;
+		io_uring_cqe_seen (&u->ring, cqe);
+
+		auto &b = u->b[j];
+		if (res < 0)
+			b.err = -res;
+		else
+			b.len += res;
+
+		/* Short reads happen at the end of the file, anything
+		 * else is read again. */
+		if (res > 0 && u->direct && b.len < u->block
+				&& b.off + (off_t)b.len < s->size)
+			stop_direct (s);
+		b.done = res <= 0 || b.len == u->block
+			|| b.off + (off_t)b.len >= s->size
+			|| !queue_read (s, j);
+		if (!b.done) io_uring_submit (&u->ring);
+	}
+
+	return 0;
+}
+
+/* Wait for all queued reads, so the buffers are no longer in use. */
+static int drain (struct io_stream *s)
+{
+	struct io_stream_uring *u = s->uring;
+
+	while (u->n) {
+		int rc = wait_block (s, u->head);
+		if (rc < 0) return rc;
+		u->head = (u->head + 1) % URING_BLOCKS;
+		u->n--;
+	}
+
+	return 0;
+}
+
+/* Switch s from plain reads of s->fd to io_uring. Returns false (and leaves
+ * s alone) if io_uring can't be used. */
+bool io_uring_file_open (struct io_stream *s, const char *file)
+{
+	auto *u = new io_stream_uring();
+
+	int rc = io_uring_queue_init (URING_BLOCKS, &u->ring, 0);
+	if (rc < 0) {
+		log_errno ("io_uring_queue_init() failed", -rc);
+		delete u;
+		return false;
+	}
+
+	/* Huge files are mostly played once, don't let them push
+	 * everything else out of the page cache. */
+	if (options::DirectIOMinSize
+			&& s->size >= (off_t)options::DirectIOMinSize * 1024 * 1024) {
+		int fd = open (file, O_RDONLY | O_DIRECT);
+		if (fd != -1) {
+			close (s->fd);
+			s->fd = fd;
+			u->direct = true;
+		}
+		else
+			log_errno ("Can't open with O_DIRECT", errno);
+	}
+
+	u->block = u->direct ? URING_BLOCK_DIRECT : URING_BLOCK;
+	rc = posix_memalign ((void **)&u->mem, DIRECT_ALIGN,
+			URING_BLOCKS * u->block);
+	if (rc)
+		fatal ("Can't allocate memory: %s", xstrerror (rc));
+
+	if (!u->direct) {
+		rc = posix_fadvise (s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		if (rc) log_errno ("posix_fadvise() failed", rc);
+	}
+
+	u->head = u->n = 0;
+	u->next = u->pos = 0;
+
+	s->uring = u;
+	s->source = IO_SOURCE_URING;
+
+	logit ("Reading with io_uring%s", u->direct ? " and O_DIRECT" : "");
+	submit_blocks (s);
+
+	return true;
+}
+
+void io_uring_file_close (struct io_stream *s)
+{
+	struct io_stream_uring *u = s->uring;
+
+	drain (s);
+	io_uring_queue_exit (&u->ring);
+	free (u->mem);
+	delete u;
+	s->uring = NULL;
+}
+
+/* Read from the queued blocks. If dont_move was set, the position is
+ * unchanged, and only what is already queued can be read. */
+ssize_t io_uring_file_read (struct io_stream *s, const int dont_move,
+		char *buf, size_t count)
+{
+	struct io_stream_uring *u = s->uring;
+	off_t pos = u->pos;
+	size_t got = 0;
+
+	for (int k = 0; got < count && k < u->n; ) {
+		const int i = (u->head + k) % URING_BLOCKS;
+		const auto &b = u->b[i];
+
+		if (wait_block (s, i) < 0)
+			return got ? (ssize_t)got : -1;
+		if (b.err) {
+			errno = b.err;
+			return got ? (ssize_t)got : -1;
+		}
+
+		if (pos < b.off + (off_t)b.len) {
+			size_t start = pos - b.off;
+			size_t len = MIN(count - got, b.len - start);
+			memcpy (buf + got, u->mem + i * u->block + start, len);
+			got += len;
+			pos += len;
+			continue;
+		}
+
+		if (b.len < u->block)
+			break; /* end of file */
+
+		if (dont_move)
+			k++;
+		else {
+			/* done with it, read the next block into it */
+			u->head = (u->head + 1) % URING_BLOCKS;
+			u->n--;
+			submit_blocks (s);
+		}
+	}
+
+	if (!dont_move)
+		u->pos = pos;
+
+	return got;
+}
+
+off_t io_uring_file_seek (struct io_stream *s, const off_t where)
+{
+	struct io_stream_uring *u = s->uring;
+
+	if (u->n && where >= u->b[u->head].off && where < u->next) {
+		/* Still in the queue: drop the blocks before it. */
+		while (where >= u->b[u->head].off + (off_t)u->block) {
+			if (wait_block (s, u->head) < 0)
+				return -1;
+			u->head = (u->head + 1) % URING_BLOCKS;
+			u->n--;
+		}
+	}
+	else {
+		if (drain (s) < 0)
+			return -1;
+		u->next = where - where % u->block;
+	}
+
+	u->pos = where;
+	submit_blocks (s);
+
+	return where;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#pragma once
+#include "io.h"
+
+/* Local files read through io_uring: a few large reads are kept in flight
+ * ahead of the read position, so the decoder thread rarely waits and there
+ * is no read thread. */
+
+#ifdef HAVE_IO_URING
+bool io_uring_file_open (struct io_stream *s, const char *file);
+void io_uring_file_close (struct io_stream *s);
+ssize_t io_uring_file_read (struct io_stream *s, const int dont_move,
+		char *buf, size_t count);
+off_t io_uring_file_seek (struct io_stream *s, const off_t where);
+#endif
@@ -27,14 +27,18 @@
 
 #define INPUT_BUFFER (32 * 1024)
 
+/* How much of a mmap()ed file to hand to libmad at once. */
+#define BORROW_MAX (1024 * 1024)
+
 struct xing
 {
-	xing() : flags(0) {}
+	xing() : flags(0), delay(-1), padding(-1) {}
 	long flags;			/* valid fields (see below) */
 	unsigned long frames;		/* total number of frames */
 	unsigned long bytes;		/* total number of bytes */
 	unsigned char toc[100];	/* 100-point seek table */
 	long scale;			/* ?? */
+	int delay, padding;		/* from the LAME tag, -1 if there is none */
 };
 enum
 {
@@ -44,11 +48,20 @@ enum
 	XING_SCALE  = 8L
 };
 
-/* parse a Xing VBR header */
+/* Samples of delay added by the decoder itself (libmad works like the
+ * reference decoder here). The LAME tag only counts the encoder's. */
+#define DECODER_DELAY	529
+
+#define MAGIC(a,b,c,d) (((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+/* parse a Xing VBR header (called "Info" in CBR files) and the LAME tag
+ * that may follow it */
 static int xing_parse(struct xing *xing, struct mad_bitptr ptr, unsigned int bitlen)
 {
-	#define XING_MAGIC (('X' << 24) | ('i' << 16) | ('n' << 8) | 'g')
-	if (bitlen < 64 || mad_bit_read(&ptr, 32) != XING_MAGIC) goto fail;
+	unsigned long magic;
+	if (bitlen < 64) goto fail;
+	magic = mad_bit_read(&ptr, 32);
+	if (magic != MAGIC('X','i','n','g') && magic != MAGIC('I','n','f','o')) goto fail;
 
 	xing->flags = mad_bit_read(&ptr, 32);
 	bitlen -= 64;
@@ -77,6 +90,20 @@ static int xing_parse(struct xing *xing, struct mad_bitptr ptr, unsigned int bit
 		bitlen -= 32;
 	}
 
+	/* LAME tag: 9 bytes of encoder version, 12 more we don't need and
+	 * then 12 bits each of encoder delay and padding. FFmpeg writes the
+	 * same tag as "Lavc" or "Lavf". */
+	xing->delay = xing->padding = -1;
+	if (bitlen >= 24*8) {
+		magic = mad_bit_read(&ptr, 32);
+		if (magic == MAGIC('L','A','M','E') || magic == MAGIC('L','a','v','c')
+				|| magic == MAGIC('L','a','v','f')) {
+			mad_bit_skip(&ptr, (21-4)*8);
+			xing->delay = mad_bit_read(&ptr, 12);
+			xing->padding = mad_bit_read(&ptr, 12);
+		}
+	}
+
 	return 0;
 
 	fail:
@@ -91,16 +118,15 @@ static inline int32_t round_sample (mad_fixed_t sample)
 	return sample >> (MAD_F_FRACBITS + 1 - 24);
 }
 
+/* Put nsamples samples of pcm, starting at first, into buf. */
 static int put_output (char *buf, int buf_len, struct mad_pcm *pcm,
-		struct mad_header *header)
+		struct mad_header *header, unsigned int first, unsigned int nsamples)
 {
-	unsigned int nsamples;
 	mad_fixed_t const *left_ch, *right_ch;
 	int olen;
 
-	nsamples = pcm->length;
-	left_ch = pcm->samples[0];
-	right_ch = pcm->samples[1];
+	left_ch = pcm->samples[0] + first;
+	right_ch = pcm->samples[1] + first;
 	olen = nsamples * MAD_NCHANNELS (header) * 4;
 
 	if (olen > buf_len) {
@@ -147,6 +173,7 @@ struct mp3_data : public Codec
 	off_t size;				/* Size of the file */
 
 	unsigned char in_buff[INPUT_BUFFER + MAD_BUFFER_GUARD];
+	const char *borrowed; /* the stream's memory libmad is reading, if not in_buff */
 
 	struct mad_stream stream;
 	struct mad_frame frame;
@@ -154,6 +181,13 @@ struct mp3_data : public Codec
 
 	int skip_frames; /* how many frames to skip (after seeking) */
 
+	/* Gapless playback: the first frame may be a Xing/LAME header, which
+	 * decodes to silence. If it has the encoder delay and padding, that
+	 * many samples are cut from the start and end. */
+	bool first_frame;
+	unsigned long skip_samples; /* still to cut at the start */
+	int64_t samples_left; /* until the padding, -1 if unknown */
+
 	int ok; /* was this stream successfully opened? */
 
 	/* Fill in the mad buffer, return number of bytes read, 0 on eof or error */
@@ -163,6 +197,29 @@ struct mp3_data : public Codec
 		unsigned char *read_start;
 		ssize_t read_size;
 
+		/* Give back what libmad is done with; the rest is read again
+		 * from the stream. */
+		if (borrowed) {
+			io_release (io_stream, stream.next_frame
+					? (const char *)stream.next_frame - borrowed : 0);
+			borrowed = NULL;
+			stream.next_frame = NULL;
+		}
+
+		/* If the file is mmap()ed, libmad can decode it in place. The
+		 * last MAD_BUFFER_GUARD bytes go through in_buff, which has
+		 * the zeros libmad wants after the end. */
+		size_t len;
+		const char *p = io_borrow (io_stream, INPUT_BUFFER, BORROW_MAX, &len);
+		if (p) {
+			if (io_tell (io_stream) + (off_t)len >= io_file_size (io_stream))
+				len -= MAD_BUFFER_GUARD;
+			borrowed = p;
+			mad_stream_buffer (&stream, (const unsigned char *)p, len);
+			stream.error = (mad_error)0;
+			return len;
+		}
+
 		if (stream.next_frame != NULL) {
 			remaining = stream.bufend - stream.next_frame;
 			memmove (in_buff, stream.next_frame, remaining);
@@ -319,6 +376,10 @@ struct mp3_data : public Codec
 		freq = 0;
 		channels = 0;
 		skip_frames = 0;
+		borrowed = NULL;
+		first_frame = true;
+		skip_samples = 0;
+		samples_left = -1;
 		bitrate = -1;
 		avg_bitrate = -1;
 		io_stream = io_open (file, buffered);
@@ -336,6 +397,7 @@ struct mp3_data : public Codec
 			duration = count_time_internal ();
 			mad_frame_mute (&frame);
 			stream.next_frame = NULL;
+			borrowed = NULL;
 			stream.sync = 0;
 			stream.error = MAD_ERROR_NONE;
 
@@ -360,7 +422,12 @@ struct mp3_data : public Codec
 		freq = 0;
 		channels = 0;
 		skip_frames = 0;
+		borrowed = NULL;
+		first_frame = true;
+		skip_samples = 0;
+		samples_left = -1;
 		bitrate = -1;
+		avg_bitrate = -1;
 		io_stream = s;
 		duration = -1;
 		size = -1;
@@ -370,6 +437,23 @@ struct mp3_data : public Codec
 		mad_synth_init (&synth);
 
 		mad_stream_options (&stream, MAD_OPTION_IGNORECRC);
+
+		/* A remote file fetched in ranges is seekable like a local
+		 * one. */
+		if (io_seekable (s)) {
+			size = io_file_size (s);
+			duration = count_time_internal ();
+			mad_frame_mute (&frame);
+			stream.next_frame = NULL;
+			borrowed = NULL;
+			stream.sync = 0;
+			stream.error = MAD_ERROR_BUFLEN;
+
+			if (io_seek(io_stream, 0, SEEK_SET) == -1) {
+				size = -1;
+				duration = -1;
+			}
+		}
 	}
 
 	~mp3_data()
@@ -436,6 +520,11 @@ struct mp3_data : public Codec
 				continue;
 			}
 
+			if (first_frame) {
+				first_frame = false;
+				if (header_frame ()) continue;
+			}
+
 			/* Sound parameters. */
 			if (!(sound_params.rate = frame.header.samplerate)) {
 				error.fatal("Broken file: information about the frequency couldn't be read.");
@@ -456,8 +545,44 @@ struct mp3_data : public Codec
 			mad_synth_frame (&synth, &frame);
 			mad_stream_sync (&stream);
 
-			return put_output (buf, buf_len, &synth.pcm, &frame.header);
+			unsigned int first = 0, n = synth.pcm.length;
+			if (skip_samples) {
+				first = MIN(skip_samples, n);
+				skip_samples -= first;
+				n -= first;
+			}
+			if (samples_left >= 0) {
+				if (!samples_left) return 0;
+				if (n > samples_left) n = samples_left;
+				samples_left -= n;
+			}
+			if (!n) continue;
+
+			return put_output (buf, buf_len, &synth.pcm, &frame.header,
+					first, n);
+		}
+	}
+
+	/* Check if the frame just decoded is a Xing/Info header and set up
+	 * the trimming from its LAME tag. */
+	bool header_frame ()
+	{
+		struct xing xing;
+		if (xing_parse(&xing, stream.anc_ptr, stream.anc_bitlen) == -1)
+			return false;
+
+		if (xing.delay >= 0) {
+			unsigned int spf = 32 * MAD_NSBSAMPLES(&frame.header);
+			skip_samples = xing.delay + DECODER_DELAY;
+			if (xing.flags & XING_FRAMES) {
+				samples_left = (int64_t)xing.frames * spf
+					- xing.delay - xing.padding;
+				if (samples_left < 0) samples_left = -1;
+			}
+			debug ("LAME tag: delay %d, padding %d", xing.delay,
+					xing.padding);
 		}
+		return true;
 	}
 
 	int seek (int sec) override
@@ -487,8 +612,12 @@ struct mp3_data : public Codec
 
 		stream.sync = 0;
 		stream.next_frame = NULL;
+		borrowed = NULL;
 
 		skip_frames = 2;
+		first_frame = false;
+		skip_samples = 0;
+		samples_left = -1; /* we don't know where we are exactly */
 
 		return sec;
 	}
@@ -90,6 +90,12 @@ static void get_comment_tags (OggVorbis_File *vf, struct file_tags *info)
 					"track=", strlen ("track=")))
 			info->track = atoi (comments->user_comments[i]
 					+ strlen ("track="));
+		else {
+			str c = comments->user_comments[i];
+			auto eq = c.find('=');
+			if (eq != str::npos)
+				comment_tag (*info, c.substr(0, eq).c_str(), c.c_str() + eq+1);
+		}
 	}
 }
 
@@ -254,6 +260,15 @@ struct vorbis_decoder : public Decoder
 		int64_t vorbis_time = ov_time_total (&vf, -1);
 		if (vorbis_time >= 0) info.time = vorbis_time / time_scaler;
 
+		vorbis_info *vi = ov_info (&vf, -1);
+		if (vi) {
+			info.rate = vi->rate;
+			info.channels = vi->channels;
+		}
+		long bitrate = ov_bitrate (&vf, -1);
+		if (bitrate > 0) info.bitrate = bitrate / 1000;
+		info.codec = "Vorbis";
+
 		ov_clear (&vf);
 	}
 
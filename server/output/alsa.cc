@@ -12,7 +12,9 @@
 /* Based on aplay copyright (c) by Jaroslav Kysela <perex@suse.cz> */
 
 #include <inttypes.h>
+#include <poll.h>
 #include <alsa/asoundlib.h>
+#include <vector>
 
 #undef STRERROR_FN 
 #define STRERROR_FN alsa_strerror
@@ -142,6 +144,9 @@ class alsa_driver : public AudioDriver
 	int buf_fill = 0;
 	int bytes_per_frame, bytes_per_sample;
 
+	/* To sleep until the card has played a period. */
+	std::vector<struct pollfd> pfds;
+
 	snd_mixer_t *mixer_handle;
 	snd_mixer_elem_t *mixer_elem1, *mixer_elem2, *mixer_elem_curr;
 
@@ -286,7 +291,8 @@ public:
 			goto err;
 		}
 
-		buffer_time = MIN(buffer_time, BUFFER_MAX_USEC);
+		buffer_time = MIN(buffer_time, options::ALSALatency
+				? options::ALSALatency * 1000 : BUFFER_MAX_USEC);
 		period_time = buffer_time / 4;
 
 		rc = snd_pcm_hw_params_set_period_time_near (handle, hw_params, &period_time, 0);
@@ -332,6 +338,18 @@ public:
 			goto err;
 		}
 
+		rc = snd_pcm_poll_descriptors_count (handle);
+		if (rc <= 0) {
+			error_errno ("Can't get poll descriptors", rc);
+			goto err;
+		}
+		pfds.resize (rc);
+		rc = snd_pcm_poll_descriptors (handle, pfds.data(), pfds.size());
+		if (rc < 0) {
+			error_errno ("Can't get poll descriptors", rc);
+			goto err;
+		}
+
 		/* Check that ALSA's and MOC's byte/sample/frame conversions agree. */
 		#ifndef NDEBUG
 		# define ALSA_CHECK(fn,val) \
@@ -395,6 +413,7 @@ public:
 		buffer_frames = 0;
 		chunk_frames = 0;
 		chunk_bytes = -1;
+		pfds.clear ();
 		handle = NULL;
 	}
 
@@ -418,6 +437,53 @@ public:
 		return size;
 	}
 
+	/* Whatever goes into buf stays there until it makes a whole chunk, so
+	 * it is already counted as written. */
+	int get_avail () override
+	{
+		if (!handle) return -1;
+
+		snd_pcm_sframes_t frames = snd_pcm_avail_update (handle);
+		if (frames < 0) return -1; /* let play() recover */
+
+		return MAX(0, (int)frames * bytes_per_frame - buf_fill);
+	}
+
+	bool wait_avail (int timeout_ms) override
+	{
+		if (!handle) return false;
+
+		int rc = poll (pfds.data(), pfds.size(), timeout_ms);
+		if (rc <= 0) {
+			if (rc < 0 && errno != EINTR) {
+				error_errno ("poll() failed", errno);
+				return false;
+			}
+			return true;
+		}
+
+		unsigned short revents;
+		rc = snd_pcm_poll_descriptors_revents (handle, pfds.data(),
+				pfds.size(), &revents);
+		if (rc < 0) {
+			error_errno ("Can't get poll events", rc);
+			return false;
+		}
+
+		/* xrun or suspend */
+		if (revents & POLLERR) {
+			rc = snd_pcm_state (handle) == SND_PCM_STATE_SUSPENDED
+				? -ESTRPIPE : -EPIPE;
+			rc = snd_pcm_recover (handle, rc, 0);
+			if (rc < 0) {
+				error_errno ("Can't recover", rc);
+				return false;
+			}
+		}
+
+		return true;
+	}
+
 	int read_mixer () const override
 	{
 		int actual_vol = read_mixer_raw (mixer_elem_curr);
@@ -17,9 +17,10 @@
  */
 
 #include <math.h>
-#include <samplerate.h>
 #include <byteswap.h>
 #include "audio_conversion.h"
+#include "audio_conversion_simd.h"
+#include "resampler.h"
 
 static void float_to_u8 (const float *in, unsigned char *out,
 		const size_t samples)
@@ -81,7 +82,7 @@ static void float_to_u16 (const float *in, unsigned char *out,
 	}
 }
 
-static void float_to_s16 (const float *in, char *out, const size_t samples)
+static void float_to_s16_ref (const float *in, char *out, const size_t samples)
 {
 	size_t i;
 
@@ -187,7 +188,7 @@ static void u16_to_float (const unsigned char *in, float *out,
 		out[i] = ((int)*in_16++ + INT16_MIN) / (float)(INT16_MAX + 1);
 }
 
-static void s16_to_float (const char *in, float *out, const size_t samples)
+static void s16_to_float_ref (const char *in, float *out, const size_t samples)
 {
 	size_t i;
 	const int16_t *in_16 = (int16_t *)in;
@@ -212,7 +213,7 @@ static void u32_to_float (const unsigned char *in, float *out,
 		out[i] = ((float)*in_32++ + (float)INT32_MIN) / ((float)INT32_MAX + 1.0);
 }
 
-static void s32_to_float (const char *in, float *out, const size_t samples)
+static void s32_to_float_ref (const char *in, float *out, const size_t samples)
 {
 	size_t i;
 	const int32_t *in_32 = (int32_t *)in;
@@ -224,107 +225,290 @@ static void s32_to_float (const char *in, float *out, const size_t samples)
 		out[i] = *in_32++ / ((float)INT32_MAX + 1.0);
 }
 
+/* The functions below use the vectorized kernels from
+ * audio_conversion_simd.cc (if the CPU has any) for the bulk of the data and
+ * the scalar _ref versions above for the rest. The _ref versions are the
+ * reference: debug builds check on the first use that the kernels give
+ * exactly the same output. */
+
+static void change_sign_8_ref (uint8_t *buf, const size_t samples);
+static void change_sign_16_ref (uint16_t *buf, const size_t samples);
+static void change_sign_32_ref (uint32_t *buf, const size_t samples);
+static void bswap_16_ref (int16_t *buf, const size_t num);
+static void bswap_32_ref (int32_t *buf, const size_t num);
+static void mono_to_stereo_ref (const char *mono, char *stereo,
+		const size_t size, const int Bps);
+
+#ifndef NDEBUG
+static void self_check (const conv_kernels &k);
+#endif
+
+static const conv_kernels &simd ()
+{
+	static const conv_kernels k = [] {
+		conv_kernels k = {};
+		conv_kernels_select (k);
+		if (k.name) {
+			logit ("Using %s sample conversion", k.name);
+			#ifndef NDEBUG
+			self_check (k);
+			#endif
+		}
+		return k;
+	}();
+	return k;
+}
+
+static void float_to_s16 (const float *in, char *out, const size_t samples)
+{
+	auto f = simd().float_to_s16;
+	size_t i = f ? f (in, out, samples) : 0;
+	float_to_s16_ref (in + i, out + 2*i, samples - i);
+}
+
+static void s16_to_float (const char *in, float *out, const size_t samples)
+{
+	auto f = simd().s16_to_float;
+	size_t i = f ? f (in, out, samples) : 0;
+	s16_to_float_ref (in + 2*i, out + i, samples - i);
+}
+
+static void s32_to_float (const char *in, float *out, const size_t samples)
+{
+	auto f = simd().s32_to_float;
+	size_t i = f ? f (in, out, samples) : 0;
+	s32_to_float_ref (in + 4*i, out + i, samples - i);
+}
+
+static void change_sign_8 (uint8_t *buf, const size_t samples)
+{
+	auto f = simd().change_sign_8;
+	size_t i = f ? f (buf, samples) : 0;
+	change_sign_8_ref (buf + i, samples - i);
+}
+
+static void change_sign_16 (uint16_t *buf, const size_t samples)
+{
+	auto f = simd().change_sign_16;
+	size_t i = f ? f (buf, samples) : 0;
+	change_sign_16_ref (buf + i, samples - i);
+}
+
+static void change_sign_32 (uint32_t *buf, const size_t samples)
+{
+	auto f = simd().change_sign_32;
+	size_t i = f ? f (buf, samples) : 0;
+	change_sign_32_ref (buf + i, samples - i);
+}
+
+void audio_conv_bswap_16 (int16_t *buf, const size_t num)
+{
+	auto f = simd().swap_16;
+	size_t i = f ? f (buf, num) : 0;
+	bswap_16_ref (buf + i, num - i);
+}
+
+void audio_conv_bswap_32 (int32_t *buf, const size_t num)
+{
+	auto f = simd().swap_32;
+	size_t i = f ? f (buf, num) : 0;
+	bswap_32_ref (buf + i, num - i);
+}
+
+/* Double the channels from mono into stereo, which must have room for
+ * 2*size bytes. */
+static void mono_to_stereo (const char *mono, char *stereo, const size_t size,
+		const long format)
+{
+	int Bps = sfmt_Bps (format);
+	auto f = simd().mono_to_stereo;
+	size_t i = f ? f (mono, stereo, size, Bps) : 0;
+	mono_to_stereo_ref (mono + i, stereo + 2*i, size - i, Bps);
+}
+
+#ifndef NDEBUG
+/* Compare the kernels in k with the reference code on edge cases and
+ * random input. Any difference is a bug in audio_conversion_simd.cc. */
+static void self_check (const conv_kernels &k)
+{
+	const size_t N = 1031; /* odd, so the scalar tails get used */
+	static float    f[N], fa[N], fb[N];
+	static int32_t  i32[N];
+	static int16_t  i16[N];
+	static char     a[8*N], b[8*N];
+	uint32_t x = 2463534242u;
+	auto rnd = [&x] { x ^= x << 13; x ^= x >> 17; x ^= x << 5; return x; };
+
+	const int32_t edge32[] = { INT32_MIN, INT32_MAX, -1, 1 };
+	const int16_t edge16[] = { INT16_MIN, INT16_MAX, -1, 1 };
+	const float edge[] = { 0.0f, -0.0f, 1.0f, -1.0f, 0.5f, -0.5f,
+		1.0000001f, -1.0000001f, 0.99999994f, -0.99999994f,
+		32767.5f / 32768.0f, -32768.5f / 32768.0f, 1.5f / 32768.0f,
+		-1.5f / 32768.0f, 2.5f / 32768.0f, 1e-40f, -1e-40f,
+		std::numeric_limits<float>::min(),
+		std::numeric_limits<float>::denorm_min(),
+		std::numeric_limits<float>::infinity(),
+		-std::numeric_limits<float>::infinity(),
+		std::numeric_limits<float>::quiet_NaN(),
+		-std::numeric_limits<float>::quiet_NaN(), 1e30f, -1e30f };
+	for (size_t i = 0; i < N; ++i) {
+		uint32_t r = rnd ();
+		if (i < ARRAY_SIZE(edge))
+			f[i] = edge[i];
+		else if (i % 3 == 0)
+			memcpy (&f[i], &r, sizeof(float)); /* any bit pattern */
+		else
+			f[i] = ((int32_t)r / 2147483648.0f) * 1.25f;
+		i32[i] = i < ARRAY_SIZE(edge32) ? edge32[i] : (int32_t)rnd ();
+		i16[i] = i < ARRAY_SIZE(edge16) ? edge16[i] : (int16_t)rnd ();
+	}
+
+	#define CHECK(cond, fn) \
+		if (!(cond)) fatal ("%s " #fn " differs from the scalar code!", k.name)
+
+	/* kernel for the bulk, reference for the rest: like the
+	 * dispatching functions above, which we can't use here */
+	size_t i;
+
+	for (size_t n : { N, (size_t)7, (size_t)64 }) {
+		if (k.float_to_s16) {
+			i = k.float_to_s16 (f, a, n);
+			float_to_s16_ref (f + i, a + 2*i, n - i);
+			float_to_s16_ref (f, b, n);
+			CHECK (!memcmp (a, b, 2*n), float_to_s16);
+		}
+		if (k.s16_to_float) {
+			i = k.s16_to_float ((char *)i16, fa, n);
+			s16_to_float_ref ((char *)(i16 + i), fa + i, n - i);
+			s16_to_float_ref ((char *)i16, fb, n);
+			CHECK (!memcmp (fa, fb, n * sizeof(float)), s16_to_float);
+		}
+		if (k.s32_to_float) {
+			i = k.s32_to_float ((char *)i32, fa, n);
+			s32_to_float_ref ((char *)(i32 + i), fa + i, n - i);
+			s32_to_float_ref ((char *)i32, fb, n);
+			CHECK (!memcmp (fa, fb, n * sizeof(float)), s32_to_float);
+		}
+		if (k.change_sign_8) {
+			memcpy (a, i32, n); memcpy (b, i32, n);
+			i = k.change_sign_8 ((uint8_t *)a, n);
+			change_sign_8_ref ((uint8_t *)a + i, n - i);
+			change_sign_8_ref ((uint8_t *)b, n);
+			CHECK (!memcmp (a, b, n), change_sign_8);
+		}
+		if (k.change_sign_16) {
+			memcpy (a, i32, 2*n); memcpy (b, i32, 2*n);
+			i = k.change_sign_16 ((uint16_t *)a, n);
+			change_sign_16_ref ((uint16_t *)a + i, n - i);
+			change_sign_16_ref ((uint16_t *)b, n);
+			CHECK (!memcmp (a, b, 2*n), change_sign_16);
+		}
+		if (k.change_sign_32) {
+			memcpy (a, i32, 4*n); memcpy (b, i32, 4*n);
+			i = k.change_sign_32 ((uint32_t *)a, n);
+			change_sign_32_ref ((uint32_t *)a + i, n - i);
+			change_sign_32_ref ((uint32_t *)b, n);
+			CHECK (!memcmp (a, b, 4*n), change_sign_32);
+		}
+		if (k.swap_16) {
+			memcpy (a, i32, 2*n); memcpy (b, i32, 2*n);
+			i = k.swap_16 ((int16_t *)a, n);
+			bswap_16_ref ((int16_t *)a + i, n - i);
+			bswap_16_ref ((int16_t *)b, n);
+			CHECK (!memcmp (a, b, 2*n), swap_16);
+		}
+		if (k.swap_32) {
+			memcpy (a, i32, 4*n); memcpy (b, i32, 4*n);
+			i = k.swap_32 ((int32_t *)a, n);
+			bswap_32_ref ((int32_t *)a + i, n - i);
+			bswap_32_ref ((int32_t *)b, n);
+			CHECK (!memcmp (a, b, 4*n), swap_32);
+		}
+		for (int Bps : { 1, 2, 4 }) {
+			if (!k.mono_to_stereo) break;
+			size_t size = n * Bps;
+			i = k.mono_to_stereo ((char *)i32, a, size, Bps);
+			mono_to_stereo_ref ((char *)i32 + i, a + 2*i, size - i, Bps);
+			mono_to_stereo_ref ((char *)i32, b, size, Bps);
+			CHECK (!memcmp (a, b, 2*size), mono_to_stereo);
+		}
+	}
+	#undef CHECK
+}
+#endif
+
 /* Convert fixed point samples in format fmt (size in bytes) to float.
- * Size of converted sound is put in new_size. Returned memory is malloc()ed. */
-static float *fixed_to_float (const char *buf, const size_t size,
-		const long fmt, size_t *new_size)
+ * out must have room for all of them. Return the number of samples. */
+size_t audio_conv_fixed_to_float (const char *buf, const size_t size,
+		const long fmt, float *out)
 {
-	float *out = NULL;
 	char fmt_name[SFMT_STR_MAX];
 
 	assert ((fmt & SFMT_MASK_FORMAT) != SFMT_FLOAT);
 
 	switch (fmt & SFMT_MASK_FORMAT) {
 		case SFMT_U8:
-			*new_size = sizeof(float) * size;
-			out = (float *)xmalloc (*new_size);
 			u8_to_float ((unsigned char *)buf, out, size);
-			break;
+			return size;
 		case SFMT_S8:
-			*new_size = sizeof(float) * size;
-			out = (float *)xmalloc (*new_size);
 			s8_to_float (buf, out, size);
-			break;
+			return size;
 		case SFMT_U16:
-			*new_size = sizeof(float) * size / 2;
-			out = (float *)xmalloc (*new_size);
 			u16_to_float ((unsigned char *)buf, out, size / 2);
-			break;
+			return size / 2;
 		case SFMT_S16:
-			*new_size = sizeof(float) * size / 2;
-			out = (float *)xmalloc (*new_size);
 			s16_to_float (buf, out, size / 2);
-			break;
+			return size / 2;
 		case SFMT_U32:
-			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			u32_to_float ((unsigned char *)buf, out, size / 4);
-			break;
+			return size / 4;
 		case SFMT_S32:
-			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			s32_to_float (buf, out, size / 4);
-			break;
+			return size / 4;
 		default:
 			error ("Can't convert from %s to float!",
 			       sfmt_str (fmt, fmt_name, sizeof (fmt_name)));
 			abort ();
 	}
-
-	return out;
 }
 
-/* Convert float samples to fixed point format fmt. Returned samples of size
- * new_size bytes is malloc()ed. */
-static char *float_to_fixed (const float *buf, const size_t samples,
-		const long fmt, size_t *new_size)
+/* Convert float samples to fixed point format fmt into out, which must be
+ * big enough. Samples outside of -1.0..1.0 are clipped. Return the size of
+ * the converted sound in bytes. */
+size_t audio_conv_float_to_fixed (const float *buf, const size_t samples,
+		const long fmt, char *out)
 {
 	char fmt_name[SFMT_STR_MAX];
-	char *new_snd = NULL;
 
 	assert ((fmt & SFMT_MASK_FORMAT) != SFMT_FLOAT);
 
 	switch (fmt & SFMT_MASK_FORMAT) {
 		case SFMT_U8:
-			*new_size = samples;
-			new_snd = (char *)xmalloc (samples);
-			float_to_u8 (buf, (unsigned char *)new_snd, samples);
-			break;
+			float_to_u8 (buf, (unsigned char *)out, samples);
+			return samples;
 		case SFMT_S8:
-			*new_size = samples;
-			new_snd = (char *)xmalloc (samples);
-			float_to_s8 (buf, new_snd, samples);
-			break;
+			float_to_s8 (buf, out, samples);
+			return samples;
 		case SFMT_U16:
-			*new_size = samples * 2;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_u16 (buf, (unsigned char *)new_snd, samples);
-			break;
+			float_to_u16 (buf, (unsigned char *)out, samples);
+			return samples * 2;
 		case SFMT_S16:
-			*new_size = samples * 2;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_s16 (buf, new_snd, samples);
-			break;
+			float_to_s16 (buf, out, samples);
+			return samples * 2;
 		case SFMT_U32:
-			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_u32 (buf, (unsigned char *)new_snd, samples);
-			break;
+			float_to_u32 (buf, (unsigned char *)out, samples);
+			return samples * 4;
 		case SFMT_S32:
-			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_s32 (buf, new_snd, samples);
-			break;
+			float_to_s32 (buf, out, samples);
+			return samples * 4;
 		default:
 			error ("Can't convert from float to %s!",
 			       sfmt_str (fmt, fmt_name, sizeof (fmt_name)));
 			abort ();
 	}
-
-	return new_snd;
 }
 
-static void change_sign_8 (uint8_t *buf, const size_t samples)
+static void change_sign_8_ref (uint8_t *buf, const size_t samples)
 {
 	size_t i;
 
@@ -332,7 +516,7 @@ static void change_sign_8 (uint8_t *buf, const size_t samples)
 		*buf++ ^= 1 << 7;
 }
 
-static void change_sign_16 (uint16_t *buf, const size_t samples)
+static void change_sign_16_ref (uint16_t *buf, const size_t samples)
 {
 	size_t i;
 
@@ -340,7 +524,7 @@ static void change_sign_16 (uint16_t *buf, const size_t samples)
 		*buf++ ^= 1 << 15;
 }
 
-static void change_sign_32 (uint32_t *buf, const size_t samples)
+static void change_sign_32_ref (uint32_t *buf, const size_t samples)
 {
 	size_t i;
 
@@ -386,7 +570,7 @@ static void change_sign (char *buf, const size_t size, long *fmt)
 	}
 }
 
-void audio_conv_bswap_16 (int16_t *buf, const size_t num)
+static void bswap_16_ref (int16_t *buf, const size_t num)
 {
 	size_t i;
 
@@ -394,7 +578,7 @@ void audio_conv_bswap_16 (int16_t *buf, const size_t num)
 		buf[i] = bswap_16 (buf[i]);
 }
 
-void audio_conv_bswap_32 (int32_t *buf, const size_t num)
+static void bswap_32_ref (int32_t *buf, const size_t num)
 {
 	size_t i;
 
@@ -443,190 +627,88 @@ int audio_conv_new (struct audio_conversion *conv,
 	}
 
 	if (from->rate != to->rate) {
-		int err;
-		int resample_type = -1;
-		using options::ResampleMethod_t;
-
-		switch (options::ResampleMethod)
-		{
-			case ResampleMethod_t::SincBestQuality:
-				resample_type = SRC_SINC_BEST_QUALITY;
-				break;
-			case ResampleMethod_t::SincMediumQuality:
-				resample_type = SRC_SINC_MEDIUM_QUALITY;
-				break;
-			case ResampleMethod_t::SincFastest:
-				resample_type = SRC_SINC_FASTEST;
-				break;
-			case ResampleMethod_t::ZeroOrderHold:
-				resample_type = SRC_ZERO_ORDER_HOLD;
-				break;
-			case ResampleMethod_t::Linear:
-				resample_type = SRC_LINEAR;
-				break;
-			default:
-				fatal ("Bad ResampleMethod option");
-				break;
-		}
-		conv->src_state = src_new (resample_type, to->channels, &err);
-		if (!conv->src_state) {
-			error ("Can't resample from %dHz to %dHz: %s",
-					from->rate, to->rate, src_strerror (err));
+		/* resampling is done before mono_to_stereo() */
+		conv->resampler = Resampler::create (from->rate, to->rate,
+				from->channels);
+		if (!conv->resampler)
 			return 0;
-		}
 	}
 	else
-		conv->src_state = NULL;
+		conv->resampler = NULL;
 
 	conv->from = *from;
 	conv->to = *to;
 
-	conv->resample_buf = NULL;
-	conv->resample_buf_nsamples = 0;
+	/* Size the scratch buffers for the chunks the player sends, so that
+	 * audio_conv() normally doesn't have to allocate anything. */
+	double expand = (double)MAX(sizeof(float), sfmt_Bps(to->fmt))
+		/ sfmt_Bps(from->fmt)
+		* (to->rate / (double)from->rate + 1.0)
+		* to->channels / from->channels;
+	size_t size = AUDIO_CONV_CHUNK * MAX(expand, 1.0);
+	for (int i = 0; i < 2; ++i) {
+		conv->scratch[i] = (char *)xmalloc (size);
+		conv->scratch_size[i] = size;
+	}
 
 	return 1;
 }
 
-static float *resample_sound (struct audio_conversion *conv, const float *buf,
-		const size_t samples, const int nchannels, size_t *resampled_samples)
+/* Get scratch buffer i of conv with room for at least size bytes. They only
+ * ever grow, so this allocates only when a chunk is bigger than any
+ * before. */
+static char *scratch (struct audio_conversion *conv, const int i,
+		const size_t size)
 {
-	SRC_DATA resample_data;
-	float *output;
-	float *new_input_start;
-	int output_samples = 0;
-
-	resample_data.end_of_input = 0;
-	resample_data.src_ratio = conv->to.rate / (double)conv->from.rate;
-
-	resample_data.input_frames = samples / nchannels
-		+ conv->resample_buf_nsamples / nchannels;
-	resample_data.output_frames = resample_data.input_frames
-		* resample_data.src_ratio;
-
-	if (conv->resample_buf) {
-		conv->resample_buf = (float *)xrealloc (conv->resample_buf,
-				sizeof(float) * resample_data.input_frames
-				* nchannels);
-		new_input_start = conv->resample_buf
-			+ conv->resample_buf_nsamples;
-	}
-	else {
-		conv->resample_buf = (float *)xmalloc (sizeof(float)
-				* resample_data.input_frames
-				* nchannels);
-		new_input_start = conv->resample_buf;
-	}
-
-	output = (float *)xmalloc (sizeof(float) * resample_data.output_frames
-				* nchannels);
-
-	/*debug ("Resampling %lu bytes of data by ratio %f", (unsigned long)size,
-			resample_data.src_ratio);*/
-
-	memcpy (new_input_start, buf, samples * sizeof(float));
-	resample_data.data_in = conv->resample_buf;
-	resample_data.data_out = output;
-
-	do {
-		int err;
-
-		if ((err = src_process(conv->src_state, &resample_data))) {
-			error ("Can't resample: %s", src_strerror (err));
-			free (output);
-			return NULL;
-		}
-
-		resample_data.data_in += resample_data.input_frames_used
-			* nchannels;
-		resample_data.input_frames -= resample_data.input_frames_used;
-		resample_data.data_out += resample_data.output_frames_gen
-			* nchannels;
-		resample_data.output_frames -= resample_data.output_frames_gen;
-		output_samples += resample_data.output_frames_gen * nchannels;
-	} while (resample_data.input_frames && resample_data.output_frames_gen
-			&& resample_data.output_frames);
-
-	*resampled_samples = output_samples;
-
-	if (resample_data.input_frames) {
-		conv->resample_buf_nsamples = resample_data.input_frames
-			* nchannels;
-		if (conv->resample_buf != resample_data.data_in) {
-			float *new_buf;
-
-			new_buf = (float *)xmalloc (sizeof(float) *
-					conv->resample_buf_nsamples);
-			memcpy (new_buf, resample_data.data_in, sizeof(float) *
-					conv->resample_buf_nsamples);
-			free (conv->resample_buf);
-			conv->resample_buf = new_buf;
-		}
-	}
-	else {
-		free (conv->resample_buf);
-		conv->resample_buf = NULL;
-		conv->resample_buf_nsamples = 0;
+	if (conv->scratch_size[i] < size) {
+		debug ("Growing conversion buffer to %zu bytes", size);
+		conv->scratch[i] = (char *)xrealloc (conv->scratch[i], size);
+		conv->scratch_size[i] = size;
 	}
-
-	return output;
+	return conv->scratch[i];
 }
 
-/* Double the channels from */
-static char *mono_to_stereo (const char *mono, const size_t size,
-		const long format)
+static void mono_to_stereo_ref (const char *mono, char *stereo,
+		const size_t size, const int Bps)
 {
-	int Bps = sfmt_Bps (format);
 	size_t i;
-	char *stereo;
-
-	stereo = (char *)xmalloc (size * 2);
 
 	for (i = 0; i < size; i += Bps) {
 		memcpy (stereo + (i * 2), mono + i, Bps);
 		memcpy (stereo + (i * 2 + Bps), mono + i, Bps);
 	}
-
-	return stereo;
 }
 
-static int16_t *s32_to_s16 (int32_t *in, const size_t samples)
+static void s32_to_s16 (const int32_t *in, int16_t *out, const size_t samples)
 {
 	size_t i;
-	int16_t *buf;
-
-	buf = (int16_t *)xmalloc (samples * 2);
 
 	for (i = 0; i < samples; i++)
-		buf[i] = in[i] >> 16;
-
-	return buf;
+		out[i] = in[i] >> 16;
 }
 
-static uint16_t *u32_to_u16 (uint32_t *in, const size_t samples)
+static void u32_to_u16 (const uint32_t *in, uint16_t *out, const size_t samples)
 {
 	size_t i;
-	uint16_t *buf;
-
-	buf = (uint16_t *)xmalloc (samples * 2);
 
 	for (i = 0; i < samples; i++)
-		buf[i] = in[i] >> 16;
-
-	return buf;
+		out[i] = in[i] >> 16;
 }
 
 /* Do the sound conversion.  buf of length size is the sample buffer to
  * convert and the size of the converted sound is put into *conv_len.
- * Return the converted sound in malloc()ed memory. */
+ * Return the converted sound, which lives in conv's scratch memory and is
+ * only valid until the next call. Returns NULL on error. */
 char *audio_conv (struct audio_conversion *conv, const char *buf,
 		const size_t size, size_t *conv_len)
 {
 	char *curr_sound;
+	int curr = 0; /* scratch buffer that holds curr_sound */
 	long curr_sfmt = conv->from.fmt;
 
 	*conv_len = size;
 
-	curr_sound = (char *)xmalloc (size);
+	curr_sound = scratch (conv, curr, size);
 	memcpy (curr_sound, buf, size);
 
 	if (!(curr_sfmt & SFMT_NE)) {
@@ -639,21 +721,20 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 	if ((curr_sfmt & (SFMT_S32 | SFMT_U32)) &&
 	    (conv->to.fmt & (SFMT_S16 | SFMT_U16)) &&
 	    conv->from.rate == conv->to.rate) {
-		char *new_sound;
+		char *new_sound = scratch (conv, !curr, *conv_len / 2);
 
 		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S32) {
-			new_sound = (char *)s32_to_s16 ((int32_t *)curr_sound,
+			s32_to_s16 ((int32_t *)curr_sound, (int16_t *)new_sound,
 					*conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_S16);
 		}
 		else {
-			new_sound = (char *)u32_to_u16 ((uint32_t *)curr_sound,
+			u32_to_u16 ((uint32_t *)curr_sound, (uint16_t *)new_sound,
 					*conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_U16);
 		}
 
-		if (curr_sound != buf)
-			free (curr_sound);
+		curr = !curr;
 		curr_sound = new_sound;
 		*conv_len /= 2;
 	}
@@ -663,45 +744,52 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 				|| (conv->to.fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT
 				|| !sfmt_same_bps(conv->to.fmt, curr_sfmt))
 			&& (curr_sfmt & SFMT_MASK_FORMAT) != SFMT_FLOAT) {
-		char *new_sound;
+		size_t samples = *conv_len / sfmt_Bps (curr_sfmt);
+		char *new_sound = scratch (conv, !curr, samples * sizeof(float));
 
-		new_sound = (char *)fixed_to_float (curr_sound, *conv_len,
-				curr_sfmt, conv_len);
+		audio_conv_fixed_to_float (curr_sound, *conv_len, curr_sfmt,
+				(float *)new_sound);
 		curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_FLOAT);
 
-		if (curr_sound != buf)
-			free (curr_sound);
+		curr = !curr;
 		curr_sound = new_sound;
+		*conv_len = samples * sizeof(float);
 	}
 
-	if (conv->from.rate != conv->to.rate) {
-		char *new_sound = (char *)resample_sound (conv,
-				(float *)curr_sound,
-				*conv_len / sizeof(float), conv->to.channels,
-				conv_len);
-		*conv_len *= sizeof(float);
-		if (curr_sound != buf)
-			free (curr_sound);
+	if (conv->resampler) {
+		Resampler *rs = conv->resampler;
+		size_t frames = *conv_len / sizeof(float) / conv->from.channels;
+		size_t out_frames = rs->max_output (frames);
+		char *new_sound = scratch (conv, !curr,
+				out_frames * conv->from.channels * sizeof(float));
+		long n = rs->process ((float *)curr_sound, frames,
+				(float *)new_sound, out_frames);
+
+		if (n < 0)
+			return NULL;
+
+		curr = !curr;
 		curr_sound = new_sound;
+		*conv_len = n * conv->from.channels * sizeof(float);
 	}
 
 	if ((curr_sfmt & SFMT_MASK_FORMAT)
 			!= (conv->to.fmt & SFMT_MASK_FORMAT)) {
 
 		if (sfmt_same_bps(curr_sfmt, conv->to.fmt))
-			change_sign (curr_sound, size, &curr_sfmt);
+			change_sign (curr_sound, *conv_len, &curr_sfmt);
 		else {
-			char *new_sound;
+			size_t samples = *conv_len / sizeof(float);
+			char *new_sound = scratch (conv, !curr,
+					samples * sfmt_Bps (conv->to.fmt));
 
 			assert (curr_sfmt & SFMT_FLOAT);
 
-			new_sound = float_to_fixed ((float *)curr_sound,
-					*conv_len / sizeof(float),
-					conv->to.fmt, conv_len);
+			*conv_len = audio_conv_float_to_fixed ((float *)curr_sound, samples,
+					conv->to.fmt, new_sound);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, conv->to.fmt);
 
-			if (curr_sound != buf)
-				free (curr_sound);
+			curr = !curr;
 			curr_sound = new_sound;
 		}
 	}
@@ -714,13 +802,12 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 	}
 
 	if (conv->from.channels == 1 && conv->to.channels == 2) {
-		char *new_sound;
+		char *new_sound = scratch (conv, !curr, *conv_len * 2);
 
-		new_sound = mono_to_stereo (curr_sound, *conv_len, curr_sfmt);
+		mono_to_stereo (curr_sound, new_sound, *conv_len, curr_sfmt);
 		*conv_len *= 2;
 
-		if (curr_sound != buf)
-			free (curr_sound);
+		curr = !curr;
 		curr_sound = new_sound;
 	}
 
@@ -731,8 +818,7 @@ void audio_conv_destroy (struct audio_conversion *conv)
 {
 	assert (conv != NULL);
 
-	if (conv->resample_buf)
-		free (conv->resample_buf);
-	if (conv->src_state)
-		src_delete (conv->src_state);
+	free (conv->scratch[0]);
+	free (conv->scratch[1]);
+	delete conv->resampler;
 }
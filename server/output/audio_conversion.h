@@ -2,7 +2,6 @@
 
 #include <stdint.h>
 #include <sys/types.h>
-#include <samplerate.h>
 
 #include "../audio.h"
 
@@ -11,11 +10,18 @@ struct audio_conversion
 	struct sound_params from;
 	struct sound_params to;
 
-	SRC_STATE *src_state;
-	float *resample_buf;
-	size_t resample_buf_nsamples; /* in samples ( sizeof(float) ) */
+	class Resampler *resampler; /* NULL if the rate stays the same */
+
+	/* Ping-pong buffers for the conversion steps, allocated by
+	 * audio_conv_new() and reused by every audio_conv() call. */
+	char *scratch[2];
+	size_t scratch_size[2];
 };
 
+/* Largest chunk audio_conv() is expected to get at once. Bigger ones work
+ * too, but the scratch buffers have to grow. */
+#define AUDIO_CONV_CHUNK	(64 * 1024)
+
 int audio_conv_new (struct audio_conversion *conv,
 		const struct sound_params *from,
 		const struct sound_params *to);
@@ -23,5 +29,10 @@ char *audio_conv (struct audio_conversion *conv,
 		const char *buf, const size_t size, size_t *conv_len);
 void audio_conv_destroy (struct audio_conversion *conv);
 
+size_t audio_conv_fixed_to_float (const char *buf, const size_t size,
+		const long fmt, float *out);
+size_t audio_conv_float_to_fixed (const float *buf, const size_t samples,
+		const long fmt, char *out);
+
 void audio_conv_bswap_16 (int16_t *buf, const size_t num);
 void audio_conv_bswap_32 (int32_t *buf, const size_t num);
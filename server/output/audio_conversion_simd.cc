@@ -0,0 +1,381 @@
+/*
+ * SSE2/AVX2/NEON versions of the hot loops in audio_conversion.cc.
+ *
+ * They must give exactly the same bytes as the scalar code there, which is
+ * the reference (debug builds check this at startup). The non-obvious
+ * parts of that are:
+ *
+ * - float_to_s16 scales by 2^31, rounds with the current rounding mode like
+ *   lrintf() and shifts. Values at or above full scale give INT16_MAX,
+ *   values at or below give INT16_MIN and NaN gives 0 (lrintf returns a
+ *   64-bit long, whose "invalid" value has zeros in bits 16..31).
+ * - s32_to_float divides by (float)INT32_MAX + 1.0, which is the double
+ *   2147483649.0, so it has to be done in double precision and rounded
+ *   to float afterwards.
+ *
+ * The x86 code is only used on x86_64, where the scalar code also runs on
+ * SSE and not on the x87 unit with its extended precision.
+ */
+
+#include "audio_conversion_simd.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+SSE2 static inline __m128i float_to_s16_4 (__m128 x)
+{
+	const __m128 full = _mm_set1_ps(2147483648.0f);
+	__m128 f = _mm_mul_ps(x, full);
+	__m128i r = _mm_srai_epi32(_mm_cvtps_epi32(f), 16);
+	__m128i hi = _mm_castps_si128(_mm_cmpge_ps(f, full));
+	__m128i nan = _mm_castps_si128(_mm_cmpunord_ps(f, f));
+	r = _mm_or_si128(_mm_andnot_si128(hi, r),
+	                 _mm_and_si128(hi, _mm_set1_epi32(INT16_MAX)));
+	return _mm_andnot_si128(nan, r);
+}
+
+SSE2 static size_t float_to_s16_sse2 (const float *in, char *out, size_t samples)
+{
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		__m128i a = float_to_s16_4(_mm_loadu_ps(in + i));
+		__m128i b = float_to_s16_4(_mm_loadu_ps(in + i + 4));
+		_mm_storeu_si128((__m128i *)(out + 2*i), _mm_packs_epi32(a, b));
+	}
+	return i;
+}
+
+SSE2 static size_t s16_to_float_sse2 (const char *in, float *out, size_t samples)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 2*i));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		_mm_storeu_ps(out + i,     _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+	return i;
+}
+
+SSE2 static size_t s32_to_float_sse2 (const char *in, float *out, size_t samples)
+{
+	const __m128d d = _mm_set1_pd(2147483649.0);
+	size_t i = 0;
+	for (; i + 4 <= samples; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 4*i));
+		__m128d lo = _mm_div_pd(_mm_cvtepi32_pd(v), d);
+		__m128d hi = _mm_div_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v, 0xEE)), d);
+		_mm_storeu_ps(out + i, _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)));
+	}
+	return i;
+}
+
+SSE2 static size_t xor_sse2 (char *buf, size_t bytes, __m128i m)
+{
+	size_t i = 0;
+	for (; i + 16 <= bytes; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		_mm_storeu_si128((__m128i *)(buf + i), _mm_xor_si128(v, m));
+	}
+	return i;
+}
+
+SSE2 static size_t change_sign_8_sse2 (uint8_t *buf, size_t samples)
+{
+	return xor_sse2((char *)buf, samples, _mm_set1_epi8((char)0x80));
+}
+
+SSE2 static size_t change_sign_16_sse2 (uint16_t *buf, size_t samples)
+{
+	return xor_sse2((char *)buf, samples * 2, _mm_set1_epi16((short)0x8000)) / 2;
+}
+
+SSE2 static size_t change_sign_32_sse2 (uint32_t *buf, size_t samples)
+{
+	return xor_sse2((char *)buf, samples * 4, _mm_set1_epi32((int)0x80000000)) / 4;
+}
+
+SSE2 static inline __m128i bswap_16_8 (__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+SSE2 static size_t bswap_16_sse2 (int16_t *buf, size_t num)
+{
+	size_t i = 0;
+	for (; i + 8 <= num; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		_mm_storeu_si128((__m128i *)(buf + i), bswap_16_8(v));
+	}
+	return i;
+}
+
+SSE2 static size_t bswap_32_sse2 (int32_t *buf, size_t num)
+{
+	size_t i = 0;
+	for (; i + 4 <= num; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+		_mm_storeu_si128((__m128i *)(buf + i), bswap_16_8(v));
+	}
+	return i;
+}
+
+SSE2 static size_t mono_to_stereo_sse2 (const char *mono, char *stereo,
+		size_t size, int Bps)
+{
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(mono + i));
+		__m128i lo, hi;
+		switch (Bps) {
+			case 1: lo = _mm_unpacklo_epi8(v, v);  hi = _mm_unpackhi_epi8(v, v);  break;
+			case 2: lo = _mm_unpacklo_epi16(v, v); hi = _mm_unpackhi_epi16(v, v); break;
+			case 4: lo = _mm_unpacklo_epi32(v, v); hi = _mm_unpackhi_epi32(v, v); break;
+			default: return 0;
+		}
+		_mm_storeu_si128((__m128i *)(stereo + 2*i), lo);
+		_mm_storeu_si128((__m128i *)(stereo + 2*i + 16), hi);
+	}
+	return i;
+}
+
+AVX2 static size_t float_to_s16_avx2 (const float *in, char *out, size_t samples)
+{
+	const __m256 full = _mm256_set1_ps(2147483648.0f);
+	const __m256i max = _mm256_set1_epi32(INT16_MAX);
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16) {
+		__m256i r[2];
+		for (int k = 0; k < 2; ++k) {
+			__m256 f = _mm256_mul_ps(_mm256_loadu_ps(in + i + 8*k), full);
+			__m256i v = _mm256_srai_epi32(_mm256_cvtps_epi32(f), 16);
+			__m256i hi = _mm256_castps_si256(_mm256_cmp_ps(f, full, _CMP_GE_OQ));
+			__m256i nan = _mm256_castps_si256(_mm256_cmp_ps(f, f, _CMP_UNORD_Q));
+			v = _mm256_blendv_epi8(v, max, hi);
+			r[k] = _mm256_andnot_si256(nan, v);
+		}
+		/* packs works per 128-bit lane, put the quarters back in order */
+		__m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(r[0], r[1]), 0xD8);
+		_mm256_storeu_si256((__m256i *)(out + 2*i), p);
+	}
+	return i;
+}
+
+AVX2 static size_t s16_to_float_avx2 (const char *in, float *out, size_t samples)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 2*i));
+		__m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(f, scale));
+	}
+	return i;
+}
+
+AVX2 static size_t s32_to_float_avx2 (const char *in, float *out, size_t samples)
+{
+	const __m256d d = _mm256_set1_pd(2147483649.0);
+	size_t i = 0;
+	for (; i + 4 <= samples; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 4*i));
+		__m256d x = _mm256_div_pd(_mm256_cvtepi32_pd(v), d);
+		_mm_storeu_ps(out + i, _mm256_cvtpd_ps(x));
+	}
+	return i;
+}
+
+AVX2 static size_t bswap_avx2 (char *buf, size_t bytes, __m256i m)
+{
+	size_t i = 0;
+	for (; i + 32 <= bytes; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		_mm256_storeu_si256((__m256i *)(buf + i), _mm256_shuffle_epi8(v, m));
+	}
+	return i;
+}
+
+AVX2 static size_t bswap_16_avx2 (int16_t *buf, size_t num)
+{
+	const __m256i m = _mm256_setr_epi8(
+		1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14,
+		1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14);
+	return bswap_avx2((char *)buf, num * 2, m) / 2;
+}
+
+AVX2 static size_t bswap_32_avx2 (int32_t *buf, size_t num)
+{
+	const __m256i m = _mm256_setr_epi8(
+		3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+		3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+	return bswap_avx2((char *)buf, num * 4, m) / 4;
+}
+
+void conv_kernels_select (conv_kernels &k)
+{
+	__builtin_cpu_init ();
+	if (!__builtin_cpu_supports ("sse2")) return;
+
+	k.name = "SSE2";
+	k.float_to_s16 = float_to_s16_sse2;
+	k.s16_to_float = s16_to_float_sse2;
+	k.s32_to_float = s32_to_float_sse2;
+	k.change_sign_8 = change_sign_8_sse2;
+	k.change_sign_16 = change_sign_16_sse2;
+	k.change_sign_32 = change_sign_32_sse2;
+	k.swap_16 = bswap_16_sse2;
+	k.swap_32 = bswap_32_sse2;
+	k.mono_to_stereo = mono_to_stereo_sse2;
+
+	if (!__builtin_cpu_supports ("avx2")) return;
+
+	k.name = "AVX2";
+	k.float_to_s16 = float_to_s16_avx2;
+	k.s16_to_float = s16_to_float_avx2;
+	k.s32_to_float = s32_to_float_avx2;
+	k.swap_16 = bswap_16_avx2;
+	k.swap_32 = bswap_32_avx2;
+}
+
+#elif defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static size_t float_to_s16_neon (const float *in, char *out, size_t samples)
+{
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		/* vcvtn saturates and turns NaN into 0, just what we need */
+		int32x4_t a = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(in + i), 2147483648.0f));
+		int32x4_t b = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(in + i + 4), 2147483648.0f));
+		int16x8_t r = vcombine_s16(vshrn_n_s32(a, 16), vshrn_n_s32(b, 16));
+		vst1q_s16((int16_t *)(out + 2*i), r);
+	}
+	return i;
+}
+
+static size_t s16_to_float_neon (const char *in, float *out, size_t samples)
+{
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8) {
+		int16x8_t v = vld1q_s16((const int16_t *)(in + 2*i));
+		float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+		float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+		vst1q_f32(out + i,     vmulq_n_f32(lo, 1.0f / 32768.0f));
+		vst1q_f32(out + i + 4, vmulq_n_f32(hi, 1.0f / 32768.0f));
+	}
+	return i;
+}
+
+static size_t s32_to_float_neon (const char *in, float *out, size_t samples)
+{
+	const float64x2_t d = vdupq_n_f64(2147483649.0);
+	size_t i = 0;
+	for (; i + 4 <= samples; i += 4) {
+		int32x4_t v = vld1q_s32((const int32_t *)(in + 4*i));
+		float64x2_t lo = vdivq_f64(vcvtq_f64_s64(vmovl_s32(vget_low_s32(v))), d);
+		float64x2_t hi = vdivq_f64(vcvtq_f64_s64(vmovl_high_s32(v)), d);
+		vst1q_f32(out + i, vcvt_high_f32_f64(vcvt_f32_f64(lo), hi));
+	}
+	return i;
+}
+
+static size_t change_sign_8_neon (uint8_t *buf, size_t samples)
+{
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16)
+		vst1q_u8(buf + i, veorq_u8(vld1q_u8(buf + i), vdupq_n_u8(0x80)));
+	return i;
+}
+
+static size_t change_sign_16_neon (uint16_t *buf, size_t samples)
+{
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+		vst1q_u16(buf + i, veorq_u16(vld1q_u16(buf + i), vdupq_n_u16(0x8000)));
+	return i;
+}
+
+static size_t change_sign_32_neon (uint32_t *buf, size_t samples)
+{
+	size_t i = 0;
+	for (; i + 4 <= samples; i += 4)
+		vst1q_u32(buf + i, veorq_u32(vld1q_u32(buf + i), vdupq_n_u32(0x80000000)));
+	return i;
+}
+
+static size_t bswap_16_neon (int16_t *buf, size_t num)
+{
+	size_t i = 0;
+	for (; i + 8 <= num; i += 8) {
+		uint8_t *p = (uint8_t *)(buf + i);
+		vst1q_u8(p, vrev16q_u8(vld1q_u8(p)));
+	}
+	return i;
+}
+
+static size_t bswap_32_neon (int32_t *buf, size_t num)
+{
+	size_t i = 0;
+	for (; i + 4 <= num; i += 4) {
+		uint8_t *p = (uint8_t *)(buf + i);
+		vst1q_u8(p, vrev32q_u8(vld1q_u8(p)));
+	}
+	return i;
+}
+
+static size_t mono_to_stereo_neon (const char *mono, char *stereo,
+		size_t size, int Bps)
+{
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		switch (Bps) {
+			case 1: {
+				uint8x16_t v = vld1q_u8((const uint8_t *)(mono + i));
+				vst2q_u8((uint8_t *)(stereo + 2*i), (uint8x16x2_t){{v, v}});
+				break;
+			}
+			case 2: {
+				uint16x8_t v = vld1q_u16((const uint16_t *)(mono + i));
+				vst2q_u16((uint16_t *)(stereo + 2*i), (uint16x8x2_t){{v, v}});
+				break;
+			}
+			case 4: {
+				uint32x4_t v = vld1q_u32((const uint32_t *)(mono + i));
+				vst2q_u32((uint32_t *)(stereo + 2*i), (uint32x4x2_t){{v, v}});
+				break;
+			}
+			default: return 0;
+		}
+	}
+	return i;
+}
+
+void conv_kernels_select (conv_kernels &k)
+{
+	k.name = "NEON";
+	k.float_to_s16 = float_to_s16_neon;
+	k.s16_to_float = s16_to_float_neon;
+	k.s32_to_float = s32_to_float_neon;
+	k.change_sign_8 = change_sign_8_neon;
+	k.change_sign_16 = change_sign_16_neon;
+	k.change_sign_32 = change_sign_32_neon;
+	k.swap_16 = bswap_16_neon;
+	k.swap_32 = bswap_32_neon;
+	k.mono_to_stereo = mono_to_stereo_neon;
+}
+
+#else
+
+void conv_kernels_select (conv_kernels &k)
+{
+}
+
+#endif
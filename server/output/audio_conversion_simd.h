@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/* Vectorized sample conversion kernels, see audio_conversion_simd.cc.
+ * Every kernel handles some prefix of its input and returns how many
+ * samples (bytes for mono_to_stereo) it did; the scalar reference code in
+ * audio_conversion.cc does the rest. A NULL entry means there is no faster
+ * version on this CPU. */
+struct conv_kernels
+{
+	const char *name;
+
+	size_t (*float_to_s16) (const float *in, char *out, size_t samples);
+	size_t (*s16_to_float) (const char *in, float *out, size_t samples);
+	size_t (*s32_to_float) (const char *in, float *out, size_t samples);
+
+	size_t (*change_sign_8)  (uint8_t *buf, size_t samples);
+	size_t (*change_sign_16) (uint16_t *buf, size_t samples);
+	size_t (*change_sign_32) (uint32_t *buf, size_t samples);
+	size_t (*swap_16) (int16_t *buf, size_t num);
+	size_t (*swap_32) (int32_t *buf, size_t num);
+
+	size_t (*mono_to_stereo) (const char *mono, char *stereo, size_t size,
+	                          int Bps);
+};
+
+/* Fill k with the best kernels the running CPU supports. */
+void conv_kernels_select (conv_kernels &k);
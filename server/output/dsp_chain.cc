@@ -0,0 +1,119 @@
+#include "dsp_chain.h"
+#include "audio_conversion.h"
+#include "equalizer.h"
+#include "softmixer.h"
+
+/* Number of frames the float stages work on at once. Small enough that a
+ * block stays in L1 between the stages. */
+#define DSP_BLOCK_FRAMES	256
+
+void DSPChain::configure(const sound_params &driver_sp)
+{
+	sp = driver_sp;
+
+	size_t n = DSP_BLOCK_FRAMES * sp.channels;
+	if (n > scratch_len) {
+		scratch = (float *)xrealloc (scratch, n * sizeof(float));
+		scratch_len = n;
+	}
+
+	equalizer_configure (sp);
+}
+
+bool DSPChain::active() const
+{
+	return equalizer_is_ready ()
+		|| (softmixer_is_active () && softmixer_get_value () != 100)
+		|| (softmixer_is_mono () && sp.channels > 1);
+}
+
+static void swap_block (char *buf, size_t samples, int Bps)
+{
+	if (Bps == 2)
+		audio_conv_bswap_16 ((int16_t *)buf, samples);
+	else if (Bps == 4)
+		audio_conv_bswap_32 ((int32_t *)buf, samples);
+}
+
+/* Add triangular (TPDF) dither of +-1 LSB of the output format. */
+void DSPChain::dither(float *buf, size_t samples)
+{
+	float lsb;
+	switch (sp.fmt & SFMT_MASK_FORMAT) {
+		case SFMT_S8:  case SFMT_U8:  lsb = 1.0f / (1 << 7);  break;
+		case SFMT_S16: case SFMT_U16: lsb = 1.0f / (1 << 15); break;
+		case SFMT_S32: case SFMT_U32: lsb = 1.0f / (1 << 23); break;
+		default: return;
+	}
+
+	const float scale = lsb / 4294967296.0f;
+	uint32_t x = seed;
+	for (size_t i = 0; i < samples; ++i) {
+		// two xorshift32 draws, their difference is triangular
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5; uint32_t r1 = x;
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5; uint32_t r2 = x;
+		buf[i] += ((float)r1 - (float)r2) * scale;
+	}
+	seed = x;
+}
+
+void DSPChain::process(char *buf, size_t size)
+{
+	NoHeapGuard no_heap;
+
+	const int C = sp.channels;
+	const bool do_eq = equalizer_is_ready ();
+	const float gain = softmixer_is_active () ? softmixer_get_value () / 100.0f : 1.0f;
+	const bool do_mono = softmixer_is_mono () && C > 1;
+	if (!do_eq && gain == 1.0f && !do_mono) return;
+
+	const long fmt = sp.fmt;
+	const int Bps = sfmt_Bps (fmt);
+	const bool is_float = (fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT;
+	const bool do_endian = (fmt & SFMT_MASK_ENDIANNESS) && !(fmt & SFMT_NE);
+	const bool do_dither = options::Dither && !is_float;
+
+	/* a partial frame at the end (if any) is left alone */
+	size_t samples = size / Bps;
+	samples -= samples % C;
+
+	/* whole frames, scratch may be bigger after more channels */
+	const size_t block = DSP_BLOCK_FRAMES * C;
+	for (size_t i0 = 0; i0 < samples; i0 += block) {
+		const size_t n = std::min(block, samples - i0);
+		char *p = buf + i0 * Bps;
+		float *f = scratch;
+
+		if (do_endian) swap_block (p, n, Bps);
+
+		if (is_float)
+			memcpy (f, p, n * sizeof(float));
+		else
+			audio_conv_fixed_to_float (p, n * Bps, fmt, f);
+
+		if (do_eq) equalizer_process_float (f, n);
+
+		if (gain != 1.0f)
+			for (size_t i = 0; i < n; ++i) f[i] *= gain;
+
+		if (do_mono) {
+			for (size_t i = 0; i < n; i += C) {
+				float k = 0.0f;
+				for (int c = 0; c < C; ++c) k += f[i+c];
+				k /= C;
+				for (int c = 0; c < C; ++c) f[i+c] = k;
+			}
+		}
+
+		if (do_dither) dither (f, n);
+
+		if (is_float) {
+			for (size_t i = 0; i < n; ++i) f[i] = CLAMP(-1.0f, f[i], 1.0f);
+			memcpy (p, f, n * sizeof(float));
+		}
+		else
+			audio_conv_float_to_fixed (f, n, fmt, p);
+
+		if (do_endian) swap_block (p, n, Bps);
+	}
+}
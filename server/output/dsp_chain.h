@@ -0,0 +1,28 @@
+#pragma once
+#include "../audio.h"
+
+/* The processing audio_send_pcm() does on the output thread, in place on
+ * sound that is in the driver's format. Each block is converted to float
+ * once, goes through the equalizer, softmixer volume and mono downmix while
+ * it is in cache, and is converted back once (optionally with dither).
+ * configure() is called by audio_open() and allocates everything, so
+ * process() never touches the heap. */
+class DSPChain
+{
+public:
+	DSPChain() : sp{0, 0, 0}, scratch(NULL), scratch_len(0), seed(1) {}
+	DSPChain(const DSPChain &) = delete;
+	~DSPChain() { free(scratch); }
+
+	void configure(const sound_params &driver_sp);
+	bool active() const;
+	void process(char *buf, size_t size);
+
+private:
+	void dither(float *buf, size_t samples);
+
+	sound_params sp;
+	float *scratch;     // float copy of one block
+	size_t scratch_len; // allocated, in samples
+	uint32_t seed;      // for dither()
+};
@@ -9,11 +9,8 @@
  * coefficients' by Robert Bristow-Johnson.
  * https://www.w3.org/2011/audio/audio-eq-cookbook.html
  *
- * TODO:
- * - Merge somehow with softmixer code to avoid multiple endianness
- *   conversions.
- * - Implement equalizer routines for integer samples... conversion
- *   to float (and back) is lazy...
+ * The sound is converted to float and back by DSPChain, which runs the
+ * equalizer and the softmixer in one pass.
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -32,10 +29,12 @@
 #include "audio_conversion.h"
 #include "equalizer.h"
 
+/* Coefficients of one peaking EQ band, normalized so that a0 = 1. The
+ * filter state lives in Equalizer::z, separate from these, so one set of
+ * coefficients serves all channels. */
 struct Biquad
 {
-	float a0, a1, a2, a3, a4;
-	mutable float x1, x2, y1, y2;
+	float b0, b1, b2, a1, a2;
 
 	/* biquad functions */
 
@@ -60,24 +59,11 @@ struct Biquad
 		float a1 =  b1;
 		float a2 =  1.0f - alpha_d_A;
 
-		this->a0 = b0 / a0;
-		this->a1 = b1 / a0;
-		this->a2 = b2 / a0;
-		this->a3 = a1 / a0;
-		this->a4 = a2 / a0;
-
-		this->x1 = 0.0f;
-		this->x2 = 0.0f;
-		this->y1 = 0.0f;
-		this->y2 = 0.0f;
-	}
-
-	void operator() (float &s, float &f) const
-	{
-		f = s*a0 + a1*x1 + a2*x2 - a3*y1 - a4*y2;
-		x2 = x1; x1 = s;
-		y2 = y1; y1 = f;
-		s = f;
+		this->b0 = b0 / a0;
+		this->b1 = b1 / a0;
+		this->b2 = b2 / a0;
+		this->a1 = a1 / a0;
+		this->a2 = a2 / a0;
 	}
 };
 
@@ -85,7 +71,8 @@ struct Equalizer
 {
 	str   name;
 	float preamp;
-	std::vector<Biquad> b;
+	std::vector<Biquad> b; // one per band
+	std::vector<float>  z; // filter state: per band, s1 for every channel, then s2
 };
 
 /* config processing */
@@ -121,26 +108,6 @@ void equalizer_prev()
 	options::EqualizerPreset = eq->name;
 }
 
-/* Applies a set of biquadratic filters to a buffer of floating point samples.
- * It is safe to have the same input and output buffer.
- * length of src and dst is len
- */
-static inline void apply_biquads(float *src, float *dst, int len, const std::vector<Biquad> b)
-{
-	int blen = b.size() / channels;
-	while (len > 0)
-	{
-		for (int c = 0; c < channels; ++c)
-		{
-			auto *cb = b.data() + c*blen; // data for channel c
-			float s = *src++, f = s;
-			for (int i = 0; i < blen; ++i) (*cb++)(s, f);
-			*dst++ = f;
-			--len;
-		}
-	}
-}
-
 void equalizer_init()
 {
 	sample_rate = 44100;
@@ -229,95 +196,117 @@ void equalizer_refresh()
 	if (!eq) equalizer_next();
 }
 
-template<typename T>
-static void process(T *buf, size_t samples)
+/* Rebuild the filters for new sound parameters. Called when the device is
+ * opened, so the output thread doesn't have to. */
+void equalizer_configure(const sound_params &sp)
 {
-	constexpr auto A = (float)std::numeric_limits<T>::min();
-	constexpr auto B = (float)std::numeric_limits<T>::max();
-	float *tmp = (float *)xmalloc (samples * sizeof (float));
-
-	for (size_t i = 0; i < samples; ++i)
-		tmp[i] = eq->preamp * (float)buf[i];
+	if (sp.rate == sample_rate && sp.channels == channels) return;
 
-	apply_biquads(tmp, tmp, samples, eq->b);
+	logit ("Recreating filters due to sound parameter changes...");
+	sample_rate = sp.rate;
+	channels = sp.channels;
+	equalizer_refresh();
+}
 
-	for (size_t i = 0; i < samples; ++i)
-	{
-		tmp[i] = (1.0f - mixin_rate) * tmp[i] + mixin_rate * (float)buf[i];
-		buf[i] = (T)CLAMP(A, tmp[i], B);
-	}
+/* sound processing code */
 
-	free(tmp);
-}
-static void process(float *buf, size_t samples)
+bool equalizer_is_ready()
 {
-	float *tmp = (float *)xmalloc (samples * sizeof (float));
+	return options::EqualizerActive && eq && !eq->b.empty();
+}
 
-	for (size_t i = 0; i < samples; ++i)
-		tmp[i] = eq->preamp * (float)buf[i];
+/* State values below this are flushed to zero at the end of each run, so
+ * that decaying filters don't drop into denormals, which are very slow on
+ * most FPUs. This is far below the resolution of any output format. */
+#define DENORMAL_LIMIT	1e-15f
 
-	apply_biquads(tmp, tmp, samples, eq->b);
+static inline float flush(float s)
+{
+	return fabsf(s) < DENORMAL_LIMIT ? 0.0f : s;
+}
 
-	for (size_t i = 0; i < samples; ++i)
+/* Run one band over interleaved frames in transposed direct form II. All
+ * channels of the band are processed side by side, with their state kept in
+ * locals for the whole run; for a fixed channel count the compiler keeps
+ * them in registers and can put the channels into SIMD lanes. */
+template<int C> static void run_band(const Biquad &q, float *z, float *buf, size_t frames)
+{
+	const float b0 = q.b0, b1 = q.b1, b2 = q.b2, a1 = q.a1, a2 = q.a2;
+	float s1[C], s2[C];
+	for (int c = 0; c < C; ++c) { s1[c] = z[c]; s2[c] = z[C+c]; }
+
+	for (size_t i = 0; i < frames; ++i, buf += C)
 	{
-		tmp[i] = (1.0f - mixin_rate) * tmp[i] + mixin_rate * buf[i];
-		buf[i] = CLAMP(-1.0f, tmp[i], 1.0f);
+		for (int c = 0; c < C; ++c)
+		{
+			float x = buf[c], y = b0*x + s1[c];
+			s1[c] = b1*x - a1*y + s2[c];
+			s2[c] = b2*x - a2*y;
+			buf[c] = y;
+		}
 	}
 
-	free(tmp);
+	for (int c = 0; c < C; ++c) { z[c] = flush(s1[c]); z[C+c] = flush(s2[c]); }
 }
 
-/* sound processing code */
-void equalizer_process_buffer(char *buf, size_t size, const sound_params &sp)
+/* Same for any other channel count: one channel at a time. */
+static void run_band(const Biquad &q, float *z, float *buf, size_t frames, int C)
 {
-	if(!options::EqualizerActive || !eq || eq->b.empty()) return;
-
-	if (sp.rate != sample_rate || sp.channels != channels)
+	const float b0 = q.b0, b1 = q.b1, b2 = q.b2, a1 = q.a1, a2 = q.a2;
+	for (int c = 0; c < C; ++c)
 	{
-		logit ("Recreating filters due to sound parameter changes...");
-		sample_rate = sp.rate;
-		channels = sp.channels;
-		equalizer_refresh();
+		float s1 = z[c], s2 = z[C+c];
+		float *p = buf + c;
+		for (size_t i = 0; i < frames; ++i, p += C)
+		{
+			float x = *p, y = b0*x + s1;
+			s1 = b1*x - a1*y + s2;
+			s2 = b2*x - a2*y;
+			*p = y;
+		}
+		z[c] = flush(s1); z[C+c] = flush(s2);
 	}
+}
+
+/* Apply preamp, the filters and the mixin to interleaved float samples in
+ * place. samples must be a multiple of the channel count and the sound must
+ * have the parameters given to equalizer_configure().
+ * The cascade runs band by band over chunks that fit into L1, instead of
+ * pushing every sample through all bands. */
+void equalizer_process_float(float *buf, size_t samples)
+{
+	if (!equalizer_is_ready()) return;
 
-	bool do_endian = (sp.fmt & SFMT_MASK_ENDIANNESS != SFMT_NE);
+	const int C = channels;
+	const int nb = eq->b.size();
+	const Biquad *b = eq->b.data();
+	float *z = eq->z.data();
+	const float preamp = eq->preamp;
+	const float mix = mixin_rate;
 
-	switch (sp.fmt & SFMT_MASK_FORMAT)
+	float dry[1024]; // unfiltered input for the mixin
+	const size_t chunk = sizeof(dry)/sizeof(float) / C * C;
+
+	for (size_t i0 = 0; i0 < samples; i0 += chunk)
 	{
-		case SFMT_U8:
-			process((uint8_t *)buf, size);
-			break;
-		case SFMT_S8:
-			process((int8_t *)buf, size);
-			break;
-		case SFMT_U16:
-			size /= sizeof(uint16_t);
-			if (do_endian)  audio_conv_bswap_16((int16_t *)buf, size);
-			process((uint16_t *)buf, size);
-			if (do_endian)  audio_conv_bswap_16((int16_t *)buf, size);
-			break;
-		case SFMT_S16:
-			size /= sizeof(int16_t);
-			if (do_endian)  audio_conv_bswap_16((int16_t *)buf, size);
-			process((int16_t *)buf, size);
-			if (do_endian)  audio_conv_bswap_16((int16_t *)buf, size);
-			break;
-		case SFMT_U32:
-			size /= sizeof(uint32_t);
-			if (do_endian)  audio_conv_bswap_32((int32_t *)buf, size);
-			process((uint32_t *)buf, size);
-			if (do_endian)  audio_conv_bswap_32((int32_t *)buf, size);
-			break;
-		case SFMT_S32:
-			size /= sizeof(int32_t);
-			if (do_endian)  audio_conv_bswap_32((int32_t *)buf, size);
-			process((int32_t *)buf, size);
-			if (do_endian)  audio_conv_bswap_32((int32_t *)buf, size);
-			break;
-		case SFMT_FLOAT:
-			size /= sizeof(float);
-			process((float *)buf, size);
-			break;
+		const size_t n = std::min(chunk, samples - i0);
+		const size_t frames = n / C;
+		float *p = buf + i0;
+
+		for (size_t i = 0; i < n; ++i) { dry[i] = p[i]; p[i] *= preamp; }
+
+		for (int k = 0; k < nb; ++k)
+		{
+			float *zk = z + 2*C*k;
+			switch (C)
+			{
+				case 1:  run_band<1>(b[k], zk, p, frames); break;
+				case 2:  run_band<2>(b[k], zk, p, frames); break;
+				default: run_band(b[k], zk, p, frames, C); break;
+			}
+		}
+
+		for (size_t i = 0; i < n; ++i) p[i] = (1.0f - mix) * p[i] + mix * dry[i];
 	}
 }
 
@@ -417,12 +406,11 @@ static int read_setup(char *desc, Equalizer *&s)
 	if (!N) return -4;
 
 	s = new Equalizer;
-	s->b.reserve(channels * N);
+	s->b.reserve(N);
 
 	for (int i = 0; i < N; ++i)
 		s->b.emplace_back(DG[i], CF[i], sample_rate, BW[i]);
-	for (int c = 1; c < channels; ++c)
-		s->b.insert(s->b.end(), s->b.begin(), s->b.begin() + N);
+	s->z.assign(2 * channels * N, 0.0f);
 
 	/*
 	preamping
@@ -2,7 +2,9 @@
 
 void equalizer_init();
 void equalizer_shutdown();
-void equalizer_process_buffer(char *buf, size_t size, const sound_params &sp);
+void equalizer_configure(const sound_params &sp);
+bool equalizer_is_ready();
+void equalizer_process_float(float *buf, size_t samples);
 void equalizer_refresh();
 bool equalizer_is_active();
 void equalizer_set_active(bool active);
@@ -9,6 +9,7 @@
 #include <math.h>
 
 #include "../audio.h"
+#include "../../ring_buf.h"
 
 #define RINGBUF_SZ 32768
 
@@ -28,6 +29,7 @@ struct jack_driver : public AudioDriver
 	int rate; /* current sample rate */
 	volatile bool our_xrun; /* flag set if xrun occurred that was our fault (the ringbuffer doesn't contain enough data in the process callback) */
 	volatile bool jack_shutdown; /* set to 1 if jack client thread exits */
+	ring_event space_ev; /* the process callback took something from the ringbuffers */
 
 	jack_driver(output_driver_caps &caps)
 	: client(NULL)
@@ -189,6 +191,28 @@ struct jack_driver : public AudioDriver
 		return size;
 	}
 
+	/* Only whole frames, and like play() leave one sample of space. */
+	int get_avail () override
+	{
+		if (jack_shutdown) return -1;
+
+		size_t space = jack_ringbuffer_write_space(ringbuffer[1]);
+		if (space <= sizeof(jack_default_audio_sample_t)) return 0;
+		return space / sizeof(jack_default_audio_sample_t) * sizeof(float) * 2;
+	}
+
+	/* The process callback runs every period, so there is no need for
+	 * the timeout. */
+	bool wait_avail (int timeout_ms) override
+	{
+		unsigned key = space_ev.prepare ();
+		if (get_avail () != 0)
+			space_ev.cancel ();
+		else
+			space_ev.wait (key);
+		return !jack_shutdown;
+	}
+
 	int read_mixer () const override
 	{
 		return volume_integer;
@@ -280,11 +304,13 @@ struct jack_driver : public AudioDriver
 			}
 		}
 
+		space_ev.notify ();
 		return 0;
 	}
 	void shutdown_cb ()
 	{
 		jack_shutdown = true;
+		space_ev.notify ();
 	}
 	int update_sample_rate_cb(jack_nframes_t new_rate)
 	{
@@ -1,51 +1,72 @@
 #include <pthread.h>
 #include "../audio.h"
-#include "../../fifo_buf.h"
+#include "../../ring_buf.h"
 #include "out_buf.h"
 
+/* The buffer itself is a lock-free SPSC ring: the player thread is the only
+ * producer and read_thread the only consumer, so audio data never goes
+ * through a mutex. The mutex and ctl_cond are only used for the rare
+ * control handshakes (stop acknowledgement, waiting for the read thread to
+ * suspend). */
 struct out_buf
 {
 public:
 	out_buf(size_t size);
 	~out_buf();
 
-	fifo_buf buf;
-	pthread_mutex_t	mutex;
+	ring_buf buf;
 	pthread_t tid;	/* Thread id of the reading thread. */
 
-	/* Signals. */
-	pthread_cond_t play_cond;	/* Something was written to the buffer. */
-	pthread_cond_t ready_cond;	/* There is some space in the buffer. */
+	/* Wakeups, these are no-ops unless the other side is waiting. */
+	ring_event play_ev;	/* Something was written or a flag changed. */
+	ring_event ready_ev;	/* There is some space in the buffer. */
+
+	pthread_mutex_t	mutex;	/* Control transitions. */
+	pthread_cond_t ctl_cond;	/* stop_ack or read_thread_waiting changed. */
+	int stop_req, stop_ack;	/* Under mutex. */
+	std::atomic<bool> cut_req;	/* out_buf_cut_mark() is waiting. */
+	bool cut_ok;	/* Its result, under mutex. */
 
 	/* Optional callback called when there is some free space in
 	 * the buffer. */
-	out_buf_free_callback *free_callback;
+	std::atomic<out_buf_free_callback*> free_callback;
 
 	/* State flags of the buffer. */
-	int pause;
-	int exit;	/* Exit when the buffer is empty. */
-	int stop;	/* Don't play anything. */
-
-	int reset_dev;	/* Request to the reading thread to reset the audio
-			   device. */
-
-	float time;	/* Time of played sound. */
-	int hardware_buf_fill;	/* How the sound card buffer is filled. */
-
-	int read_thread_waiting; /* Is the read thread waiting for data? */
+	std::atomic<bool> pause;
+	std::atomic<bool> exit;	/* Exit when the buffer is empty. */
+	std::atomic<bool> stop;	/* Don't play anything. */
+
+	std::atomic<bool> reset_dev;	/* Request to the reading thread to
+					   reset the audio device. */
+
+	std::atomic<float> time;	/* Time of played sound. */
+	std::atomic<int> hardware_buf_fill;	/* How the sound card buffer is
+						   filled. */
+
+	bool read_thread_waiting; /* Is the read thread waiting for data?
+				     Under mutex. */
+
+	/* Position in the stream (counted like ring_buf::total_put()) where
+	 * time jumps to mark_time, e.g. the start of the next file in gapless
+	 * playback. mark_pos and mark_time are written before mark is set. */
+	std::atomic<bool> mark;
+	size_t mark_pos;
+	float mark_time;
 };
 
 static void *read_thread (void *arg);
 
 out_buf::out_buf(size_t size)
 	: buf(size)
-	, exit(0), pause(0), stop(0), time(0.0)
-	, reset_dev(0), hardware_buf_fill(0), read_thread_waiting(0)
+	, stop_req(0), stop_ack(0), cut_req(false), cut_ok(false)
 	, free_callback(NULL)
+	, pause(false), exit(false), stop(false), reset_dev(false)
+	, time(0.0f), hardware_buf_fill(0)
+	, read_thread_waiting(false)
+	, mark(false), mark_pos(0), mark_time(0.0f)
 {
 	pthread_mutex_init (&mutex, NULL);
-	pthread_cond_init (&play_cond, NULL);
-	pthread_cond_init (&ready_cond, NULL);
+	pthread_cond_init (&ctl_cond, NULL);
 
 	int rc = pthread_create (&tid, NULL, read_thread, this);
 	if (rc) fatal ("Can't create buffer thread: %s", xstrerror (rc));
@@ -53,26 +74,19 @@ out_buf::out_buf(size_t size)
 
 out_buf::~out_buf()
 {
-	LOCK(mutex);
-	exit = 1;
-	pthread_cond_signal (&play_cond);
-	UNLOCK (mutex);
+	exit = true;
+	play_ev.notify ();
 
 	pthread_join(tid, NULL);
 
 	/* Let other threads using this buffer know that the state of the
 	 * buffer has changed. */
-	LOCK (mutex);
-	buf.clear();
-	pthread_cond_broadcast (&ready_cond);
-	UNLOCK (mutex);
+	ready_ev.notify ();
 
 	int rc = pthread_mutex_destroy (&mutex);
 	if (rc) log_errno ("Destroying buffer mutex failed", rc);
-	rc = pthread_cond_destroy (&play_cond);
-	if (rc) log_errno ("Destroying buffer play condition failed", rc);
-	rc = pthread_cond_destroy (&ready_cond);
-	if (rc) log_errno ("Destroying buffer ready condition failed", rc);
+	rc = pthread_cond_destroy (&ctl_cond);
+	if (rc) log_errno ("Destroying buffer control condition failed", rc);
 }
 
 /* Allocate and initialize the buf structure, size is the buffer size. */
@@ -95,6 +109,13 @@ void out_buf_free (struct out_buf *buf)
 #define AUDIO_MAX_PLAY		0.1
 #define AUDIO_MAX_PLAY_BYTES	32768
 
+/* How long to sleep at most while the device is full. The driver normally
+ * wakes us up much earlier, when a period has been played. */
+#define AUDIO_WAIT_MS		100
+
+/* Enough for one frame of any format we support. */
+#define AUDIO_MAX_BPF		256
+
 static void set_realtime_prio ()
 {
 	int rc;
@@ -109,6 +130,57 @@ static void set_realtime_prio ()
 	}
 }
 
+static bool nothing_to_play (const struct out_buf *buf)
+{
+	return (buf->buf.get_fill() == 0 || buf->pause || buf->stop)
+		&& !buf->exit;
+}
+
+/* Sleep until the producer or one of the control functions wakes us up.
+ * out_buf_wait() is told about it so it can tell that the audio device is
+ * not in use. */
+static void suspend_read_thread (struct out_buf *buf)
+{
+	unsigned key = buf->play_ev.prepare ();
+	if (!nothing_to_play (buf) || buf->reset_dev || buf->cut_req) {
+		buf->play_ev.cancel ();
+		return;
+	}
+
+	LOCK (buf->mutex);
+	buf->read_thread_waiting = true;
+	pthread_cond_broadcast (&buf->ctl_cond);
+	UNLOCK (buf->mutex);
+
+	buf->play_ev.wait (key);
+
+	LOCK (buf->mutex);
+	buf->read_thread_waiting = false;
+	UNLOCK (buf->mutex);
+}
+
+static void add_time (struct out_buf *buf, float dt)
+{
+	float t = buf->time.load ();
+	while (!buf->time.compare_exchange_weak (t, t + dt)) {}
+}
+
+/* Bytes we can play before reaching the mark, if there is one. When it is
+ * reached, set the time and drop it. */
+static size_t check_mark (struct out_buf *buf)
+{
+	if (!buf->mark.load (std::memory_order_acquire))
+		return SIZE_MAX;
+
+	size_t left = buf->mark_pos - buf->buf.total_got ();
+	if (left) return left;
+
+	logit ("Reached the mark, time is now %.1f", buf->mark_time);
+	buf->time = buf->mark_time;
+	buf->mark = false;
+	return SIZE_MAX;
+}
+
 /* Reading thread of the buffer. */
 static void *read_thread (void *arg)
 {
@@ -119,46 +191,55 @@ static void *read_thread (void *arg)
 
 	set_realtime_prio ();
 
-	LOCK (buf->mutex);
-
 	while (1) {
-		int played = 0;
-		char play_buf[AUDIO_MAX_PLAY_BYTES];
-		int play_buf_fill;
-		int play_buf_pos = 0;
-
 		if (buf->reset_dev && !audio_dev_closed) {
 			audio_reset ();
-			buf->reset_dev = 0;
+			buf->reset_dev = false;
 		}
 
-		if (buf->stop)
-			buf->buf.clear();
-
-		if (buf->free_callback) {
-			/* unlock the mutex to make calls to out_buf functions
-			 * possible in the callback */
+		if (buf->stop) {
+			buf->buf.discard ();
+			buf->mark = false;
+			LOCK (buf->mutex);
+			if (buf->stop_ack != buf->stop_req) {
+				buf->stop_ack = buf->stop_req;
+				pthread_cond_broadcast (&buf->ctl_cond);
+			}
 			UNLOCK (buf->mutex);
-			buf->free_callback ();
+		}
+
+		if (buf->cut_req) {
+			/* Only we know if the mark has been reached, and the
+			 * producer waits, so nothing moves under us. */
 			LOCK (buf->mutex);
+			buf->cut_ok = buf->mark;
+			if (buf->cut_ok) {
+				buf->buf.truncate (buf->mark_pos);
+				buf->mark = false;
+			}
+			buf->cut_req = false;
+			pthread_cond_broadcast (&buf->ctl_cond);
+			UNLOCK (buf->mutex);
 		}
 
-		pthread_cond_broadcast (&buf->ready_cond);
+		check_mark (buf);
 
-		if ((buf->buf.get_fill() == 0 || buf->pause || buf->stop)
-				&& !buf->exit) {
+		auto *free_callback = buf->free_callback.load ();
+		if (free_callback)
+			free_callback ();
+
+		buf->ready_ev.notify ();
+
+		if (nothing_to_play (buf)) {
 			if (buf->pause && !audio_dev_closed) {
 				logit ("Closing the device due to pause");
 				audio_close ();
 				audio_dev_closed = 1;
 			}
 
-			buf->read_thread_waiting = 1;
-			pthread_cond_wait (&buf->play_cond, &buf->mutex);
+			suspend_read_thread (buf);
 		}
 
-		buf->read_thread_waiting = 0;
-
 		if (audio_dev_closed && !buf->pause) {
 			logit ("Opening the device again after pause");
 			if (!audio_open(NULL)) {
@@ -190,36 +271,61 @@ static void *read_thread (void *arg)
 		}
 
 		if (!audio_dev_closed) {
-			int audio_bpf;
-			size_t play_buf_frames;
+			int audio_bpf, avail;
+			size_t max_play, to_mark, n;
+			char bounce[AUDIO_MAX_BPF];
+			char *p;
 
 			audio_bpf = audio_get_bpf();
-			play_buf_frames = MIN(audio_get_bps() * AUDIO_MAX_PLAY,
-			                      AUDIO_MAX_PLAY_BYTES) / audio_bpf;
-			play_buf_fill = buf->buf.get(play_buf, play_buf_frames * audio_bpf);
-			UNLOCK (buf->mutex);
 
-			while (play_buf_pos < play_buf_fill) {
-				played = audio_send_pcm (
-						play_buf + play_buf_pos,
-						play_buf_fill - play_buf_pos);
+			/* If the driver can tell how much fits into the
+			 * device, write only that and sleep here until it
+			 * wants more, so pause and stop are noticed after at
+			 * most one period. */
+			avail = audio_get_avail ();
+			if (avail >= 0 && avail < audio_bpf) {
+				if (audio_wait_avail (AUDIO_WAIT_MS))
+					continue;
+				avail = -1;
+			}
 
-				play_buf_pos += played;
+			max_play = MIN(audio_get_bps() * AUDIO_MAX_PLAY,
+			               AUDIO_MAX_PLAY_BYTES);
+			if (avail >= 0)
+				max_play = MIN(max_play, (size_t)avail);
+			max_play -= max_play % audio_bpf;
+			to_mark = check_mark (buf);
+			max_play = MIN(max_play, to_mark);
+
+			/* Play straight from the ring. Only a frame that
+			 * straddles the end of the ring has to be copied. */
+			p = buf->buf.read_span (&n);
+			n = MIN(n, max_play);
+			n -= n % audio_bpf;
+			if (n) {
+				audio_send_pcm (p, n);
+				buf->buf.consume (n);
+			}
+			else if (to_mark < (size_t)audio_bpf) {
+				/* not a whole frame, can't happen with the
+				 * same sound parameters on both sides */
+				n = buf->buf.get (bounce, to_mark);
 			}
+			else {
+				n = buf->buf.get (bounce, MIN(audio_bpf, AUDIO_MAX_BPF));
+				audio_send_pcm (bounce, n);
+			}
+			buf->ready_ev.notify ();
 
 			/*logit ("done sending PCM");*/
 
-			LOCK (buf->mutex);
-
 			/* Update time */
-			if (play_buf_fill && audio_get_bps())
-				buf->time += play_buf_fill / (float)audio_get_bps();
+			if (n && audio_get_bps())
+				add_time (buf, n / (float)audio_get_bps());
 			buf->hardware_buf_fill = audio_get_buf_fill();
 		}
 	}
 
-	UNLOCK (buf->mutex);
-
 	logit ("exiting");
 
 	return NULL;
@@ -235,48 +341,68 @@ int out_buf_put (struct out_buf *buf, const char *data, int size)
 	while (size) {
 		int written;
 
-		LOCK (buf->mutex);
-
 		if (buf->buf.get_space() == 0 && !buf->stop) {
 			/*logit ("buffer full, waiting for the signal");*/
-			pthread_cond_wait (&buf->ready_cond, &buf->mutex);
+			unsigned key = buf->ready_ev.prepare ();
+			if (buf->buf.get_space() == 0 && !buf->stop)
+				buf->ready_ev.wait (key);
+			else
+				buf->ready_ev.cancel ();
 			/*logit ("buffer ready");*/
 		}
 
 		if (buf->stop) {
 			logit ("the buffer is stopped, refusing to write to the buffer");
-			UNLOCK (buf->mutex);
 			return 0;
 		}
 
 		written = buf->buf.put(data + pos, size);
 
 		if (written) {
-			pthread_cond_signal (&buf->play_cond);
+			buf->play_ev.notify ();
 			size -= written;
 			pos += written;
 		}
-
-		UNLOCK (buf->mutex);
 	}
 
 	return 1;
 }
 
+/* Get the contiguous free space at the end of the buffer so the caller can
+ * write into it directly. Sets *size to its length, which may be 0 when the
+ * buffer is full. Returns NULL if the buffer is stopped. */
+char *out_buf_reserve (struct out_buf *buf, size_t *size)
+{
+	if (buf->stop) {
+		*size = 0;
+		return NULL;
+	}
+	return buf->buf.reserve (size);
+}
+
+/* Queue size bytes written into the span returned by out_buf_reserve(). */
+void out_buf_commit (struct out_buf *buf, size_t size)
+{
+	if (!size) return;
+	buf->buf.commit (size);
+	buf->play_ev.notify ();
+}
+
 void out_buf_pause (struct out_buf *buf)
 {
 	LOCK (buf->mutex);
-	buf->pause = 1;
-	buf->reset_dev = 1;
+	buf->pause = true;
+	buf->reset_dev = true;
 	UNLOCK (buf->mutex);
+	buf->play_ev.notify ();
 }
 
 void out_buf_unpause (struct out_buf *buf)
 {
 	LOCK (buf->mutex);
-	buf->pause = 0;
-	pthread_cond_signal (&buf->play_cond);
+	buf->pause = false;
 	UNLOCK (buf->mutex);
+	buf->play_ev.notify ();
 }
 
 /* Stop playing, after that buffer will refuse to play anything and ignore data
@@ -285,37 +411,45 @@ void out_buf_stop (struct out_buf *buf)
 {
 	logit ("stopping the buffer");
 	LOCK (buf->mutex);
-	buf->stop = 1;
-	buf->pause = 0;
-	buf->reset_dev = 1;
+	buf->stop = true;
+	buf->pause = false;
+	buf->reset_dev = true;
+	int req = ++buf->stop_req;
 	logit ("sending signal");
-	pthread_cond_signal (&buf->play_cond);
+	buf->play_ev.notify ();
 	logit ("waiting for signal");
-	pthread_cond_wait (&buf->ready_cond, &buf->mutex);
+	while (buf->stop_ack != req)
+		pthread_cond_wait (&buf->ctl_cond, &buf->mutex);
 	logit ("done");
 	UNLOCK (buf->mutex);
 }
 
-/* Reset the buffer state: this can by called ONLY when the buffer is stopped
- * and buf_put is not used! */
+/* Reset the buffer state: this can by called ONLY when buf_put is not used!
+ * If the buffer is stopped, it is emptied: the read thread did that when it
+ * acknowledged the stop, but a span reserved before the stop may have been
+ * committed after it. While stopped, the read thread only discards as well
+ * and nothing is put, so both set the tail to the same head. A buffer that
+ * is not stopped (player() starting after a gapless handoff) keeps playing. */
 void out_buf_reset (struct out_buf *buf)
 {
 	logit ("resetting the buffer");
 
+	if (buf->stop) {
+		buf->buf.discard ();
+		buf->mark = false;
+	}
+
 	LOCK (buf->mutex);
-	buf->buf.clear();
-	buf->stop = 0;
-	buf->pause = 0;
-	buf->reset_dev = 0;
+	buf->stop = false;
+	buf->pause = false;
+	buf->reset_dev = false;
 	buf->hardware_buf_fill = 0;
 	UNLOCK (buf->mutex);
 }
 
 void out_buf_time_set (struct out_buf *buf, const float time)
 {
-	LOCK (buf->mutex);
 	buf->time = time;
-	UNLOCK (buf->mutex);
 }
 
 /* Return the time in the audio which the user is currently hearing.
@@ -325,50 +459,27 @@ void out_buf_time_set (struct out_buf *buf, const float time)
  * its own processing. */
 int out_buf_time_get (struct out_buf *buf)
 {
-	int time;
 	int bps = audio_get_bps ();
-
-	LOCK (buf->mutex);
-	time = buf->time - (bps ? buf->hardware_buf_fill / (float)bps : 0);
-	UNLOCK (buf->mutex);
-
-	return time;
+	return buf->time - (bps ? buf->hardware_buf_fill / (float)bps : 0);
 }
 
 void out_buf_set_free_callback (struct out_buf *buf,
 		out_buf_free_callback callback)
 {
 	assert (buf != NULL);
-
-	LOCK (buf->mutex);
 	buf->free_callback = callback;
-	UNLOCK (buf->mutex);
 }
 
 int out_buf_get_free (struct out_buf *buf)
 {
-	int space;
-
 	assert (buf != NULL);
-
-	LOCK (buf->mutex);
-	space = buf->buf.get_space();
-	UNLOCK (buf->mutex);
-
-	return space;
+	return buf->buf.get_space();
 }
 
 int out_buf_get_fill (struct out_buf *buf)
 {
-	int fill;
-
 	assert (buf != NULL);
-
-	LOCK (buf->mutex);
-	fill = buf->buf.get_fill();
-	UNLOCK (buf->mutex);
-
-	return fill;
+	return buf->buf.get_fill();
 }
 
 /* Wait until the read thread will stop and wait for data to come.
@@ -383,9 +494,41 @@ void out_buf_wait (struct out_buf *buf)
 	LOCK (buf->mutex);
 	while (!buf->read_thread_waiting) {
 		debug ("waiting....");
-		pthread_cond_wait (&buf->ready_cond, &buf->mutex);
+		pthread_cond_wait (&buf->ctl_cond, &buf->mutex);
 	}
 	UNLOCK (buf->mutex);
 
 	logit ("done");
 }
+
+/* Set a mark at the current end of the buffer: when playback gets there, the
+ * time is set to time. There can be only one mark, stopping the buffer
+ * removes it. */
+void out_buf_mark (struct out_buf *buf, const float time)
+{
+	assert (!buf->mark);
+	buf->mark_pos = buf->buf.total_put ();
+	buf->mark_time = time;
+	buf->mark.store (true, std::memory_order_release);
+}
+
+/* Remove the mark and everything put after it, unless playback has already
+ * reached it. Returns 1 if it was removed. */
+int out_buf_cut_mark (struct out_buf *buf)
+{
+	LOCK (buf->mutex);
+	buf->cut_req = true;
+	buf->play_ev.notify ();
+	while (buf->cut_req)
+		pthread_cond_wait (&buf->ctl_cond, &buf->mutex);
+	int ok = buf->cut_ok;
+	UNLOCK (buf->mutex);
+
+	return ok;
+}
+
+/* Is the mark set and not yet reached? */
+int out_buf_mark_pending (struct out_buf *buf)
+{
+	return buf->mark.load (std::memory_order_acquire);
+}
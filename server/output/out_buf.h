@@ -7,6 +7,8 @@ struct out_buf;
 struct out_buf *out_buf_new (int size);
 void out_buf_free (struct out_buf *buf);
 int out_buf_put (struct out_buf *buf, const char *data, int size);
+char *out_buf_reserve (struct out_buf *buf, size_t *size);
+void out_buf_commit (struct out_buf *buf, size_t size);
 void out_buf_pause (struct out_buf *buf);
 void out_buf_unpause (struct out_buf *buf);
 void out_buf_stop (struct out_buf *buf);
@@ -18,4 +20,7 @@ void out_buf_set_free_callback (struct out_buf *buf,
 int out_buf_get_free (struct out_buf *buf);
 int out_buf_get_fill (struct out_buf *buf);
 void out_buf_wait (struct out_buf *buf);
+void out_buf_mark (struct out_buf *buf, const float time);
+int out_buf_mark_pending (struct out_buf *buf);
+int out_buf_cut_mark (struct out_buf *buf);
 
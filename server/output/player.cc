@@ -11,14 +11,18 @@
 
 #include <pthread.h>
 #include <deque>
+#include <atomic>
 
 #include "../input/decoder.h"
 #include "../audio.h"
 #include "../server.h"
 #include "player.h"
+#include "../../buf_pool.h"
 
 #define PCM_BUF_SIZE		(36 * 1024)
 #define PREBUFFER_THRESHOLD	(18 * 1024)
+#define DIRECT_MIN		(32 * 1024) /* see Codec::decode */
+#define PREBUFFER_MAX_WAIT	2 /* seconds, see prebuffer_target() */
 
 enum Request
 {
@@ -81,12 +85,16 @@ static BitrateList bitrate_list;
 //-----------------------------------------------------------------------------
 // DecoderState
 //-----------------------------------------------------------------------------
+// One file being decoded. Sound that didn't fit into the output buffer yet
+// waits in buf, which is a list of segments so that a change of the sound
+// parameters is kept in band instead of mixing the two.
+//-----------------------------------------------------------------------------
 
 struct DecoderState
 {
-	DecoderState(const str &path)
-	: buf(PCM_BUF_SIZE), buf_fill(0), path(path), time(0.0)
-	, sp{ -1, -1, -1 }, sound_params_changed(false), tags_changed(false)
+	DecoderState(const str &path, size_t buf_size = PCM_BUF_SIZE)
+	: buf(buf_size), buf_pos(0), buf_fill(0), path(path), time(0.0)
+	, sp{ -1, -1, -1 }, psp{ -1, -1, -1 }, tags_changed(false)
 	, stream(NULL), codec(NULL), done(true)
 	{
 		if (is_url(path))
@@ -130,9 +138,26 @@ struct DecoderState
 		if (stream) io_close(stream);
 	}
 
-	bool decode() // returns false if buffer was already full
+	size_t pending() const { return buf_fill - buf_pos; }
+
+	// Is the next sound in buf in other parameters than what we've sent
+	// to the output so far? Then the output has to be reopened first.
+	bool sound_params_changed() const
+	{
+		return !segs.empty() && segs.front().sp != psp;
+	}
+
+	bool decode() // returns false if buf was already full
 	{
 		const size_t N = buf.size();
+
+		// codecs want some room, so move the pending sound to the front
+		if (buf_pos && N - buf_fill < DIRECT_MIN)
+		{
+			memmove(buf.data(), buf.data() + buf_pos, pending());
+			buf_fill -= buf_pos;
+			buf_pos = 0;
+		}
 		if (done || buf_fill >= N) return false;
 		
 		// decode next chunk
@@ -140,8 +165,52 @@ struct DecoderState
 		int n = codec->decode(buf.data() + buf_fill, N - buf_fill, sp);
 		buf_fill += n; assert(buf_fill <= N);
 		
+		if (n)
+		{
+			if (segs.empty() || segs.back().sp != sp)
+				segs.push_back({sp, 0});
+			segs.back().bytes += n;
+		}
+
+		decoded(n, sp0);
+		return true;
+	}
+
+	// Decode straight into the output buffer, skipping buf and flush().
+	// Only possible while buf is empty, the output is open with our sound
+	// parameters and no conversion is needed. Returns false if nothing was
+	// done and the caller should use decode() instead.
+	bool decode_direct()
+	{
+		if (done || pending() || sp != psp || sp.channels == -1) return false;
+
+		size_t N;
+		char *dst = audio_reserve_buf(&N);
+		if (!dst || N < DIRECT_MIN) return false;
+
+		const size_t bpf = sfmt_Bps(sp.fmt) * sp.channels;
+		N = std::min(N, buf.size());
+		N -= N % bpf;
+
+		sound_params sp0 = sp;
+		int n = codec->decode(dst, N, sp);
+		if (sp != sp0)
+		{
+			// this is not what the output expects, keep it for later
+			memcpy(buf.data(), dst, n);
+			buf_pos = 0; buf_fill = n;
+			if (n) segs.push_back({sp, (size_t)n});
+		}
+		else
+			audio_commit_buf(n);
+
+		decoded(n, sp0);
+		return true;
+	}
+
+	void decoded(int n, const sound_params &sp0)
+	{
 		// update bitrate and such
-		if (sp != sp0) sound_params_changed = true;
 		bitrate.add(time, codec->get_bitrate());
 		time += n / (double)(sfmt_Bps(sp.fmt) * sp.rate * sp.channels);
 		
@@ -151,120 +220,307 @@ struct DecoderState
 		// check if we're done
 		if (!n || codec->error.type == ERROR_FATAL) done = true;
 		//if (!done && codec->current_tags(tags)) if (sp0.channels != -1) tags_changed = true;
-
-		return true;
 	}
 	
-	void flush()
+	// Send the sound that is in the current output parameters (psp) to
+	// the output, as much as fits in max bytes of the output buffer.
+	void flush(size_t max = SIZE_MAX)
 	{
-		audio_send_buf(buf.data(), buf_fill);
-		buf_fill = 0;
+		// max is in the driver's format: turn it into whole frames of
+		// ours, audio_conv() can't take part of a frame
+		if (psp.channels <= 0) return;
+		const size_t bpf = sfmt_Bps(psp.fmt) * psp.channels;
+		const int out_bps = audio_get_bps();
+		if (max != SIZE_MAX && out_bps > 0)
+			max = (uint64_t)max * (bpf * psp.rate) / out_bps;
+		max -= max % bpf;
+
+		while (max && !segs.empty() && segs.front().sp == psp)
+		{
+			auto &s = segs.front();
+			size_t n = std::min(max, s.bytes);
+			audio_send_buf(buf.data() + buf_pos, n);
+			buf_pos += n; max -= n; s.bytes -= n;
+			if (!s.bytes) segs.pop_front();
+		}
+		if (buf_pos == buf_fill) buf_pos = buf_fill = 0;
 	}
 
+	void clear()
+	{
+		buf_pos = buf_fill = 0;
+		segs.clear();
+	}
 
 	Codec *codec;
 	io_stream *stream;
 	str path; // what is this decoding?
 
-	std::vector<char> buf;
-	size_t buf_fill;
+	struct Segment { sound_params sp; size_t bytes; };
+	pool_buf buf;
+	size_t buf_pos, buf_fill; // pending sound is buf[buf_pos, buf_fill)
+	std::deque<Segment> segs; // and this is what it is
 	
 	double time; // at the end of buf (used to update bitrate)
-	sound_params sp; // from last decode call
+	sound_params sp;  // from last decode call
+	sound_params psp; // of what was sent to the output
 	BitrateList bitrate;
 	file_tags tags;
 	bool tags_changed;
-	bool sound_params_changed;
 
 	bool done;
 };
 
 //-----------------------------------------------------------------------------
-// Precache
+// Decode-ahead
+//-----------------------------------------------------------------------------
+// The next PrecacheTracks files of the playlist are opened and decoded into
+// memory by a few worker threads while the current one plays, so that slow
+// opens (network filesystems, HTTP) and cold caches don't delay the track
+// change. Each one gets a budget of PrecacheBuffer KB and stops decoding when
+// that is full; the player continues where it stopped.
+// Files that are skipped are cancelled instead of waited for: a queued one
+// is just removed and a running one is thrown away by its worker when it's
+// done, so changing tracks never blocks on somebody else's slow open.
 //-----------------------------------------------------------------------------
 
-static void *precache_thread (void *data); // below
+#define PRECACHE_WORKERS	2
 
 struct Precache
 {
-	Precache() : decoder(NULL), running(false), tid(0) {}
-	~Precache() { assert(!running); delete decoder; }
+	Precache(const str &p) : decoder(NULL), state(QUEUED), ready(false), cancelled(false), path(p) {}
+	~Precache() { delete decoder; }
+
+	enum State { QUEUED, RUNNING, DONE };
 
-	DecoderState *decoder;
-	bool running; /* if the precache thread is running */
-	pthread_t tid; /* tid of the precache thread */
+	DecoderState *decoder; /* the result, set before ready */
+	State state; /* under PrecachePool::mtx */
+	std::atomic<bool> ready; /* the worker is done with it */
+	std::atomic<bool> cancelled; /* nobody wants the result */
 	str path;
+};
+
+static void *precache_worker (void *unused); // below
 
-	bool start(const str &p)
+struct PrecachePool
+{
+	PrecachePool() : stop(false)
 	{
-		if (running) finish();
-		path = p;
-		logit ("Precaching %s", path.c_str());
-		int rc = pthread_create (&tid, NULL, precache_thread, NULL);
-		if (rc != 0)
-			log_errno ("Could not run precache thread", rc);
-		else
-			running = true;
-		return running;
+		pthread_mutex_init (&mtx, NULL);
+		pthread_cond_init (&job_cond, NULL);
+		pthread_cond_init (&done_cond, NULL);
+	}
+
+	pthread_mutex_t mtx; /* for everything below */
+	pthread_cond_t job_cond; /* jobs was added to or stop was set */
+	pthread_cond_t done_cond; /* a job is done */
+	std::deque<std::shared_ptr<Precache>> jobs; // queued, in playing order
+	std::vector<pthread_t> workers;
+	bool stop;
+
+	bool add(const std::shared_ptr<Precache> &p)
+	{
+		LockGuard g(mtx);
+		while (workers.size() < PRECACHE_WORKERS)
+		{
+			pthread_t tid;
+			int rc = pthread_create (&tid, NULL, precache_worker, NULL);
+			if (rc != 0)
+			{
+				log_errno ("Could not run precache thread", rc);
+				if (workers.empty()) return false;
+				break;
+			}
+			workers.push_back(tid);
+		}
+
+		logit ("Precaching %s", p->path.c_str());
+		jobs.push_back(p);
+		pthread_cond_signal (&job_cond);
+		return true;
+	}
+
+	// Nobody is going to use p: don't start it, or drop it when it's done.
+	void cancel(const std::shared_ptr<Precache> &p)
+	{
+		LockGuard g(mtx);
+		p->cancelled = true;
+		if (p->state != Precache::QUEUED) return;
+		jobs.erase(std::find(jobs.begin(), jobs.end(), p));
+		p->state = Precache::DONE;
+	}
+
+	// Take the result of p. NULL if it wasn't started yet, then it is
+	// not started at all and the caller had better open the file itself.
+	DecoderState *take(const std::shared_ptr<Precache> &p)
+	{
+		LockGuard g(mtx);
+		if (p->state == Precache::QUEUED)
+		{
+			jobs.erase(std::find(jobs.begin(), jobs.end(), p));
+			p->state = Precache::DONE;
+		}
+		while (p->state != Precache::DONE)
+			pthread_cond_wait (&done_cond, &mtx);
+
+		DecoderState *d = p->decoder; p->decoder = NULL;
+		return d;
+	}
+
+	// Called at exit only: a worker in a slow open is waited for.
+	void shutdown()
+	{
+		LOCK (mtx);
+		stop = true;
+		jobs.clear();
+		pthread_cond_broadcast (&job_cond);
+		UNLOCK (mtx);
+
+		for (auto tid : workers)
+		{
+			int rc = pthread_join (tid, NULL);
+			if (rc != 0) log_errno ("pthread_join() for precache thread failed", rc);
+		}
+		workers.clear();
+	}
+};
+static PrecachePool precache_pool;
+
+struct DecodeAhead
+{
+	DecodeAhead() : gapless(false) {}
+
+	std::deque<std::shared_ptr<Precache>> q; // in playing order
+	bool gapless; /* the front decoder was handed off, its sound is already
+	                 in the output buffer, right after the previous file's */
+
+	// Make the queue follow files (the next ones on the playlist), starting
+	// the missing ones. Entries for anything else are dropped.
+	void update(const std::vector<str> &files)
+	{
+		const size_t N = std::min(files.size(), (size_t)options::PrecacheTracks);
+		size_t i = 0;
+		for (; i < N && i < q.size(); ++i)
+			if (q[i]->path != files[i]) break;
+		while (q.size() > i) pop_back();
+
+		for (; i < N; ++i)
+		{
+			const file_type t = plist_item::ftype(files[i]);
+			if (t != F_SOUND && t != F_URL) break;
+			auto p = std::make_shared<Precache>(files[i]);
+			if (!precache_pool.add(p)) break;
+			q.push_back(p);
+		}
+	}
+
+	// Take the decoder for file out of the queue. Whatever comes before it
+	// was skipped and is dropped.
+	DecoderState *take(const str &file)
+	{
+		while (!q.empty() && q.front()->path != file)
+		{
+			logit ("Dropping precached %s", q.front()->path.c_str());
+			precache_pool.cancel(q.front());
+			q.pop_front();
+		}
+		if (q.empty()) return NULL;
+
+		DecoderState *d = precache_pool.take(q.front());
+		q.pop_front();
+		return d;
+	}
+
+	// The decoder for file if it is at the front and done precaching
+	// (still owned by the queue).
+	DecoderState *front(const str &file)
+	{
+		if (q.empty() || q.front()->path != file || !q.front()->ready) return NULL;
+		return q.front()->decoder;
 	}
-	void finish()
+
+	void pop_back()
 	{
-		if (!running) return;
-		debug ("Waiting for precache thread...");
-		int rc = pthread_join(tid, NULL);
-		if (rc != 0) fatal("pthread_join() for precache thread failed: %s", xstrerror(rc));
-		running = false;
-		debug ("done");
+		precache_pool.cancel(q.back());
+		q.pop_back();
 	}
+
 	void drop()
 	{
-		finish();
-		delete decoder;
-		decoder = NULL;
+		while (!q.empty()) pop_back();
+		gapless = false;
 	}
 };
-static Precache precache;
+static DecodeAhead ahead;
 
-static void *precache_thread (void *)
+static DecoderState *precache (const Precache &p)
 {
-	delete precache.decoder;
-	precache.decoder = new DecoderState(precache.path);
-	if (precache.decoder->done)
+	auto *d = new DecoderState(p.path, std::max(options::PrecacheBuffer * 1024, PCM_BUF_SIZE));
+	if (d->done || p.cancelled)
+	{
+		delete d;
+		return NULL;
+	}
+
+	// A live stream would only get behind, but opening it has warmed up
+	// the connection for when it's played.
+	if (d->stream && io_file_size(d->stream) < 0)
 	{
-		delete precache.decoder;
-		precache.decoder = NULL;
+		logit ("Not precaching the live stream %s", p.path.c_str());
+		delete d;
 		return NULL;
 	}
-	auto &decoder = *precache.decoder;
-	assert(decoder.sp.channels == -1);
 
-	while (!decoder.done)
+	// parameter changes are recorded in d->segs, so we just decode
+	// until the budget is used up
+	while (!p.cancelled && d->decode()) {}
+
+	if (p.cancelled)
 	{
-		bool first = (decoder.sp.channels == -1);
-		bool ok = decoder.decode();
-		if (!ok) break;
+		delete d;
+		return NULL;
+	}
+	logit ("Precached %zu bytes from %s", d->pending(), p.path.c_str());
+	return d;
+}
 
-		// if sound_params change, we have no place to put that
-		// information, so cancel (this thing can't be precached)
-		if (decoder.sound_params_changed || decoder.tags_changed)
+static void *precache_worker (void *unused)
+{
+	auto &pool = precache_pool;
+
+	LOCK (pool.mtx);
+	while (!pool.stop)
+	{
+		if (pool.jobs.empty())
 		{
-			if (first)
-			{
-				decoder.sound_params_changed = false;
-				decoder.tags_changed = false;
-			}
-			else
-			{
-				logit("Cannot precache");
-				// we can pre-open the thing again though...
-				delete precache.decoder;
-				precache.decoder = new DecoderState(precache.path);
-				break;
-			}
+			pthread_cond_wait (&pool.job_cond, &pool.mtx);
+			continue;
+		}
+		auto p = pool.jobs.front();
+		pool.jobs.pop_front();
+		p->state = Precache::RUNNING;
+		UNLOCK (pool.mtx);
+
+		DecoderState *d = precache(*p);
+
+		LOCK (pool.mtx);
+		const bool keep = !p->cancelled;
+		if (keep) p->decoder = d;
+		p->state = Precache::DONE;
+		p->ready = true;
+		pthread_cond_broadcast (&pool.done_cond);
+
+		if (!keep && d)
+		{
+			// closing a stream may take a while
+			UNLOCK (pool.mtx);
+			logit ("Dropping precached %s", p->path.c_str());
+			delete d;
+			LOCK (pool.mtx);
 		}
 	}
+	UNLOCK (pool.mtx);
 
-	logit ("Precached %d bytes from %s", decoder.buf_fill, precache.path.c_str());
 	return NULL;
 }
 
@@ -279,6 +535,41 @@ void player_init ()
 {
 }
 
+/* How much of the stream of d to buffer before decoding on when the output
+ * buffer runs low. Prebuffering, or with AdaptivePrebuffering:
+ *  - twice the longest wait for data seen lately, one such wait more for
+ *    every underrun, in seconds of sound;
+ *  - everything allowed when a file is hardly faster than the sound. Not
+ *    for a live stream: it never comes faster than the sound, so buffering
+ *    more only costs as much silence as it gains.
+ * The player waits for the target while the sound runs out, so it is never
+ * more than the source can add at its measured rate in PREBUFFER_MAX_WAIT
+ * seconds. The input buffer is grown to keep twice the target. */
+static size_t prebuffer_target (DecoderState *d, io_stream *stream,
+		const io_stats &st)
+{
+	const size_t min = options::Prebuffering * 1024;
+	const int max_secs = options::AdaptivePrebuffering;
+	if (!max_secs) return min;
+
+	int kbps = d->codec->get_avg_bitrate();
+	if (kbps <= 0) kbps = d->codec->get_bitrate();
+	if (kbps <= 0) return min;
+
+	if (!st.size) return min; // not buffered
+
+	const double bps = kbps * 125.0; // bytes of the file per second of sound
+	const bool live = io_file_size(stream) < 0;
+	double secs = 2.0 * st.stall / 1000.0 * (1 + st.underruns);
+	if (!live && st.rate > 0 && st.rate < 1.25 * bps) secs = max_secs;
+
+	size_t target = (size_t)(bps * std::min(secs, (double)max_secs));
+	target = std::min(target, st.fill + (size_t)(st.rate * PREBUFFER_MAX_WAIT));
+	target = std::max(min, target);
+	if (2 * target > st.size) io_grow_buffer (stream, 2 * target);
+	return target;
+}
+
 /* Called when some free space in the output buffer appears. */
 static void buf_free_cb ()
 {
@@ -295,79 +586,160 @@ static void buf_free_cb ()
 	}
 }
 
-/* Open a file, decode it and put output into the buffer. At the end, start
- * precaching next_file. */
-void player (const char *file, const char *next_file, struct out_buf *out_buf)
+/* The current file is completely in the output buffer. If next_file is
+ * precached with the same sound parameters, put its sound right behind it
+ * and keep decoding it until playback reaches the boundary, where the mark
+ * resets the time. Returns true if that worked, then the decoder stays at
+ * the front of the decode-ahead queue for the next player() call. */
+static bool gapless_handoff (const str &next_file, struct out_buf *out_buf)
 {
-	out_buf_reset (out_buf);
+	if (!options::Gapless || !options::AutoNext || next_file.empty()) return false;
 
-	DecoderState *d = NULL;
-	precache.finish();
-	if (precache.decoder)
+	DecoderState *d = ahead.front(next_file);
+	if (!d || !d->pending() || d->segs.front().sp != decoder->psp
+	|| request != REQ_NOTHING)
+		return false;
+
+	logit ("Gapless handoff to %s", next_file.c_str());
+	d->psp = decoder->psp;
+	out_buf_mark (out_buf, 0.0);
+
+	while (true)
 	{
-		if (precache.decoder->path == file)
+		if (!d->done)
 		{
-			logit ("Using precached file");
-			d = precache.decoder;
-			precache.decoder = NULL;
+			if (!d->decode_direct())
+				d->decode();
 
-			auto &sp = d->sp;
-			set_info_channels (sp.channels);
-			set_info_rate (sp.rate / 1000);
-			if (!audio_open(&sp))
-			{
-				delete d;
-				return;
-			}
+			decoder_error &err = d->codec->error;
+			if (err) error ("%s", err.desc.c_str());
+		}
+
+		d->flush(out_buf_get_free(out_buf));
 
-			d->flush();
-			set_info_avg_bitrate (d->codec ? d->codec->get_avg_bitrate() : -1);
+		LOCK (request_cond_mtx);
+		bool pending = out_buf_mark_pending (out_buf);
+		bool idle = d->pending() || d->done;
+		if (pending && idle && request == REQ_NOTHING)
+			pthread_cond_wait (&request_cond, &request_cond_mtx);
+		UNLOCK (request_cond_mtx);
+
+		// Whatever the request is, it's about the file the user still
+		// hears, so take back only what was queued of the next one and
+		// let player() handle it. Stopping the buffer would throw away
+		// the end of the current file too. If the boundary has been
+		// played already, the next file is what is heard and the
+		// request is for the next player() call.
+		if (request != REQ_NOTHING && out_buf_cut_mark(out_buf))
+		{
+			logit ("Request during gapless handoff, dropping %s", next_file.c_str());
+			ahead.drop();
+			return false;
 		}
-		else
+		if (!pending || request != REQ_NOTHING) break;
+	}
+
+	ahead.gapless = true;
+	return true;
+}
+
+/* The file player() handed off to is not going to be played after all:
+ * drop its sound from the output buffer. */
+void player_drop_handoff (struct out_buf *out_buf)
+{
+	if (!ahead.gapless) return;
+	logit ("Dropping the gapless handoff");
+	out_buf_stop (out_buf);
+	out_buf_reset (out_buf);
+	out_buf_time_set (out_buf, 0.0);
+	ahead.drop();
+}
+
+/* Open a file, decode it and put output into the buffer. Meanwhile, decode
+ * ahead the files in next (which come after it on the playlist). Returns
+ * true if next[0] has been handed off to for gapless playback: its start is
+ * already queued and the buffer is not drained. */
+bool player (const str &file, const std::vector<str> &next, struct out_buf *out_buf)
+{
+	out_buf_reset (out_buf);
+
+	if (ahead.gapless && !ahead.front(file))
+		player_drop_handoff (out_buf);
+
+	bool gapless = ahead.gapless;
+	ahead.gapless = false;
+	DecoderState *d = ahead.take(file);
+	if (d)
+	{
+		logit ("Using precached file");
+
+		if (!gapless && d->pending())
 		{
-			logit ("The precached file is not the file we want.");
-			precache.drop();
+			d->psp = d->segs.front().sp;
+			if (!audio_open(&d->psp))
+			{
+				delete d;
+				return false;
+			}
+			d->flush(out_buf_get_free(out_buf));
 		}
+		// else the device is open and playing our sound already
+
+		set_info_channels (d->psp.channels);
+		set_info_rate (d->psp.rate / 1000);
+		set_info_avg_bitrate (d->codec ? d->codec->get_avg_bitrate() : -1);
 	}
 	
 	if (!d) d = new DecoderState(file);
-	if (d->done && !d->buf_fill) return;
+	if (d->done && !d->pending()) { delete d; return false; }
 
 	delete decoder; decoder = d;
-	if (is_url(file)) next_file = NULL;
+	// a live stream doesn't end, so there is nothing to decode ahead for
+	const std::vector<str> none;
+	const std::vector<str> &next_files = decoder->stream
+		&& io_file_size(decoder->stream) < 0 ? none : next;
 	
 	audio_state_started_playing ();
-	assert(decoder); if (!decoder) return;
+	assert(decoder); if (!decoder) return false;
 
-	bool stopped = false;
+	bool stopped = false, handed_off = false;
 
 	out_buf_set_free_callback (out_buf, buf_free_cb);
 
 	LOCK (decoder_stream_mtx);
 	io_stream *decoder_stream = decoder->codec ? decoder->codec->get_stream() : NULL;
 	UNLOCK (decoder_stream_mtx);
+	if (!decoder_stream) set_info_buffer (-1, 0);
 
 	while (true)
 	{
 		if (!decoder->done)
 		{
-			if (decoder_stream && out_buf_get_fill(out_buf) < PREBUFFER_THRESHOLD)
-				io_prebuffer(decoder_stream, options::Prebuffering * 1024);
+			if (decoder_stream)
+			{
+				io_stats st; io_get_stats(decoder_stream, &st);
+				size_t target = prebuffer_target(decoder, decoder_stream, st);
+				set_info_buffer (st.size ? (int)(target / 1024) : -1, st.underruns);
+
+				if (out_buf_get_fill(out_buf) < PREBUFFER_THRESHOLD)
+					io_prebuffer(decoder_stream, target);
+			}
 
-			decoder->decode();
+			if (!decoder->decode_direct())
+				decoder->decode();
 
 			decoder_error &err = decoder->codec->error;
 			if (err) error ("%s", err.desc.c_str());
 		}
 
 		/* Wait, if there is no space in the buffer to put the decoded
-		 * data or EOF occurred and there is something in the buffer. */
-		if (decoder->buf_fill > out_buf_get_free(out_buf)
-		|| (decoder->done && out_buf_get_fill(out_buf)))
+		 * data, we have to wait for it to drain before reopening the
+		 * device, or EOF occurred and there is something in the buffer. */
+		const size_t pending = decoder->pending();
+		if ((pending && out_buf_get_free(out_buf) < std::min(pending, (size_t)PCM_BUF_SIZE))
+		|| ((decoder->done || decoder->sound_params_changed()) && out_buf_get_fill(out_buf)))
 		{
-			if (next_file && !precache.running && !precache.decoder && 
-			plist_item::ftype(next_file) == F_SOUND && options::AutoNext)
-				precache.start(next_file);
+			if (options::AutoNext) ahead.update(next_files);
 			
 			LOCK (request_cond_mtx);
 			pthread_cond_wait (&request_cond, &request_cond_mtx);
@@ -406,6 +778,7 @@ void player (const char *file, const char *next_file, struct out_buf *out_buf)
 						}
 						else logit ("true error when seeking");
 					}
+					else decoder->done = false; // it may have hit the end before
 
 					if (pos != -1) {
 						out_buf_stop (out_buf);
@@ -413,7 +786,7 @@ void player (const char *file, const char *next_file, struct out_buf *out_buf)
 						out_buf_time_set (out_buf, pos);
 						decoder->bitrate.clear();
 						decoder->time = pos;
-						decoder->buf_fill = 0;
+						decoder->clear();
 					}
 					break;
 				}
@@ -423,23 +796,29 @@ void player (const char *file, const char *next_file, struct out_buf *out_buf)
 		}
 		if (stopped) break;
 
-		if (decoder->buf_fill <= out_buf_get_free(out_buf) && !decoder->sound_params_changed)
-		{
-			decoder->flush();
-		}
+		decoder->flush(out_buf_get_free(out_buf));
 		
-		if (decoder->sound_params_changed && out_buf_get_fill(out_buf) == 0)
+		if (decoder->sound_params_changed() && out_buf_get_fill(out_buf) == 0)
 		{
-			decoder->sound_params_changed = false;
-			auto &sp = decoder->sp;
+			auto &sp = decoder->psp;
+			sp = decoder->segs.front().sp;
 			logit ("Sound parameters have changed.");
 			set_info_channels (sp.channels);
 			set_info_rate (sp.rate / 1000);
 			out_buf_wait (out_buf);
 			if (!audio_open(&sp)) break;
+			decoder->flush(out_buf_get_free(out_buf));
 		}
 		
-		if (decoder->done && out_buf_get_fill(out_buf) == 0)
+		if (decoder->done && !decoder->pending()
+		&& !next_files.empty() && gapless_handoff(next_files[0], out_buf))
+		{
+			handed_off = true;
+			break;
+		}
+
+		if (decoder->done && !decoder->pending() && out_buf_get_fill(out_buf) == 0
+		&& request == REQ_NOTHING)
 		{
 			logit ("played everything");
 			break;
@@ -450,9 +829,10 @@ void player (const char *file, const char *next_file, struct out_buf *out_buf)
 	delete decoder; decoder = NULL;
 	UNLOCK (decoder_stream_mtx);
 
-	out_buf_wait (out_buf);
+	if (!handed_off) out_buf_wait (out_buf);
 
 	logit ("exiting");
+	return handed_off;
 }
 
 void player_cleanup ()
@@ -466,7 +846,8 @@ void player_cleanup ()
 	rc = pthread_cond_destroy (&request_cond);
 	if (rc != 0) log_errno ("Can't destroy request condition", rc);
 
-	precache.drop();
+	ahead.drop();
+	precache_pool.shutdown();
 	delete decoder; decoder = NULL;
 }
 
@@ -4,7 +4,8 @@
 #include "../input/io.h"
 
 void player_cleanup ();
-void player (const char *file, const char *next_file, struct out_buf *out_buf);
+bool player (const str &file, const std::vector<str> &next, struct out_buf *out_buf);
+void player_drop_handoff (struct out_buf *out_buf);
 void player_stop ();
 void player_seek (const int n);
 void player_jump_to (const int n);
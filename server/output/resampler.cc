@@ -0,0 +1,262 @@
+#include <math.h>
+#include <samplerate.h>
+
+#include "resampler.h"
+
+/* Frames of input the libsamplerate backend can carry over to the next call.
+ * It normally uses up all input when given max_output() frames of room, so
+ * this only has to cover the few frames it holds back. */
+#define CARRY_FRAMES	4096
+
+//----------------------------------------------------------------------------
+// libsamplerate
+//----------------------------------------------------------------------------
+
+class SRCResampler : public Resampler
+{
+public:
+	SRCResampler(SRC_STATE *src, int from, int to, int channels)
+		: Resampler(from, to, channels), src(src)
+		, carry(CARRY_FRAMES * channels), ncarry(0) {}
+	~SRCResampler() { src_delete(src); }
+
+	long process(const float *in, size_t frames, float *out, size_t out_frames) override;
+
+private:
+	size_t carry_frames() const override { return ncarry; }
+	long run(const float *&in, size_t &frames, float *&out, size_t &out_frames);
+
+	SRC_STATE *src;
+	std::vector<float> carry;
+	size_t ncarry; // frames in carry
+};
+
+/* Feed frames from in to libsamplerate until it is used up or out is full,
+ * advancing all four arguments. Returns the frames put out or -1. */
+long SRCResampler::run(const float *&in, size_t &frames, float *&out, size_t &out_frames)
+{
+	SRC_DATA d;
+	long n = 0;
+
+	d.end_of_input = 0;
+	d.src_ratio = ratio;
+
+	while (frames && out_frames)
+	{
+		d.data_in = in;
+		d.input_frames = frames;
+		d.data_out = out;
+		d.output_frames = out_frames;
+
+		int err = src_process(src, &d);
+		if (err) {
+			error ("Can't resample: %s", src_strerror (err));
+			return -1;
+		}
+
+		in += d.input_frames_used * C;
+		frames -= d.input_frames_used;
+		out += d.output_frames_gen * C;
+		out_frames -= d.output_frames_gen;
+		n += d.output_frames_gen;
+
+		if (!d.output_frames_gen && !d.input_frames_used) break;
+	}
+
+	return n;
+}
+
+long SRCResampler::process(const float *in, size_t frames, float *out, size_t out_frames)
+{
+	long n = 0;
+
+	if (ncarry) {
+		const float *c = carry.data();
+		size_t left = ncarry;
+		long k = run(c, left, out, out_frames);
+		if (k < 0) return -1;
+		n += k;
+		if (left) memmove(carry.data(), c, left * C * sizeof(float));
+		ncarry = left;
+	}
+
+	if (!ncarry) {
+		long k = run(in, frames, out, out_frames);
+		if (k < 0) return -1;
+		n += k;
+	}
+
+	if (frames) {
+		size_t k = std::min(frames, CARRY_FRAMES - ncarry);
+		if (k < frames) debug ("Resampler carry full, dropping %zu frames", frames - k);
+		memcpy(carry.data() + ncarry * C, in, k * C * sizeof(float));
+		ncarry += k;
+	}
+
+	return n;
+}
+
+//----------------------------------------------------------------------------
+// built-in resamplers
+//----------------------------------------------------------------------------
+
+/* Both step through the input with an exact integer phase: pos is the
+ * position of the next output frame after the previous input frame, in
+ * units of 1/to input frames. Every output adds from to it and every input
+ * frame subtracts to, so there is no drift however long the stream. */
+
+class LinearResampler : public Resampler
+{
+public:
+	LinearResampler(int from, int to, int channels)
+		: Resampler(from, to, channels), prev(channels), pos(0), primed(false) {}
+
+	long process(const float *in, size_t frames, float *out, size_t out_frames) override
+	{
+		float *o = out;
+		const float scale = 1.0f / to;
+
+		for (size_t i = 0; i < frames; ++i, in += C)
+		{
+			if (!primed) {
+				std::copy(in, in + C, prev.begin());
+				primed = true;
+			}
+
+			for (; pos < to; pos += from, o += C)
+			{
+				assert(o < out + out_frames * C);
+				const float t = pos * scale;
+				for (int c = 0; c < C; ++c)
+					o[c] = prev[c] + (in[c] - prev[c]) * t;
+			}
+			pos -= to;
+			std::copy(in, in + C, prev.begin());
+		}
+
+		return (o - out) / C;
+	}
+
+private:
+	std::vector<float> prev; // last input frame
+	long pos;
+	bool primed;
+};
+
+/* Band-limited interpolation with a windowed sinc of 2*Z taps. The filter is
+ * precomputed for PHASES fractional positions and interpolated linearly
+ * between them. The last 2*Z input frames are kept in a ring that is stored
+ * twice, so the taps always see them as one contiguous block. */
+
+#define PHASES	256
+#define MAX_Z	32
+
+class PolyphaseResampler : public Resampler
+{
+public:
+	PolyphaseResampler(int from, int to, int channels, int Z, double cutoff)
+		: Resampler(from, to, channels), N(2*Z)
+		, table((PHASES + 1) * N), hist(2 * N * channels, 0.0f)
+		, head(0), pos(0)
+	{
+		assert(Z <= MAX_Z);
+
+		// lowpass at the lower of the two Nyquist frequencies
+		const double fc = cutoff * std::min(1.0, ratio);
+
+		for (int p = 0; p <= PHASES; ++p)
+		{
+			float *h = &table[p * N];
+			double sum = 0.0;
+			for (int k = 0; k < N; ++k)
+			{
+				// distance of tap k from the output position
+				double d = (Z - 1) + p / (double)PHASES - k;
+				double x = M_PI * fc * d;
+				double s = fabs(x) < 1e-9 ? 1.0 : sin(x) / x;
+				double w = (d + Z) / (2.0 * Z); // Blackman-Harris
+				w = 0.35875 - 0.48829 * cos(2*M_PI*w) + 0.14128 * cos(4*M_PI*w)
+					- 0.01168 * cos(6*M_PI*w);
+				h[k] = s * w;
+				sum += h[k];
+			}
+			for (int k = 0; k < N; ++k) h[k] /= sum; // unity gain at DC
+		}
+	}
+
+	long process(const float *in, size_t frames, float *out, size_t out_frames) override
+	{
+		float *o = out;
+		float coef[2 * MAX_Z];
+
+		for (size_t i = 0; i < frames; ++i, in += C)
+		{
+			std::copy(in, in + C, &hist[head * C]);
+			std::copy(in, in + C, &hist[(head + N) * C]);
+			const float *win = &hist[(head + 1) * C]; // oldest frame first
+			if (++head == N) head = 0;
+
+			for (; pos < to; pos += from, o += C)
+			{
+				assert(o < out + out_frames * C);
+
+				long p = pos * PHASES;
+				const float *h0 = &table[(p / to) * N], *h1 = h0 + N;
+				const float t = (p % to) / (float)to;
+				for (int k = 0; k < N; ++k) coef[k] = h0[k] + (h1[k] - h0[k]) * t;
+
+				for (int c = 0; c < C; ++c)
+				{
+					float acc = 0.0f;
+					for (int k = 0; k < N; ++k) acc += coef[k] * win[k * C + c];
+					o[c] = acc;
+				}
+			}
+			pos -= to;
+		}
+
+		return (o - out) / C;
+	}
+
+private:
+	const int N;               // taps
+	std::vector<float> table;  // (PHASES+1) x N coefficients
+	std::vector<float> hist;   // 2N frames, each one stored at i and i+N
+	int  head;                 // where the next frame goes
+	long pos;
+};
+
+//----------------------------------------------------------------------------
+
+Resampler *Resampler::create(int from, int to, int channels)
+{
+	using options::ResampleMethod_t;
+	int type;
+
+	switch (options::ResampleMethod)
+	{
+		case ResampleMethod_t::FastLinear:
+			return new LinearResampler(from, to, channels);
+		case ResampleMethod_t::PolyphaseFast:
+			return new PolyphaseResampler(from, to, channels, 8, 0.85);
+		case ResampleMethod_t::PolyphaseBest:
+			return new PolyphaseResampler(from, to, channels, MAX_Z, 0.95);
+
+		case ResampleMethod_t::SincBestQuality:   type = SRC_SINC_BEST_QUALITY; break;
+		case ResampleMethod_t::SincMediumQuality: type = SRC_SINC_MEDIUM_QUALITY; break;
+		case ResampleMethod_t::SincFastest:       type = SRC_SINC_FASTEST; break;
+		case ResampleMethod_t::ZeroOrderHold:     type = SRC_ZERO_ORDER_HOLD; break;
+		case ResampleMethod_t::Linear:            type = SRC_LINEAR; break;
+		default:
+			fatal ("Bad ResampleMethod option");
+	}
+
+	int err;
+	SRC_STATE *src = src_new (type, channels, &err);
+	if (!src) {
+		error ("Can't resample from %dHz to %dHz: %s",
+				from, to, src_strerror (err));
+		return NULL;
+	}
+	return new SRCResampler(src, from, to, channels);
+}
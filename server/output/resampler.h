@@ -0,0 +1,36 @@
+#pragma once
+
+/* Sample rate conversion of interleaved float sound, one stream at a time.
+ * The backend is chosen by the ResampleMethod option: libsamplerate for
+ * its methods, or the built-in linear and polyphase sinc resamplers. All
+ * memory is allocated by create(), so process() never touches the heap.
+ * Input is always consumed completely; what a backend can not use yet is
+ * kept in a fixed-size carry buffer for the next call. */
+class Resampler
+{
+public:
+	// Returns NULL (after logging an error) if it can't be done.
+	static Resampler *create(int from_rate, int to_rate, int channels);
+	virtual ~Resampler() {}
+
+	// Upper bound for the frames process() can put out for this input.
+	size_t max_output(size_t frames) const
+	{
+		return (size_t)((frames + carry_frames()) * ratio) + 2;
+	}
+
+	// Resample frames of input into out, which has room for out_frames
+	// (at least max_output(frames)). Returns the number of frames put
+	// into out or -1 on error.
+	virtual long process(const float *in, size_t frames, float *out,
+			size_t out_frames) = 0;
+
+protected:
+	Resampler(int from, int to, int channels)
+		: from(from), to(to), C(channels), ratio(to / (double)from) {}
+
+	virtual size_t carry_frames() const { return 0; }
+
+	const int from, to, C;
+	const double ratio;
+};
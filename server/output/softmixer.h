@@ -10,5 +10,3 @@ void softmixer_set_active(bool act);
 
 bool softmixer_is_mono();
 void softmixer_set_mono(bool mono);
-
-void softmixer_process_buffer(char *buf, const size_t size, const sound_params &sp);
@@ -13,6 +13,8 @@ enum ServerEvents : int
 	EV_DATA = 301,		/* data in response to a request follows */
 	EV_FILE_TAGS,		/* tags in a response for tags request */
 	EV_FILE_RATING,		/* ratings changed for a file */
+	EV_FILE_TAGS_BATCH,	/* responses for tags requests: pairs of file
+				   and tags, then "" */
 	
 	EV_PLIST_NEW = 401,	/* replaced the playlist (no data. use CMD_PLIST_GET) */
 	EV_PLIST_ADD,		/* items were added, followed by the file names and "" */
@@ -28,7 +30,9 @@ enum ServerEvents : int
 	EV_CHANNELS,		/* the number of channels has changed */
 	EV_OPTIONS,		/* the options (repeat, shuffle, autonext) have changed */
 	EV_AVG_BITRATE,		/* average bitrate has changed */
-	EV_MIXER_CHANGE		/* (20) the mixer channel was changed */
+	EV_MIXER_CHANGE,	/* (20) the mixer channel was changed */
+	EV_BUFFER		/* the input buffer target (KB, -1 if none) or
+				   the number of underruns has changed */
 };
 
 /* Definition of server commands. */
@@ -57,6 +61,8 @@ enum ServerCommands : int
 	CMD_FILES_RM,		/* delete files/directories */
 	CMD_FILES_MV,		/* move files into new directory */
 	CMD_FILES_RENAME,	/* move+rename single file */
+	CMD_GET_FILE_TAGS_BATCH,/* get tags for the files in the list (see
+				   Socket::send_paths()) */
 
 	CMD_GET_CURRENT = 4001,	/* get the current song index and path */
 	CMD_GET_CTIME,		/* get the current song time */
@@ -68,6 +74,7 @@ enum ServerCommands : int
 	CMD_SET_MIXER,		/* set the volume level */
 	CMD_GET_AVG_BITRATE,	/* get the average bitrate */
 	CMD_GET_MIXER_CHANNEL_NAME,/* get the mixer channel's name */
+	CMD_GET_BUFFER,		/* get the input buffer target and underruns */
 
 	CMD_GET_OPTIONS = 5001,	/* request an EV_OPTIONS */
 	CMD_SET_OPTION_SHUFFLE, CMD_SET_OPTION_REPEAT, CMD_SET_OPTION_AUTONEXT,
@@ -23,6 +23,7 @@
 #include "audio.h"
 #include "server.h"
 #include "../playlist.h"
+#include "../buf_pool.h"
 #include "tags_cache.h"
 #include "output/softmixer.h"
 #include "output/equalizer.h"
@@ -32,10 +33,17 @@
 #define PID_FILE	"pid"
 #define PLAYLIST_FILE	"playlist.m3u"
 
+/* A packet must go out in one non-blocking send(), which doesn't take much
+ * more than this on a unix socket, so batches are split at about it. */
+#define TAGS_BATCH_BYTES	(64 * 1024)
+
 struct client
 {
 	Socket *socket; 	/* NULL if inactive */
 	pthread_mutex_t events_mtx;
+	/* tags responses not yet sent, go out as one event per iteration of
+	 * the server loop (under events_mtx) */
+	std::vector<std::pair<str, file_tags>> tags_batch;
 };
 static client clients[CLIENTS_MAX];
 
@@ -66,11 +74,15 @@ static struct {
 	int bitrate;
 	int rate;
 	int channels;
+	int buffer_target;	/* KB */
+	int underruns;
 } sound_info = {
 	-1,
 	-1,
 	-1,
-	-1
+	-1,
+	-1,
+	0
 };
 
 static tags_cache *tc = NULL;
@@ -174,6 +186,7 @@ static void del_client(int i)
 	LOCK (cli.events_mtx);
 	close (cli.socket->fd());
 	delete cli.socket; cli.socket = NULL;
+	cli.tags_batch.clear();
 	tc->clear_queue(i);
 	UNLOCK (cli.events_mtx);
 }
@@ -434,6 +447,7 @@ static void server_shutdown ()
 
 	audio_exit ();
 	delete tc; tc = NULL;
+	buf_pool_cleanup ();
 	unlink (options::SocketPath.c_str());
 	unlink (options::run_file_path(PID_FILE).c_str());
 	close (wake_up_pipe[0]);
@@ -656,6 +670,14 @@ static void handle_command (const int client_id)
 			case CMD_GET_AVG_BITRATE: send_data_int(&cli, sound_info.avg_bitrate); break;
 			case CMD_GET_RATE: send_data_int(&cli, sound_info.rate); break;
 			case CMD_GET_CHANNELS: send_data_int(&cli, sound_info.channels); break;
+			case CMD_GET_BUFFER:
+			{
+				Lock lock(cli);
+				cli.socket->send(EV_DATA);
+				cli.socket->send(sound_info.buffer_target);
+				cli.socket->send(sound_info.underruns);
+				break;
+			}
 			case CMD_GET_OPTIONS: send_ev_options(client_id); break;
 			case CMD_SET_OPTION_AUTONEXT: options::AutoNext = cli.socket->get_bool(); send_ev_options(); break;
 			case CMD_SET_OPTION_SHUFFLE:  options::Shuffle  = cli.socket->get_bool(); send_ev_options(); break;
@@ -679,6 +701,11 @@ static void handle_command (const int client_id)
 				tc->add_request(file.c_str(), client_id);
 				break;
 			}
+			case CMD_GET_FILE_TAGS_BATCH:
+			{
+				tc->add_requests(cli.socket->get_paths(), client_id);
+				break;
+			}
 
 			case CMD_SET_FILE_TAGS:
 			{
@@ -726,6 +753,34 @@ static void handle_command (const int client_id)
 	}
 }
 
+/* Turn the tags responses collected for cli into events, as few as
+ * TAGS_BATCH_BYTES allows. */
+static void send_tags_batch (client &cli)
+{
+	auto &batch = cli.tags_batch;
+	auto &sock = *cli.socket;
+
+	if (batch.empty()) return;
+
+	if (batch.size() == 1) {
+		sock.packet(EV_FILE_TAGS);
+		sock.send(batch[0].first);
+		sock.send(&batch[0].second);
+		sock.finish();
+	}
+	else for (size_t i = 0; i < batch.size(); ) {
+		sock.packet(EV_FILE_TAGS_BATCH);
+		while (i < batch.size() && sock.buffered() < TAGS_BATCH_BYTES) {
+			sock.send(batch[i].first);
+			sock.send(&batch[i].second);
+			i++;
+		}
+		sock.send("");
+		sock.finish();
+	}
+	batch.clear();
+}
+
 /* Add clients file descriptors to fds. */
 static void add_clients_fds (fd_set *read, fd_set *write)
 {
@@ -733,6 +788,7 @@ static void add_clients_fds (fd_set *read, fd_set *write)
 		if (clients[i].socket) {
 			FD_SET (clients[i].socket->fd(), read);
 			LOCK (clients[i].events_mtx);
+			send_tags_batch (clients[i]);
 			if (clients[i].socket->pending())
 				FD_SET (clients[i].socket->fd(), write);
 			UNLOCK (clients[i].events_mtx);
@@ -871,6 +927,15 @@ void set_info_avg_bitrate (const int avg_bitrate)
 	add_event_all (EV_AVG_BITRATE, sound_info.avg_bitrate);
 }
 
+void set_info_buffer (const int target, const int underruns)
+{
+	if (sound_info.buffer_target == target
+			&& sound_info.underruns == underruns) return;
+	sound_info.buffer_target = target;
+	sound_info.underruns = underruns;
+	add_event_all (EV_BUFFER, sound_info.buffer_target, sound_info.underruns);
+}
+
 /* Notify the client about change of the player state. */
 void state_change ()
 {
@@ -894,8 +959,16 @@ void tags_response (const int client_id, const str &file, const file_tags *tags)
 	assert (tags != NULL);
 	assert (LIMIT(client_id, CLIENTS_MAX));
 
-	if (clients[client_id].socket) {
-		add_event (clients[client_id], EV_FILE_TAGS, file, tags);
-		wake_up_server ();
+	client &cli = clients[client_id];
+	bool wake = false;
+
+	/* the server thread picks the batch up in add_clients_fds() */
+	LOCK (cli.events_mtx);
+	if (cli.socket) {
+		wake = cli.tags_batch.empty();
+		cli.tags_batch.emplace_back(file, *tags);
 	}
+	UNLOCK (cli.events_mtx);
+
+	if (wake) wake_up_server ();
 }
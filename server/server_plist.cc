@@ -191,6 +191,39 @@ ServerPlaylist::song ServerPlaylist::next(bool force) const
 	assert(false); nv[dir] = 0; return NIL;
 }
 
+/* The paths of next() and the songs after it, as far as they are known
+ * (with Shuffle and Repeat, the order after the end of the list is not). */
+std::vector<str> ServerPlaylist::upcoming(int n) const
+{
+	std::vector<str> r;
+	song s = next();
+	if (n <= 0 || s.second == -1) return r;
+	r.push_back(path(s));
+	if (!options::AutoNext) return r;
+
+	auto &p = dir ? dir_plist : playlist;
+	const int N = p.size();
+	if (!options::Shuffle)
+	{
+		for (int i = s.second+1; (int)r.size() < n; ++i)
+		{
+			if (i == N)
+			{
+				if (!options::Repeat) break;
+				i = 0;
+			}
+			if (i == i1 || i == s.second) break;
+			if (VALID(i)) r.push_back(path(IT));
+		}
+	}
+	else if (order.size() == p.size())
+	{
+		for (int k = order_inv[s.second]+1; k < N && (int)r.size() < n; ++k)
+			if (VALID(order[k])) r.push_back(path(S(dir, order[k])));
+	}
+	return r;
+}
+
 ServerPlaylist::song ServerPlaylist::prev() const
 {
 	if (!nv[dir]) return NIL;
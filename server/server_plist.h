@@ -30,6 +30,7 @@ public:
 	bool stopped() const { return i1 == -1; }
 
 	song next(bool force = false) const; // force ignores Repeat and AutoNext
+	std::vector<str> upcoming(int n) const; // paths of up to n songs after next()
 	song prev() const;
 	song current() const { return S(dir, i1); }
 
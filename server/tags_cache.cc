@@ -6,6 +6,7 @@
 #include "ratings.h"
 #include <pthread.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 
 /* Read the selected tags for this file and add it to the cache.
  * If client_id != -1, the server is notified using tags_response().
@@ -20,7 +21,13 @@ file_tags tags_cache::read_add (const str &file, int client_id)
 	/* If this entry is already present in the cache, we have 3 options:
 	 * we must read different tags (TAGS_*) or the tags are outdated
 	 * or this is an immediate tags read (client_id == -1) */
-	time_t current_mtime = get_mtime (file);
+	struct stat st;
+	if (stat(file.c_str(), &st) == -1)
+	{
+		st.st_mtime = (time_t)-1; // like get_mtime()
+		st.st_size = -1;
+	}
+	time_t current_mtime = st.st_mtime;
 	if (rec)
 	{
 		if (rec.mod_time == current_mtime)
@@ -31,10 +38,12 @@ file_tags tags_cache::read_add (const str &file, int client_id)
 		debug ("Tags in the cache are outdated");
 	}
 
+	rec.tags = file_tags(); // don't keep what the file no longer has
 	auto *df = get_decoder (file);
 	if (df) df->read_tags(file, rec.tags);
 	rec.tags.rating = ratings_read(file);
 	rec.mod_time = current_mtime;
+	rec.size = st.st_size;
 
 	db->add(file, rec);
 
@@ -44,13 +53,11 @@ file_tags tags_cache::read_add (const str &file, int client_id)
 }
 
 
-/* Read the selected tags for this file and add it to the cache.
- * If client_id != -1, the server is notified using tags_response().
- * If client_id == -1, copy of file_tags is returned. */
-void tags_cache::write_add (const str &file, tag_changes *tags, int client_id)
+/* Write the tags to the file. Returns false if that failed. */
+bool tags_cache::write_add (const str &file, tag_changes *tags)
 {
 	assert(tags);
-	if (tags->empty()) return;
+	if (tags->empty()) { delete tags; return false; }
 	
 	#ifndef NDEBUG
 	debug ("Setting tags for %s", file);
@@ -65,18 +72,17 @@ void tags_cache::write_add (const str &file, tag_changes *tags, int client_id)
 	{
 		status_msg(format("Can not write tags for %s", file.c_str()));
 		delete tags;
-		return;
+		return false;
 	}
 	bool ok = df->write_tags(file, *tags);
 	delete tags;
 	if (!ok)
 	{
 		status_msg(format("Failed writing tags for %s", file.c_str()));
-		return;
+		return false;
 	}
 
-	assert (client_id != -1);
-	read_add(file, client_id);
+	return true;
 }
 
 void tags_cache::ratings_changed(const str &file, int rating)
@@ -105,40 +111,99 @@ void tags_cache::ratings_changed(const str &file, int rating)
 	db->add(file, rec);
 }
 
+/* Wait for the next request and take it, going round the clients so that
+ * none of them has to wait for all requests of another. A client's queue is
+ * taken as a batch and sorted by (device, inode), so that a directory's
+ * files are read roughly in the order they are on the disk. A read of a file
+ * that is being read already only adds the client to those waiting for it;
+ * other requests for a file that is busy wait. Returns false when the
+ * thread should exit. Called with mutex held. */
+bool tags_cache::next_request (int &client, str &file, tag_changes *&tags)
+{
+	while (!stop_reader_thread)
+	{
+		for (int i = 0; i < CLIENTS_MAX; ++i)
+		{
+			int c = (next_client + i) % CLIENTS_MAX;
+			auto &batch = batches[c];
+
+			while (true)
+			{
+				if (batch.empty())
+				{
+					auto &q = queues[c];
+					for (; !q.empty(); q.pop()) batch.push_back(std::move(q.front()));
+					std::stable_sort(batch.begin(), batch.end(),
+					[](const Request &a, const Request &b)
+					{ return a.dev != b.dev ? a.dev < b.dev : a.ino < b.ino; });
+				}
+				if (batch.empty()) break;
+
+				auto &rq = batch.front();
+				auto it = in_flight.find(rq.path);
+				if (it == in_flight.end())
+				{
+					client = c;
+					file = rq.path;
+					tags = rq.tags.release();
+					in_flight[file] = {tags != NULL, {c}};
+					batch.pop_front();
+					next_client = (c + 1) % CLIENTS_MAX;
+					return true;
+				}
+				if (rq.tags || it->second.write) break; // busy
+
+				auto &w = it->second.clients;
+				if (std::find(w.begin(), w.end(), c) == w.end()) w.push_back(c);
+				batch.pop_front();
+			}
+		}
+
+		debug ("No requests to take, waiting");
+		pthread_cond_wait (&request_cond, &mutex);
+	}
+	return false;
+}
+
+/* Send the tags of a file from next_request() to the clients waiting for
+ * them, or just let others have the file if tags is NULL. */
+void tags_cache::finish_request (const str &file, const file_tags *tags)
+{
+	LOCK (mutex);
+	std::vector<int> clients;
+	clients.swap(in_flight[file].clients);
+	in_flight.erase(file);
+	pthread_cond_broadcast (&request_cond);
+	UNLOCK (mutex);
+
+	if (tags) for (int c : clients) tags_response (c, file, tags);
+}
+
 void *tags_cache::reader_thread(void *cache_ptr)
 {
 	logit ("Tags reader thread started");
 
 	tags_cache *c = (tags_cache *)cache_ptr;
-	LOCK (c->mutex);
+	int client;
+	str file;
+	tag_changes *tags;
 
-	for (int client = 0, last_client = 0; !c->stop_reader_thread; )
+	while (true)
 	{
-		++client; client %= CLIENTS_MAX;
-		auto &q = c->queues[client];
-		if (!q.empty())
-		{
-			last_client = client;
-			auto &rq = q.front();
-			str file = rq.path;
-			tag_changes *tags = rq.tags.release();
-			q.pop();
-			UNLOCK (c->mutex);
-			if (!tags)
-				c->read_add (file, client);
-			else
-				c->write_add(file, tags, client);
-			LOCK (c->mutex);
-		}
-		else if (client == last_client)
+		LOCK (c->mutex);
+		bool ok = c->next_request(client, file, tags);
+		UNLOCK (c->mutex);
+		if (!ok) break;
+
+		if (!tags || c->write_add(file, tags))
 		{
-			debug ("All queues empty, waiting");
-			pthread_cond_wait (&c->request_cond, &c->mutex);
-			continue;
+			file_tags t = c->read_add(file, -1);
+			c->finish_request(file, &t);
 		}
+		else
+			c->finish_request(file, NULL);
 	}
 
-	UNLOCK (c->mutex);
 	logit ("Exiting tags reader thread");
 
 	return NULL;
@@ -146,17 +211,16 @@ void *tags_cache::reader_thread(void *cache_ptr)
 
 tags_cache::tags_cache()
 : stop_reader_thread(false)
+, next_client(0)
 , db(NULL)
 {
 	pthread_mutex_init (&mutex, NULL);
 	int rc = pthread_cond_init (&request_cond, NULL);
 	if (rc != 0) fatal ("Can't create request_cond: %s", xstrerror (rc));
-	rc = pthread_create (&reader_thread_id, NULL, reader_thread, this);
-	if (rc != 0) fatal ("Can't create tags cache thread: %s", xstrerror (rc));
 
 	try
 	{
-		db = new tags_db;
+		db = tags_db::open();
 	}
 	catch(std::exception &e)
 	{
@@ -165,21 +229,32 @@ tags_cache::tags_cache()
 		db = NULL;
 		fatal("Can't create tags_db: %s", e.what());
 	}
+
+	for (int i = 0; i < options::TagsReaderThreads; ++i)
+	{
+		pthread_t tid;
+		rc = pthread_create (&tid, NULL, reader_thread, this);
+		if (rc != 0) fatal ("Can't create tags cache thread: %s", xstrerror (rc));
+		reader_threads.push_back(tid);
+	}
 }
 
 tags_cache::~tags_cache()
 {
 	LOCK (mutex);
 	stop_reader_thread = true;
-	pthread_cond_signal (&request_cond);
+	pthread_cond_broadcast (&request_cond);
 	UNLOCK (mutex);
 
-	delete db;
+	for (auto tid : reader_threads)
+	{
+		int rc = pthread_join (tid, NULL);
+		if (rc != 0) fatal ("pthread_join() on cache reader thread failed: %s", xstrerror (rc));
+	}
 
-	int rc = pthread_join (reader_thread_id, NULL);
-	if (rc != 0) fatal ("pthread_join() on cache reader thread failed: %s", xstrerror (rc));
+	delete db;
 
-	rc = pthread_mutex_destroy (&mutex);
+	int rc = pthread_mutex_destroy (&mutex);
 	if (rc != 0) log_errno ("Can't destroy mutex", rc);
 	rc = pthread_cond_destroy (&request_cond);
 	if (rc != 0) log_errno ("Can't destroy request_cond", rc);
@@ -189,13 +264,20 @@ void tags_cache::add_request (const str &file, int client_id, tag_changes *tags)
 {
 	assert (LIMIT(client_id, CLIENTS_MAX));
 
+	struct stat st;
+	if (stat(file.c_str(), &st) == -1)
+	{
+		memset(&st, 0, sizeof(st));
+		st.st_mtime = (time_t)-1; // like get_mtime()
+	}
+
 	if (!tags)
 	{
 		debug ("Request for tags for '%s' from client %d", file.c_str(), client_id);
 
 		auto rec = db->get(file);
 		if (rec) {
-			if (rec.mod_time == get_mtime(file)) {
+			if (rec.mod_time == st.st_mtime) {
 				tags_response (client_id, file, &rec.tags);
 				debug ("Tags are present in the cache");
 				return;
@@ -205,16 +287,79 @@ void tags_cache::add_request (const str &file, int client_id, tag_changes *tags)
 	}
 
 	LOCK (mutex);
-	queues[client_id].emplace(file, tags);
+	queues[client_id].emplace(file, tags, st);
 	pthread_cond_signal (&request_cond);
 	UNLOCK (mutex);
 }
 
+/* Tags requests for many files, usually a whole directory. The cache is
+ * checked right away for all of them at once and what is found up to date
+ * is sent back without waiting for the readers, which only get the rest. */
+void tags_cache::add_requests (const strings &files, int client_id)
+{
+	assert (LIMIT(client_id, CLIENTS_MAX));
+	debug ("Request for tags for %zu files from client %d", files.size(), client_id);
+
+	std::vector<struct stat> st(files.size());
+	str dir;
+	int dir_fd = -1;
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		auto &f = files[i];
+		auto k = f.rfind('/');
+		int rc = -1;
+		if (k != str::npos)
+		{
+			if (dir.length() != k+1 || f.compare(0, k+1, dir))
+			{
+				if (dir_fd != -1) close(dir_fd);
+				dir = f.substr(0, k+1);
+				dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			}
+			if (dir_fd != -1) rc = fstatat(dir_fd, f.c_str() + k+1, &st[i], 0);
+		}
+		else
+			rc = stat(f.c_str(), &st[i]);
+
+		if (rc == -1)
+		{
+			memset(&st[i], 0, sizeof(st[i]));
+			st[i].st_mtime = (time_t)-1; // like get_mtime()
+		}
+	}
+	if (dir_fd != -1) close(dir_fd);
+
+	auto recs = db->get(files);
+
+	size_t hits = 0;
+	std::vector<size_t> misses;
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (recs[i] && recs[i].mod_time == st[i].st_mtime)
+		{
+			tags_response (client_id, files[i], &recs[i].tags);
+			++hits;
+		}
+		else
+			misses.push_back(i);
+	}
+
+	if (!misses.empty())
+	{
+		LOCK (mutex);
+		for (size_t i : misses) queues[client_id].emplace(files[i], nullptr, st[i]);
+		pthread_cond_broadcast (&request_cond);
+		UNLOCK (mutex);
+	}
+	debug ("%zu of %zu tags were in the cache", hits, files.size());
+}
+
 void tags_cache::clear_queue (int client_id)
 {
 	assert (LIMIT(client_id, CLIENTS_MAX));
 	LOCK (mutex);
 	request_queue().swap(queues[client_id]);
+	batches[client_id].clear();
 	debug ("Cleared requests queue for client %d", client_id);
 	UNLOCK (mutex);
 }
@@ -1,6 +1,8 @@
 #pragma once
 #include "server.h"
 #include "tags_db.h"
+#include <sys/stat.h>
+#include <deque>
 
 class tags_cache
 {
@@ -9,6 +11,7 @@ public:
 	~tags_cache();
 
 	void add_request (const str &file, int client_id, tag_changes *tags=NULL);
+	void add_requests (const strings &files, int client_id);
 	file_tags get_immediate (const str &file);
 	void ratings_changed(const str &file, int rating);
 	void clear_queue (int client_id);
@@ -20,33 +23,34 @@ public:
 private:
 	tags_db *db;
 
-	struct Lock
-	{
-		Lock(tags_db &db, DBT &key);
-		Lock(const Lock &) = delete;
-		~Lock();
-		DB_LOCK lock;
-		DB_ENV *db_env;
-	};
-	friend struct Lock;
-
-	void remove_rec(const str &fname);
-	void add(DBT &key, const cache_record &rec);
 	file_tags read_add(const str &file, int client_id);
-	void write_add(const str &file, tag_changes *tags, int client_id);
+	bool write_add(const str &file, tag_changes *tags);
 	static void *reader_thread (void *cache_ptr);
 
 	struct Request
 	{
 		str path;
 		std::unique_ptr<tag_changes> tags;
-		Request(const str &p) : path(p) {}
-		Request(const str &p, tag_changes *t) : path(p), tags(t) {}
+		dev_t dev; ino_t ino; // where the file is, to read in disk order
+		Request(const str &p, tag_changes *t, const struct stat &st)
+		: path(p), tags(t), dev(st.st_dev), ino(st.st_ino) {}
 	};
 	typedef std::queue<Request> request_queue;
 	request_queue queues[CLIENTS_MAX]; /* requests queues for each client */
+	std::deque<Request> batches[CLIENTS_MAX]; /* what was in a queue when
+						     a reader got to it, sorted */
+	int next_client; /* where the next reader starts looking, for fairness */
+	struct InFlight
+	{
+		bool write;
+		std::vector<int> clients; /* waiting for the tags */
+	};
+	std::map<str, InFlight> in_flight; /* files being read or written */
 	bool stop_reader_thread; /* request for stopping read thread (if non-zero) */
-	pthread_cond_t request_cond; /* condition for signalizing new requests */
+	pthread_cond_t request_cond; /* new requests or in_flight changed */
 	pthread_mutex_t mutex; /* mutex for all above data (except db because it's thread-safe) */
-	pthread_t reader_thread_id; /* tid of the reading thread */
+	std::vector<pthread_t> reader_threads; /* TagsReaderThreads of them */
+
+	bool next_request (int &client, str &file, tag_changes *&tags);
+	void finish_request (const str &file, const file_tags *tags);
 };
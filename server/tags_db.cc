@@ -1,4 +1,6 @@
 #include "tags_db.h"
+#include "tags_log.h"
+#include <db.h>
 #include <dirent.h>
 #include <sys/stat.h>
 
@@ -8,7 +10,10 @@
 /* Number used to create cache version tag to detect incompatibilities
  * between cache version stored on the disk and MOC/BerkeleyDB environment.
  * If you modify the DB structure, increase this number. */
-#define CACHE_DB_FORMAT_VERSION	4
+#define CACHE_DB_FORMAT_VERSION	5
+
+/* Caches of this version are upgraded by converting their records. */
+#define CACHE_DB_UPGRADABLE	4
 
 /* How frequently to flush the tags database to disk.  A value of zero
  * disables flushing. */
@@ -40,70 +45,38 @@ static void db_panic_cb (DB_ENV *, int errval)
 }
 #endif
 
-static std::vector<char> cache_record_serialize (const cache_record &rec)
-{
-	const auto &tags = rec.tags;
-	size_t artist_len = tags.artist.length()+1;
-	size_t album_len = tags.album.length()+1;
-	size_t title_len = tags.title.length()+1;
-
-	size_t len = sizeof(rec.mod_time)
-		+ artist_len + album_len + title_len
-		+ sizeof(tags.track)
-		+ 1 /* rating */
-		+ sizeof(tags.time);
-	std::vector<char> buf(len);
-	char *p = (char*)buf.data();
-
-	memcpy (p, &rec.mod_time, sizeof(rec.mod_time)); p += sizeof(rec.mod_time);
-	memcpy (p, tags.artist.c_str(), artist_len); p += artist_len;
-	memcpy (p, tags.album.c_str(), album_len); p += album_len;
-	memcpy (p, tags.title.c_str(), title_len); p += title_len;
-	memcpy (p, &tags.track, sizeof(tags.track)); p += sizeof(tags.track);
-	memcpy (p, &tags.time, sizeof(tags.time)); p += sizeof(tags.time);
-	*p++ = (char)tags.rating;
-	return buf;
-}
-static bool cache_record_deserialize (cache_record &rec, const char *buf, size_t bytes_left)
+class bdb_tags_db : public tags_db
 {
-	auto &tags = rec.tags;
-	const char *p = buf;
-
-	#define extract_num(var) \
-	do { \
-		if (bytes_left < sizeof(var)) goto err; \
-		memcpy (&var, p, sizeof(var)); \
-		bytes_left -= sizeof(var); \
-		p += sizeof(var); \
-	} while (0)
-
-	#define extract_str(var) \
-	do { \
-		size_t len = strlen(p) + 1; \
-		if (len > bytes_left) goto err; \
-		var = p; p += len; bytes_left -= len; \
-		assert(var.length() == len-1); \
-	} while (0)
-
-	extract_num (rec.mod_time);
-	extract_str (tags.artist);
-	extract_str (tags.album);
-	extract_str (tags.title);
-	extract_num (tags.track);
-	extract_num (tags.time);
-
-	if (!bytes_left) goto err;
-	tags.rating = *p++;
-	--bytes_left;
-
-	return true;
-
-err:
-	logit ("Cache record deserialization error at %tdB", p - buf);
-	return false;
-}
-
-tags_db::Lock::Lock(tags_db &db, const str &k)
+public:
+	bdb_tags_db();
+	~bdb_tags_db();
+
+	void add(const str &key, const cache_record &rec) override;
+	cache_record get(const str &key) override;
+	std::vector<cache_record> get(const strings &keys) override;
+	void remove(const str &key) override;
+	std::unique_ptr<Lock> lock(const str &key) override;
+
+private:
+	struct bdb_lock : Lock
+	{
+		bdb_lock(bdb_tags_db &db, const str &k);
+		~bdb_lock();
+		DB_LOCK lock;
+		DB_ENV *db_env;
+	};
+
+	void sync();
+	void put(const str &key, const std::vector<char> &data);
+	void load_pool();
+	bool upgrade();
+
+	DB_ENV *db_env;
+	DB     *db;
+	u_int32_t locker;
+};
+
+bdb_tags_db::bdb_lock::bdb_lock(bdb_tags_db &db, const str &k)
 : db_env(db.db_env)
 {
 	DBT key; memset(&key, 0, sizeof(key));
@@ -113,18 +86,18 @@ tags_db::Lock::Lock(tags_db &db, const str &k)
 	int rc = db_env->lock_get (db.db_env, db.locker, 0, &key, DB_LOCK_WRITE, &lock);
 	if (rc) fatal ("Can't get DB lock: %s", db_strerror (rc));
 }
-tags_db::Lock::~Lock()
+bdb_tags_db::bdb_lock::~bdb_lock()
 {
 	int rc = db_env->lock_put (db_env, &lock);
 	if (rc) fatal ("Can't release DB lock: %s", db_strerror (rc));
 }
 
-tags_db::Lock tags_db::lock(const str &key)
+std::unique_ptr<tags_db::Lock> bdb_tags_db::lock(const str &key)
 {
-	return Lock(*this, key);
+	return std::make_unique<bdb_lock>(*this, key);
 }
 
-cache_record tags_db::get(const str &k)
+cache_record bdb_tags_db::get(const str &k)
 {
 	debug ("Getting tags for %s", k.c_str());
 
@@ -149,24 +122,71 @@ cache_record tags_db::get(const str &k)
 		throw std::runtime_error("Cache DB get error");
 	}
 
-	bool ok = cache_record_deserialize(rec, (const char*)val.data, val.size);
+	bool ok = cache_record_deserialize(rec, (const char*)val.data, val.size, pool);
 	free(val.data);
-	if (!ok) throw std::runtime_error("Cache DB deserialization error");
+	if (!ok) rec.mod_time = -1;
 	return rec;
 }
 
-void tags_db::add(const str &k, const cache_record &rec)
+/* Look up many keys with one cursor, in key order, so that the btree pages
+ * are walked through once instead of searched for every key. */
+std::vector<cache_record> bdb_tags_db::get(const strings &keys)
 {
-	debug ("Adding/updating cache object");
+	std::vector<cache_record> recs(keys.size());
+	for (auto &rec : recs) rec.mod_time = -1;
+	if (keys.empty()) return recs;
 
+	std::vector<size_t> order(keys.size());
+	for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+	std::sort(order.begin(), order.end(),
+		[&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+
+	DBC *cur = NULL;
+	int ret = db->cursor(db, NULL, &cur, 0);
+	if (ret)
+	{
+		log_errno ("Cache DB cursor error", ret);
+		throw std::runtime_error("Cache DB cursor error");
+	}
+
+	DBT val; memset (&val, 0, sizeof(val));
+	val.flags = DB_DBT_REALLOC;
+
+	for (size_t i : order)
+	{
+		auto &k = keys[i];
+		DBT key; memset(&key, 0, sizeof(key));
+		key.data = (void *) k.c_str();
+		key.size = k.length();
+
+		ret = cur->get(cur, &key, &val, DB_SET);
+		if (ret == DB_NOTFOUND) continue;
+		if (ret) break;
+
+		if (!cache_record_deserialize(recs[i], (const char*)val.data, val.size, pool))
+			recs[i].mod_time = -1;
+	}
+
+	free(val.data);
+	cur->close(cur);
+
+	if (ret && ret != DB_NOTFOUND)
+	{
+		log_errno ("Cache DB get error", ret);
+		throw std::runtime_error("Cache DB get error");
+	}
+	return recs;
+}
+
+void bdb_tags_db::put(const str &k, const std::vector<char> &data)
+{
 	DBT key; memset (&key, 0, sizeof (key));
 	key.data = (void *) k.c_str();
 	key.size = k.length();
 
 	DBT val; memset (&val, 0, sizeof(val));
-	auto buf = cache_record_serialize (rec);
-	val.data = buf.data();
-	val.size = buf.size();
+	val.data = (void *) data.data();
+	val.size = data.size();
 
 	int ret = db->put (db, NULL, &key, &val, 0);
 	if (ret) error_errno ("DB put error", ret);
@@ -174,7 +194,19 @@ void tags_db::add(const str &k, const cache_record &rec)
 	sync();
 }
 
-void tags_db::remove(const str &k)
+void bdb_tags_db::add(const str &k, const cache_record &rec)
+{
+	debug ("Adding/updating cache object");
+
+	std::vector<char> buf;
+	cache_record_serialize (rec, buf, pool);
+
+	/* strings first, so that the record never refers to missing ones */
+	pool.save([this](const str &key, const std::vector<char> &data) { put(key, data); });
+	put(k, buf);
+}
+
+void bdb_tags_db::remove(const str &k)
 {
 	debug ("Removing %s from the cache...", k.c_str());
 
@@ -189,7 +221,7 @@ void tags_db::remove(const str &k)
 }
 
 /* Synchronize cache every DB_SYNC_COUNT updates. */
-void tags_db::sync ()
+void bdb_tags_db::sync ()
 {
 	static int sync_count = 0;
 	if (DB_SYNC_COUNT == 0) return;
@@ -207,30 +239,133 @@ static str create_version_tag()
 	return format("%d %d %d", CACHE_DB_FORMAT_VERSION, db_major, db_minor);
 }
 
-/* Check version of the cache directory.  If it was created
- * using format not handled by this version of MOC, return 0. */
-static bool cache_version_matches ()
+static bool write_version_tag()
+{
+	str p = options::run_file_path(TAGS_INFO_FILE);
+	FILE *f = fopen (p.c_str(), "w");
+	if (!f) {
+		log_errno ("Error writing cache info file", errno);
+		return false;
+	}
+	str vt = create_version_tag();
+	if (fwrite (vt.c_str(), vt.length(), 1, f) != 1)
+		logit ("Error writing cache version tag");
+	fclose (f);
+	return true;
+}
+
+/* Return the format version of the cache directory, or 0 if there is none
+ * or it was made by another version of Berkeley DB. */
+static int cache_version ()
 {
 	str fname = options::run_file_path(TAGS_INFO_FILE);
 	FILE *f = fopen(fname.c_str(), "r");
-	if (!f) return false;
-
-	str vt0 = create_version_tag(), vt;
-	vt.resize(vt0.length()+1);
-	ssize_t rres = fread ((char*)vt.c_str(), 1, vt0.length()+1, f);
-	fclose(f); f = NULL;
-	if (rres != vt0.length()) return false;
-	vt.resize(rres);
-	logit("Cache version %s", vt.c_str());
-	return vt == vt0;
+	if (!f) return 0;
+
+	int format, major, minor, db_major, db_minor;
+	int n = fscanf (f, "%d %d %d", &format, &major, &minor);
+	fclose (f);
+	if (n != 3) return 0;
+	logit("Cache version %d %d %d", format, major, minor);
+
+	db_version (&db_major, &db_minor, NULL);
+	return major == db_major && minor == db_minor ? format : 0;
+}
+
+/* Read the string pool that the records refer to. */
+void bdb_tags_db::load_pool()
+{
+	for (uint32_t chunk = 0; ; ++chunk)
+	{
+		str k = string_pool::chunk_key(chunk);
+		DBT key; memset(&key, 0, sizeof(key));
+		key.data = (void *) k.c_str();
+		key.size = k.length();
+
+		DBT val; memset (&val, 0, sizeof(val));
+		val.flags = DB_DBT_MALLOC;
+
+		int ret = db->get(db, NULL, &key, &val, 0);
+		if (ret)
+		{
+			if (ret != DB_NOTFOUND) log_errno ("Cache DB get error", ret);
+			break;
+		}
+		bool more = pool.load(chunk, (const char*)val.data, val.size);
+		free(val.data);
+		if (!more) break;
+	}
+}
+
+/* Convert the records of a CACHE_DB_UPGRADABLE cache. Records that are
+ * in the current format already were converted by an upgrade that was
+ * interrupted. */
+bool bdb_tags_db::upgrade()
+{
+	logit ("Upgrading the tags cache...");
+
+	DBC *cur = NULL;
+	int ret = db->cursor(db, NULL, &cur, 0);
+	if (ret)
+	{
+		error_errno ("Cache DB cursor error", ret);
+		return false;
+	}
+
+	DBT key; memset (&key, 0, sizeof(key));
+	DBT val; memset (&val, 0, sizeof(val));
+	key.flags = val.flags = DB_DBT_REALLOC;
+	std::vector<char> buf;
+	size_t n = 0;
+
+	while ((ret = cur->get(cur, &key, &val, DB_NEXT)) == 0)
+	{
+		const char *data = (const char*)val.data;
+		cache_record rec;
+
+		if (key.size && *(const char*)key.data == '\1') continue; // string_pool
+		if (val.size && data[0] == CACHE_RECORD_VERSION
+				&& cache_record_deserialize(rec, data, val.size, pool))
+			continue;
+
+		if (!cache_record_deserialize_v4(rec, data, val.size))
+		{
+			cur->del(cur, 0);
+			continue;
+		}
+		cache_record_serialize (rec, buf, pool);
+
+		DBT nval; memset (&nval, 0, sizeof(nval));
+		nval.data = buf.data();
+		nval.size = buf.size();
+		ret = cur->put(cur, &key, &nval, DB_CURRENT);
+		if (ret) break;
+		++n;
+	}
+
+	free(key.data);
+	free(val.data);
+	cur->close(cur);
+	pool.save([this](const str &key, const std::vector<char> &data) { put(key, data); });
+	db->sync (db, 0);
+
+	if (ret != DB_NOTFOUND)
+	{
+		error_errno ("Upgrading the tags cache failed", ret);
+		return false;
+	}
+	logit ("Converted %zu records", n);
+	return true;
 }
 
-tags_db::tags_db()
+bdb_tags_db::bdb_tags_db()
 : db(NULL), db_env(NULL), locker(0)
 {
 	int ret;
+	const int version = cache_version();
+	const bool upgrading = version == CACHE_DB_UPGRADABLE;
 
-	if (!cache_version_matches()) {
+	if (version != CACHE_DB_FORMAT_VERSION && !upgrading) {
 		logit ("Preparing new tags cache....");
 		if (!file_delete(options::run_file_path(TAGS_INFO_FILE)) ||
 		    !file_delete(options::run_file_path(TAGS_DB_FILE)))
@@ -238,17 +373,7 @@ tags_db::tags_db()
 			error ("Deleting old files failed!");
 			goto err;
 		}
-
-		str p = options::run_file_path(TAGS_INFO_FILE);
-		FILE *f = fopen (p.c_str(), "w");
-		if (!f) {
-			log_errno ("Error writing cache info file", errno);
-			goto err;
-		}
-		str vt = create_version_tag();
-		if (fwrite (vt.c_str(), vt.length(), 1, f) != 1)
-			logit ("Error writing cache version tag");
-		fclose (f);
+		if (!write_version_tag()) goto err;
 	}
 
 	ret = db_env_create (&db_env, 0);
@@ -296,6 +421,9 @@ tags_db::tags_db()
 		goto err;
 	}
 
+	load_pool();
+	if (upgrading && upgrade()) write_version_tag();
+
 	return;
 
 err:
@@ -320,7 +448,7 @@ err:
 	throw std::runtime_error("Failed to initialise tags cache");
 }
 
-tags_db::~tags_db()
+bdb_tags_db::~bdb_tags_db()
 {
 	if (db) {
 		#ifndef NDEBUG
@@ -341,4 +469,10 @@ tags_db::~tags_db()
 		db_env->close (db_env, 0);
 		db_env = NULL;
 	}
-}
\ No newline at end of file
+}
+
+tags_db *tags_db::open()
+{
+	if (options::TagsCacheLog) return new tags_log;
+	return new bdb_tags_db;
+}
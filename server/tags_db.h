@@ -1,41 +1,26 @@
 #pragma once
-#include "../file_tags.h"
-#include <db.h>
-
-struct cache_record
-{
-	operator bool() const { return mod_time != -1; }
-
-	time_t mod_time; // last modification time of the file
-	file_tags tags;
-};
+#include "cache_record.h"
 
+// Storage of the tags cache: Berkeley DB (tags_db.cc) or an append-only
+// log (tags_log.cc), as options::TagsCacheLog says.
 class tags_db
 {
 public:
-	tags_db();
-	~tags_db();
+	static tags_db *open(); // throws if the cache can't be opened
+	virtual ~tags_db() {}
 
-	void add(const str &key, const cache_record &rec);
-	cache_record get(const str &key); // mod_time -1 if not found
-	void remove(const str &key);
-	void sync();
+	virtual void add(const str &key, const cache_record &rec) = 0;
+	virtual cache_record get(const str &key) = 0; // mod_time -1 if not found
+	virtual std::vector<cache_record> get(const strings &keys) = 0; // same, for many
+	virtual void remove(const str &key) = 0;
 
+	// held while a record is read, changed and written back
 	struct Lock
 	{
-		Lock(Lock &&) = default;
-		Lock(const Lock &) = delete;
-		Lock(tags_db &db, const str &k);
-		~Lock();
-		DB_LOCK lock;
-		DB_ENV *db_env;
+		virtual ~Lock() {}
 	};
-	friend struct Lock;
-
-	Lock lock(const str &key);
+	virtual std::unique_ptr<Lock> lock(const str &key) = 0;
 
-private:
-	DB_ENV *db_env;
-	DB     *db;
-	u_int32_t locker;
+protected:
+	string_pool pool; // of the records in this store
 };
@@ -0,0 +1,773 @@
+#include "tags_log.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define TAGS_LOG_FILE	"tags.log"
+#define TAGS_INDEX_FILE	"tags.idx"
+
+/* Increase this if you change the format of either file. */
+#define TAGS_LOG_VERSION	2
+
+/* A log of this version has records that can be converted, see upgrade(). */
+#define TAGS_LOG_UPGRADABLE	1
+
+#define REC_MAGIC	0x4d4f4352	/* every record starts with it */
+#define EMPTY		0	/* offsets in slots that can't be records */
+#define DELETED		1
+#define MIN_SLOTS	4096
+#define COMPACT_MIN	(1 << 20)	/* don't compact for less garbage */
+#define COPY_CHUNK	(1 << 20)	/* write size when compacting */
+
+/* The log is mapped once with this size, so that it can grow without
+ * moving under the readers. It can't get bigger. */
+#define LOG_MAP		((size_t)1 << (sizeof(void *) > 4 ? 36 : 30))
+
+static const char LOG_MAGIC[8] = "MOCTLOG";
+static const char IDX_MAGIC[8] = "MOCTIDX";
+
+struct log_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+	uint64_t id;	/* the index must have the same */
+};
+
+/* followed by the key, the value and padding to 8 bytes */
+struct rec_header
+{
+	uint32_t magic;
+	uint32_t key_len;
+	uint32_t val_len;	/* 0: the key was removed */
+	uint32_t check;		/* of the key and value */
+};
+
+struct idx_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+	uint64_t log_id;
+	uint64_t log_end;	/* what the index covers, the log may be
+				   longer after a crash */
+	uint64_t slots;		/* a power of two */
+	uint64_t used;		/* slots not empty, deleted ones included */
+	uint64_t garbage;	/* bytes of the log that compacting frees */
+};
+
+struct slot
+{
+	uint64_t hash;
+	uint64_t off;	/* of the record, EMPTY or DELETED */
+};
+
+struct tags_log::files
+{
+	int log_fd = -1;
+	const char *log = (const char *)MAP_FAILED;	/* LOG_MAP bytes */
+	bool own_log = true;	/* an index that replaced this one has it now */
+	idx_header *idx = (idx_header *)MAP_FAILED;
+	size_t idx_size = 0;
+
+	slot *slots() const { return (slot *)(idx + 1); }
+
+	~files()
+	{
+		if (idx != MAP_FAILED) munmap (idx, idx_size);
+		if (!own_log) return;
+		if (log != MAP_FAILED) munmap ((void *)log, LOG_MAP);
+		if (log_fd != -1) close (log_fd);
+	}
+};
+typedef tags_log::files files;
+
+static uint64_t hash (const char *p, size_t n, uint64_t h = 0xcbf29ce484222325ULL)
+{
+	for (size_t i = 0; i < n; i++) h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+static size_t rec_size (const uint32_t key_len, const uint32_t val_len)
+{
+	return (sizeof(rec_header) + key_len + val_len + 7) & ~(size_t)7;
+}
+
+/* The record at off, if it is a whole one before end. */
+static const rec_header *record (const files &f, const uint64_t off,
+		const uint64_t end)
+{
+	if (off < sizeof(log_header) || off % 8 || off + sizeof(rec_header) > end)
+		return NULL;
+
+	auto *r = (const rec_header *)(f.log + off);
+	if (r->magic != REC_MAGIC || off + rec_size(r->key_len, r->val_len) > end)
+		return NULL;
+	return r;
+}
+
+static const char *rec_key (const rec_header *r) { return (const char *)(r + 1); }
+static const char *rec_val (const rec_header *r) { return rec_key(r) + r->key_len; }
+
+static uint32_t rec_check (const rec_header *r)
+{
+	return hash (rec_key(r), r->key_len + r->val_len);
+}
+
+/* Find the slot of the key, or the empty one where it would go. off is
+ * what the slot had when it was checked; without the write mutex it may
+ * have changed since. */
+static slot *find (const files &f, const uint64_t h, const char *key,
+		const uint32_t n, uint64_t &off)
+{
+	const uint64_t mask = f.idx->slots - 1;
+	const uint64_t end = __atomic_load_n (&f.idx->log_end, __ATOMIC_ACQUIRE);
+	slot *s = f.slots();
+
+	for (uint64_t i = h & mask; ; i = (i + 1) & mask) {
+		off = __atomic_load_n (&s[i].off, __ATOMIC_ACQUIRE);
+		if (off == EMPTY) return &s[i];
+		if (off == DELETED || __atomic_load_n (&s[i].hash, __ATOMIC_RELAXED) != h)
+			continue;
+
+		auto *r = record (f, off, end);
+		if (r && r->key_len == n && !memcmp(rec_key(r), key, n))
+			return &s[i];
+	}
+}
+
+/* Point the index of f to the record at off, which is within log_end: its
+ * slot gets it, or is marked deleted if it is a removal. Without the write
+ * mutex, readers may be looking. */
+static void index_record (files &f, const uint64_t off)
+{
+	auto *r = (const rec_header *)(f.log + off);
+	const uint64_t h = hash (rec_key(r), r->key_len);
+	uint64_t old;
+	slot *s = find (f, h, rec_key(r), r->key_len, old);
+
+	if (old != EMPTY && old != DELETED) {
+		auto *o = (const rec_header *)(f.log + old);
+		f.idx->garbage += rec_size (o->key_len, o->val_len);
+	}
+	if (!r->val_len)
+		f.idx->garbage += rec_size (r->key_len, r->val_len);
+	if (!r->val_len && old == EMPTY)
+		return;
+
+	if (old == EMPTY) {
+		s->hash = h;
+		f.idx->used++;
+	}
+	__atomic_store_n (&s->off, r->val_len ? off : DELETED, __ATOMIC_RELEASE);
+}
+
+/* Put off into a slot of a new index that has no such key yet. */
+static void put_new (files &f, const uint64_t h, const uint64_t off)
+{
+	const uint64_t mask = f.idx->slots - 1;
+	slot *s = f.slots();
+
+	uint64_t i = h & mask;
+	while (s[i].off != EMPTY) i = (i + 1) & mask;
+	s[i].hash = h;
+	s[i].off = off;
+	f.idx->used++;
+}
+
+static uint64_t new_log_id ()
+{
+	struct timespec t;
+
+	clock_gettime (CLOCK_REALTIME, &t);
+	return ((uint64_t)t.tv_sec << 30 ^ t.tv_nsec) * 31 + getpid();
+}
+
+/* Create an empty index of the given size at path and map it into f. */
+static bool make_index (files &f, const str &path, const uint64_t log_id,
+		const uint64_t slots)
+{
+	const size_t size = sizeof(idx_header) + slots * sizeof(slot);
+
+	int fd = open (path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		log_errno ("Can't create the tags index", errno);
+		return false;
+	}
+	if (ftruncate(fd, size)) {
+		log_errno ("Can't create the tags index", errno);
+		close (fd);
+		return false;
+	}
+	void *p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (p == MAP_FAILED) {
+		log_errno ("Can't map the tags index", errno);
+		return false;
+	}
+
+	f.idx = (idx_header *)p;
+	f.idx_size = size;
+	memcpy (f.idx->magic, IDX_MAGIC, sizeof(IDX_MAGIC));
+	f.idx->version = TAGS_LOG_VERSION;
+	f.idx->log_id = log_id;
+	f.idx->log_end = sizeof(log_header);
+	f.idx->slots = slots;
+
+	return true;
+}
+
+/* Map the index at path into f if it belongs to the log. */
+static bool open_index (files &f, const str &path, const uint64_t log_id,
+		const uint64_t log_size)
+{
+	int fd = open (path.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0) return false;
+
+	struct stat st;
+	idx_header h;
+	bool ok = !fstat(fd, &st)
+		&& pread(fd, &h, sizeof(h), 0) == ssizeof(h)
+		&& !memcmp(h.magic, IDX_MAGIC, sizeof(IDX_MAGIC))
+		&& h.version == TAGS_LOG_VERSION
+		&& h.log_id == log_id
+		&& h.slots >= MIN_SLOTS && !(h.slots & (h.slots - 1))
+		&& (uint64_t)st.st_size == sizeof(h) + h.slots * sizeof(slot)
+		&& h.used < h.slots
+		&& h.log_end >= sizeof(log_header) && h.log_end <= log_size;
+
+	void *p = ok ? mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+		: MAP_FAILED;
+	close (fd);
+	if (p == MAP_FAILED) return false;
+
+	f.idx = (idx_header *)p;
+	f.idx_size = st.st_size;
+	return true;
+}
+
+static bool map_log (files &f)
+{
+	void *p = mmap (NULL, LOG_MAP, PROT_READ, MAP_SHARED, f.log_fd, 0);
+	if (p == MAP_FAILED) {
+		log_errno ("Can't map the tags log", errno);
+		return false;
+	}
+	f.log = (const char *)p;
+	return true;
+}
+
+/* Open the log and its index, starting new ones if they are missing or
+ * don't fit together. A log of TAGS_LOG_UPGRADABLE is moved aside to
+ * upgrade_from for upgrade(). */
+files *tags_log::open_files (str &upgrade_from)
+{
+	auto f = std::make_unique<files>();
+	const str log_path = options::run_file_path(TAGS_LOG_FILE);
+	const str idx_path = options::run_file_path(TAGS_INDEX_FILE);
+
+	f->log_fd = ::open (log_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (f->log_fd < 0) {
+		log_errno ("Can't open the tags log", errno);
+		throw std::runtime_error("Can't open the tags log");
+	}
+
+	struct stat st;
+	log_header lh;
+	bool ok = !fstat(f->log_fd, &st)
+		&& pread(f->log_fd, &lh, sizeof(lh), 0) == ssizeof(lh)
+		&& !memcmp(lh.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+
+	/* an upgrade that was interrupted, the records it got to are
+	 * converted again */
+	if (ok && lh.version == TAGS_LOG_VERSION
+			&& !access((log_path + ".old").c_str(), F_OK)) {
+		logit ("Resuming the upgrade of the tags log");
+		upgrade_from = log_path + ".old";
+	}
+
+	if (ok && lh.version == TAGS_LOG_UPGRADABLE) {
+		const str old_path = log_path + ".old";
+		if (rename(log_path.c_str(), old_path.c_str()))
+			log_errno ("Can't move the old tags log aside", errno);
+		else
+			upgrade_from = old_path;
+
+		close (f->log_fd);
+		f->log_fd = ::open (log_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (f->log_fd < 0) {
+			log_errno ("Can't open the tags log", errno);
+			throw std::runtime_error("Can't open the tags log");
+		}
+	}
+
+	if (!ok || lh.version != TAGS_LOG_VERSION) {
+		logit ("Preparing new tags log...");
+		memset (&lh, 0, sizeof(lh));
+		memcpy (lh.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+		lh.version = TAGS_LOG_VERSION;
+		lh.id = new_log_id ();
+		if (ftruncate(f->log_fd, 0)
+				|| pwrite(f->log_fd, &lh, sizeof(lh), 0) != ssizeof(lh)) {
+			log_errno ("Can't write the tags log", errno);
+			throw std::runtime_error("Can't write the tags log");
+		}
+		st.st_size = sizeof(lh);
+	}
+	if ((uint64_t)st.st_size > LOG_MAP)
+		throw std::runtime_error("The tags log is too big");
+	if (!map_log(*f))
+		throw std::runtime_error("Can't map the tags log");
+
+	if (!open_index(*f, idx_path, lh.id, st.st_size)) {
+		logit ("Rebuilding the tags index");
+		if (!make_index(*f, idx_path, lh.id, MIN_SLOTS))
+			throw std::runtime_error("Can't create the tags index");
+	}
+
+	return f.release();
+}
+
+/* Add the records between the end of what the index covers and end to the
+ * index. A torn record at the end, left by a crash, is cut off. */
+void tags_log::replay (const uint64_t end)
+{
+	files *f = cur;
+	uint64_t off = f->idx->log_end;
+	size_t n = 0;
+
+	while (off < end) {
+		auto *r = record (*f, off, end);
+		if (!r || rec_check(r) != r->check)
+			break;
+
+		if (f->idx->used * 2 >= f->idx->slots) {
+			grow ();
+			f = cur;
+		}
+
+		index_record (*f, off);
+		off += rec_size (r->key_len, r->val_len);
+		f->idx->log_end = off;
+		n++;
+	}
+
+	if (off < end) {
+		logit ("Cutting off %llu broken bytes of the tags log",
+				(unsigned long long)(end - off));
+		if (ftruncate(f->log_fd, off))
+			log_errno ("Can't truncate the tags log", errno);
+	}
+	if (n) logit ("Added %zu records to the tags index", n);
+}
+
+/* Read the string pool from its chunks in the log. */
+void tags_log::load_pool ()
+{
+	files *f = cur;
+
+	for (uint32_t chunk = 0; ; chunk++) {
+		const str key = string_pool::chunk_key (chunk);
+		uint64_t off;
+
+		find (*f, hash(key.data(), key.length()), key.data(), key.length(), off);
+		if (off == EMPTY || off == DELETED) break;
+
+		auto *r = (const rec_header *)(f->log + off);
+		if (!pool.load(chunk, rec_val(r), r->val_len)) break;
+	}
+}
+
+/* Convert the records of a TAGS_LOG_UPGRADABLE log at path into this one
+ * and remove it. */
+void tags_log::upgrade (const str &path)
+{
+	files old;
+	struct stat st;
+
+	logit ("Upgrading the tags log...");
+	old.log_fd = ::open (path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (old.log_fd < 0 || fstat(old.log_fd, &st)
+			|| (uint64_t)st.st_size > LOG_MAP || !map_log(old)) {
+		log_errno ("Can't read the old tags log", errno);
+		unlink (path.c_str());
+		return;
+	}
+
+	uint64_t off = sizeof(log_header);
+	size_t n = 0;
+	const rec_header *r;
+	while ((r = record(old, off, st.st_size)) && rec_check(r) == r->check) {
+		const str key (rec_key(r), r->key_len);
+		cache_record rec;
+
+		if (!r->val_len)
+			remove (key);
+		else if (cache_record_deserialize_v4(rec, rec_val(r), r->val_len)) {
+			add (key, rec);
+			n++;
+		}
+		off += rec_size (r->key_len, r->val_len);
+	}
+
+	if (unlink(path.c_str()))
+		log_errno ("Can't remove the old tags log", errno);
+	logit ("Converted %zu records of the old tags log", n);
+}
+
+/* Replace the index with one twice as big. Called with write_mtx held. */
+void tags_log::grow ()
+{
+	files *f = cur;
+	auto nf = std::make_unique<files>();
+	const str path = options::run_file_path(TAGS_INDEX_FILE);
+
+	if (!make_index(*nf, path + ".new", f->idx->log_id, f->idx->slots * 2))
+		return;
+
+	const slot *s = f->slots();
+	for (uint64_t i = 0; i < f->idx->slots; i++)
+		if (s[i].off != EMPTY && s[i].off != DELETED)
+			put_new (*nf, s[i].hash, s[i].off);
+	nf->idx->log_end = f->idx->log_end;
+	nf->idx->garbage = f->idx->garbage;
+
+	if (rename((path + ".new").c_str(), path.c_str())) {
+		log_errno ("Can't replace the tags index", errno);
+		return;
+	}
+
+	nf->log_fd = f->log_fd;
+	nf->log = f->log;
+	f->own_log = false;
+
+	debug ("Tags index grown to %llu slots", (unsigned long long)nf->idx->slots);
+	cur = nf.release ();
+	retired.push_back (f);
+	release_retired ();
+}
+
+/* Free replaced files nobody can be reading. Called with write_mtx held.
+ * A reader counts itself before it loads cur, so if none is counted after
+ * cur was changed, all of them will see the new one. */
+void tags_log::release_retired ()
+{
+	if (retired.empty() || readers) return;
+	for (auto *f : retired) delete f;
+	retired.clear ();
+}
+
+/* Write a record (a removal if len is 0) and point the index to it. Called
+ * with write_mtx held. */
+bool tags_log::append (const str &key, const char *val, const uint32_t len)
+{
+	files *f = cur;
+	if (f->idx->used * 2 >= f->idx->slots) {
+		grow ();
+		f = cur;
+		if (f->idx->used + 1 >= f->idx->slots) return false;
+	}
+
+	const uint64_t off = f->idx->log_end;
+	const size_t size = rec_size (key.length(), len);
+	static const char pad[8] = {};
+
+	if (off + size > LOG_MAP) {
+		error ("The tags log is full");
+		return false;
+	}
+
+	rec_header r;
+	r.magic = REC_MAGIC;
+	r.key_len = key.length();
+	r.val_len = len;
+	r.check = hash (val, len, hash (key.data(), key.length()));
+
+	struct iovec iov[4] = {
+		{ &r, sizeof(r) },
+		{ (void *)key.data(), key.length() },
+		{ (void *)val, len },
+		{ (void *)pad, size - sizeof(r) - key.length() - len }
+	};
+	if (pwritev(f->log_fd, iov, 4, off) != (ssize_t)size) {
+		log_errno ("Can't write to the tags log", errno);
+		return false;
+	}
+	__atomic_store_n (&f->idx->log_end, off + size, __ATOMIC_RELEASE);
+	index_record (*f, off);
+
+	if (f->idx->garbage >= COMPACT_MIN && f->idx->garbage * 2 > f->idx->log_end
+			&& !compact_wanted) {
+		compact_wanted = true;
+		pthread_cond_signal (&compact_cond);
+	}
+
+	return true;
+}
+
+/* Write the live records into a new log with a new index and switch to
+ * them. Called with write_mtx held, which is dropped while the records are
+ * copied: readers and writers go on using the old files, and what was
+ * written meanwhile is copied over at the end, under the mutex again. */
+void tags_log::compact ()
+{
+	files *f = cur;
+	const str log_path = options::run_file_path(TAGS_LOG_FILE);
+	const str idx_path = options::run_file_path(TAGS_INDEX_FILE);
+
+	/* not grow()'s ".new", it can run while we copy */
+	const str new_log = log_path + ".compact";
+	const str new_idx = idx_path + ".compact";
+
+	logit ("Compacting the tags log (%llu of %llu bytes are unused)",
+			(unsigned long long)f->idx->garbage,
+			(unsigned long long)f->idx->log_end);
+
+	/* copy in the order of the log, reading it sequentially */
+	std::vector<std::pair<uint64_t, uint64_t>> live; // offset, hash
+	const slot *s = f->slots();
+	for (uint64_t i = 0; i < f->idx->slots; i++)
+		if (s[i].off != EMPTY && s[i].off != DELETED)
+			live.emplace_back (s[i].off, s[i].hash);
+	std::sort (live.begin(), live.end());
+
+	/* Only we replace the log, so it stays mapped, and what is before
+	 * end doesn't change. f itself may be retired by grow(). */
+	const char *log = f->log;
+	const uint64_t end = f->idx->log_end;
+
+	log_header lh;
+	memset (&lh, 0, sizeof(lh));
+	memcpy (lh.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+	lh.version = TAGS_LOG_VERSION;
+	lh.id = new_log_id ();
+
+	auto nf = std::make_unique<files>();
+	uint64_t slots = MIN_SLOTS;
+	while (slots < live.size() * 4) slots *= 2;
+
+	nf->log_fd = ::open (new_log.c_str(),
+			O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (nf->log_fd < 0) {
+		log_errno ("Can't create the new tags log", errno);
+		return;
+	}
+	if (!make_index(*nf, new_idx, lh.id, slots)) {
+		unlink (new_log.c_str());
+		return;
+	}
+	if (!map_log(*nf)) {
+		unlink (new_log.c_str());
+		unlink (new_idx.c_str());
+		return;
+	}
+
+	UNLOCK (write_mtx);
+
+	std::vector<char> out;
+	out.reserve (COPY_CHUNK + sizeof(lh));
+	out.insert (out.end(), (const char *)&lh, (const char *)(&lh + 1));
+	uint64_t written = 0;
+	bool ok = true;
+
+	for (auto &l : live) {
+		auto *r = (const rec_header *)(log + l.first);
+		const size_t size = rec_size (r->key_len, r->val_len);
+
+		put_new (*nf, l.second, written + out.size());
+		out.insert (out.end(), (const char *)r, (const char *)r + size);
+		if (out.size() < COPY_CHUNK) continue;
+
+		ok = !compact_stop && pwrite(nf->log_fd, out.data(), out.size(), written) == (ssize_t)out.size();
+		if (!ok) break;
+		written += out.size();
+		out.clear ();
+	}
+	if (ok && !out.empty()) {
+		ok = pwrite(nf->log_fd, out.data(), out.size(), written) == (ssize_t)out.size();
+		written += out.size();
+	}
+	nf->idx->log_end = written;
+
+	/* the bulk of the syncing, the tail below adds little */
+	ok = ok && !fdatasync(nf->log_fd) && !msync(nf->idx, nf->idx_size, MS_SYNC);
+
+	LOCK (write_mtx);
+	f = cur;
+
+	/* what was written since the snapshot */
+	for (uint64_t off = end; ok && off < f->idx->log_end; ) {
+		auto *r = (const rec_header *)(log + off);
+		const size_t size = rec_size (r->key_len, r->val_len);
+
+		if (nf->idx->used * 2 >= nf->idx->slots) {
+			/* rare, garbage is left, so it's tried again */
+			logit ("Too much written while compacting the tags log");
+			ok = false;
+			break;
+		}
+		ok = pwrite(nf->log_fd, r, size, written) == (ssize_t)size;
+		if (!ok) break;
+		nf->idx->log_end = written + size;
+		index_record (*nf, written);
+		written += size;
+		off += size;
+	}
+
+	ok = ok && !compact_stop
+		&& !fdatasync(nf->log_fd) && !msync(nf->idx, nf->idx_size, MS_SYNC)
+		&& !rename(new_idx.c_str(), idx_path.c_str())
+		&& !rename(new_log.c_str(), log_path.c_str());
+	if (!ok) {
+		/* If only the index was replaced, it doesn't fit the log and
+		 * is rebuilt at start. Until then we go on with the old files,
+		 * and the log we write to is still the one that is kept. */
+		if (!compact_stop) log_errno ("Compacting the tags log failed", errno);
+		unlink (new_log.c_str());
+		unlink (new_idx.c_str());
+		return;
+	}
+
+	logit ("Tags log compacted to %llu bytes", (unsigned long long)written);
+	cur = nf.release ();
+	retired.push_back (f);
+	release_retired ();
+}
+
+void *tags_log::compact_thread (void *log_ptr)
+{
+	tags_log *t = (tags_log *)log_ptr;
+
+	LOCK (t->write_mtx);
+	while (true) {
+		while (!t->compact_stop && !t->compact_wanted)
+			pthread_cond_wait (&t->compact_cond, &t->write_mtx);
+		if (t->compact_stop) break;
+		t->compact ();
+		t->compact_wanted = false;
+	}
+	UNLOCK (t->write_mtx);
+
+	return NULL;
+}
+
+tags_log::tags_log ()
+: cur(NULL), readers(0), compact_wanted(false), compact_stop(false)
+{
+	pthread_mutex_init (&write_mtx, NULL);
+	for (auto &m : key_mtx) pthread_mutex_init (&m, NULL);
+	int rc = pthread_cond_init (&compact_cond, NULL);
+	if (rc != 0) fatal ("Can't create compact_cond: %s", xstrerror (rc));
+
+	str upgrade_from;
+	cur = open_files (upgrade_from);
+
+	struct stat st;
+	if (fstat(cur.load()->log_fd, &st))
+		throw std::runtime_error("Can't stat the tags log");
+	replay (st.st_size);
+	load_pool ();
+	if (!upgrade_from.empty())
+		upgrade (upgrade_from);
+	logit ("Tags log: %llu bytes, %llu index slots used",
+			(unsigned long long)cur.load()->idx->log_end,
+			(unsigned long long)cur.load()->idx->used);
+
+	files *f = cur;
+	compact_wanted = f->idx->garbage >= COMPACT_MIN
+		&& f->idx->garbage * 2 > f->idx->log_end;
+
+	rc = pthread_create (&compact_tid, NULL, compact_thread, this);
+	if (rc != 0) fatal ("Can't create tags log thread: %s", xstrerror (rc));
+}
+
+tags_log::~tags_log ()
+{
+	LOCK (write_mtx);
+	compact_stop = true;
+	pthread_cond_signal (&compact_cond);
+	UNLOCK (write_mtx);
+
+	int rc = pthread_join (compact_tid, NULL);
+	if (rc != 0) log_errno ("pthread_join() on tags log thread failed", rc);
+
+	files *f = cur;
+	if (msync(f->idx, f->idx_size, MS_SYNC))
+		log_errno ("Can't sync the tags index", errno);
+	if (fdatasync(f->log_fd))
+		log_errno ("Can't sync the tags log", errno);
+	delete f;
+	release_retired ();
+
+	pthread_mutex_destroy (&write_mtx);
+	for (auto &m : key_mtx) pthread_mutex_destroy (&m);
+	rc = pthread_cond_destroy (&compact_cond);
+	if (rc != 0) log_errno ("Can't destroy compact_cond", rc);
+}
+
+cache_record tags_log::get (const str &key)
+{
+	cache_record rec;
+	rec.mod_time = -1;
+
+	++readers;
+	files *f = cur;
+	uint64_t off;
+	find (*f, hash(key.data(), key.length()), key.data(), key.length(), off);
+	if (off != EMPTY && off != DELETED) {
+		/* find() checked it, the log doesn't change under it */
+		auto *r = (const rec_header *)(f->log + off);
+		if (!cache_record_deserialize(rec, rec_val(r), r->val_len, pool))
+			rec.mod_time = -1;
+	}
+	--readers;
+
+	return rec;
+}
+
+std::vector<cache_record> tags_log::get (const strings &keys)
+{
+	std::vector<cache_record> recs;
+	recs.reserve (keys.size());
+	for (auto &k : keys) recs.push_back (get(k));
+	return recs;
+}
+
+void tags_log::add (const str &key, const cache_record &rec)
+{
+	LOCK (write_mtx);
+	cache_record_serialize (rec, buf, pool);
+	/* new strings go first, so a record never has numbers the log lacks */
+	pool.save ([this] (const str &k, const std::vector<char> &data) {
+		append (k, data.data(), data.size());
+	});
+	append (key, buf.data(), buf.size());
+	release_retired ();
+	UNLOCK (write_mtx);
+}
+
+void tags_log::remove (const str &key)
+{
+	uint64_t off;
+
+	LOCK (write_mtx);
+	find (*cur.load(), hash(key.data(), key.length()), key.data(), key.length(), off);
+	if (off != EMPTY && off != DELETED) append (key, NULL, 0);
+	UNLOCK (write_mtx);
+}
+
+namespace {
+struct key_lock : tags_db::Lock
+{
+	key_lock(pthread_mutex_t &m) : m(m) { LOCK (m); }
+	~key_lock() { UNLOCK (m); }
+	pthread_mutex_t &m;
+};
+}
+
+std::unique_ptr<tags_db::Lock> tags_log::lock (const str &key)
+{
+	const uint64_t h = hash (key.data(), key.length());
+	return std::make_unique<key_lock>(key_mtx[h % 64]);
+}
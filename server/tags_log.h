@@ -0,0 +1,48 @@
+#pragma once
+#include "tags_db.h"
+#include <atomic>
+
+// Tags cache as an append-only log of records with a hash index (hash of
+// the path -> offset of its record) in a memory mapped file. Readers follow
+// the index into the mapped log without taking locks or copying the record
+// first; writers append under a mutex. Replaced and removed records stay in
+// the log until a background thread compacts it. Both files are kept over
+// restarts, so opening even a large cache only maps them.
+class tags_log : public tags_db
+{
+public:
+	tags_log();
+	~tags_log();
+
+	void add(const str &key, const cache_record &rec) override;
+	cache_record get(const str &key) override;
+	std::vector<cache_record> get(const strings &keys) override;
+	void remove(const str &key) override;
+	std::unique_ptr<Lock> lock(const str &key) override;
+
+	struct files; // a log with its index
+
+private:
+	std::atomic<files *> cur;
+	std::atomic<int> readers; // in get() right now
+	std::vector<files *> retired; // replaced, freed once there are no readers
+
+	pthread_mutex_t write_mtx; // for writing and everything below
+	std::vector<char> buf; // serialized record
+	bool compact_wanted;
+	std::atomic<bool> compact_stop; // also read while compacting
+	pthread_cond_t compact_cond;
+	pthread_t compact_tid;
+
+	pthread_mutex_t key_mtx[64]; // for lock(), by hash of the key
+
+	files *open_files(str &upgrade_from);
+	void replay(uint64_t end);
+	void load_pool();
+	void upgrade(const str &path);
+	bool append(const str &key, const char *val, uint32_t len);
+	void grow();
+	void compact();
+	void release_retired();
+	static void *compact_thread(void *log_ptr);
+};